@@ -0,0 +1,115 @@
+/*********
+calbench.c -- Micro-benchmark of the DATE-TIME decoder
+Times parseCalTime and calTimeUTC against the strptime and mktime path
+findDate took before caltime.c, over the same values, in the process
+time zone (set TZ to try others). Run with "make bench".
+********/
+
+#define _GNU_SOURCE     // for strptime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <assert.h>
+#include "calutil.h"
+#include "caltime.h"
+
+#define BENCH_VALUES 1000000    // values decoded per run, unless given
+#define VALUE_LEN 17            // YYYYMMDDTHHMMSSZ and its terminator
+
+/*
+Fill a table with DATE-TIME values from 1990 to 2030
+INPUT: table, how many, whether in order, whether UTC
+OUTPUT: NA
+*/
+void makeValues (char * values, int count, bool sorted, bool utc);
+
+/*
+Decode every value of a table one way
+INPUT: table, how many, whether by caltime (else strptime and mktime)
+OUTPUT: nanoseconds a value took
+*/
+double timeValues (const char * values, int count, bool caltime);
+
+/*
+Old findDate: strptime then mktime
+INPUT: value
+OUTPUT: seconds since epoche
+*/
+time_t oldDate (const char * value);
+
+volatile time_t benchSink;  // keeps the decoding from being optimised away
+
+int main (int argc, char ** argv) {
+    const char * names[] = {"random floating", "random UTC (Z)", "sorted floating"};
+    const bool sorted[] = {false, false, true};
+    const bool utc[] = {false, true, false};
+    const char * zone;
+    char * values;
+    int count = BENCH_VALUES;
+
+    if (argc > 1) {
+        count = atoi(argv[1]);
+    }
+    if (count < 1) {
+        fprintf(stderr,"usage: calbench [values]\n");
+        return 1;
+    }
+    values = malloc(sizeof(char)*VALUE_LEN*count);
+    assert(values != NULL);
+    zone = getenv("TZ");
+    printf("%d values, TZ %s, ns/value\n",count,zone == NULL ? "unset" : zone);
+    printf("%-18s %16s %8s\n","","strptime+mktime","caltime");
+    for (int i = 0; i < 3; i++) {
+        makeValues(values,count,sorted[i],utc[i]);
+        printf("%-18s %16.0f",names[i],timeValues(values,count,false));
+        printf(" %8.0f\n",timeValues(values,count,true));
+    }
+    free(values);
+    return 0;
+}
+
+void makeValues (char * values, int count, bool sorted, bool utc) {
+    const time_t first = 631152000;     // 1990-01-01
+    const time_t span = 1893456000 - first;     // to 2030-01-01
+    struct tm when;
+    time_t at;
+
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        if (sorted) {
+            at = first + span/count*i;
+        } else {
+            at = first + (time_t)((double)rand()/RAND_MAX*span);
+        }
+        gmtime_r(&at,&when);
+        strftime(values+i*VALUE_LEN,VALUE_LEN,utc ? "%Y%m%dT%H%M%SZ" : "%Y%m%dT%H%M%S",&when);
+    }
+}
+
+double timeValues (const char * values, int count, bool caltime) {
+    struct timespec start, end;
+    const char * value;
+    CalTime t;
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for (int i = 0; i < count; i++) {
+        value = values+i*VALUE_LEN;
+        if (caltime) {
+            benchSink = parseCalTime(value,strlen(value),&t) == OK ? calTimeUTC(&t) : 0;
+        } else {
+            benchSink = oldDate(value);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    return ((end.tv_sec-start.tv_sec)*1e9 + (end.tv_nsec-start.tv_nsec))/count;
+}
+
+time_t oldDate (const char * value) {
+    struct tm timeStruct = {.tm_mday = 1};
+
+    strptime(value,"%Y%m%dT%H%M%S",&timeStruct);
+    timeStruct.tm_isdst = -1;
+    return mktime(&timeStruct);
+}
@@ -4,22 +4,147 @@ Last Modified: 330pm April 6, 2016
 Geofferson Camp (gcamp@mail.uoguelph.ca)
 0658817
 
-- Added ability to parse organizers, locations, and priorities for A4 
+- Added ability to parse organizers, locations, and priorities for A4
+- readFile returns a Calendar wrapping the C tree; its components and
+  properties become python strings only when asked for
+- Files are read and written with the GIL released; readFileAsync reads
+  on a thread of its own
+- readBuffer and writeBuffer parse from, and write to, memory
+- info, extractEvents, extractProps, filter and combine run caltool's
+  functions on a Calendar already read, giving python values
+- eventColumns gives a calendar's events as columns of buffers, laid
+  out as Arrow arrays are
 ********************/
 
 #include <Python.h>
+#include <structmember.h>
+#include <pthread.h>
+#include <errno.h>
+#include <stdint.h>
 #include "calutil.h"
+#include "caltime.h"
+#include "caltool.h"
+
+/* Python types over a calendar tree. A Calendar owns a tree read by
+   readFile and frees it when the last reference to it goes. Component
+   and Property objects point into the tree and hold a reference to the
+   Calendar, so the tree outlives them; they're made as they're asked
+   for, and make their strings the same way. */
+
+typedef struct {
+    PyObject_HEAD
+    CalComp * comp;
+    PyObject * owner;   // Calendar the tree belongs to (NULL for a Calendar)
+} CalCompObject;
+
+typedef struct {
+    CalCompObject base;
+    int lines;          // lines read to make it (0 if made in memory)
+    CalIndex * index[2];    // date index of its events and todos, built by filter
+} CalendarObject;
+
+typedef struct {
+    PyObject_HEAD
+    CalProp * prop;
+    PyObject * owner;   // Calendar the tree belongs to
+} CalPropObject;
+
+/* A read started by readFileAsync. Its detached thread fills in cal,
+   status and errnum of a ReadState shared with the Reading, then sets
+   done; result() waits for that, and gives the Calendar (or raises)
+   from then on. Whichever of the two lets go of the state last frees
+   it, so a Reading dropped mid-read never waits for its thread. */
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+    int refs;           // the Reading's and the thread's (under lock)
+    bool done;          // thread has finished (under lock)
+    char * filename;
+    CalComp * cal;      // tree read, until it goes to a Calendar
+    CalStatus status;
+    int errnum;         // errno if the file didn't open, else 0
+} ReadState;
+
+typedef struct {
+    PyObject_HEAD
+    ReadState * state;
+    PyObject * calendar;    // Calendar made by result()
+} CalReadObject;
+
+/* One buffer of an eventColumns column: count items of one size, in
+   memory it owns, handed out read-only through the buffer protocol with
+   their struct format, so numpy.frombuffer and pyarrow.py_buffer use it
+   in place. A column is a tuple of these in Arrow's order: validity
+   bitmap (None if no value is missing), then int64 values for a date,
+   or int64 offsets and UTF-8 data for text (Arrow's large_string). A
+   missing date is also INT64_MIN, numpy's NaT. */
+
+typedef struct {
+    PyObject_HEAD
+    void * data;
+    Py_ssize_t count;
+    Py_ssize_t itemsize;
+    const char * format;    // "q" for int64, "B" for bytes
+} CalBufferObject;
+
+typedef enum {      // columns eventColumns fills from a VEVENT's properties
+    COL_DTSTART = 0,
+    COL_DTEND,      // DTEND, or DTSTART plus DURATION
+    COL_SUMMARY,
+    COL_ORGANIZER,  // ORGANIZER's CN, without quotes
+    COL_LOCATION,
+    NCOLUMNS,
+} EventColumn;
+
+#define NDATES 2    // columns before COL_SUMMARY are dates
+
+typedef struct {    // an event's text for one column, in the tree
+    const char * text;  // NULL if missing
+    size_t len;
+} EventText;
+
+static PyTypeObject ComponentType;
+static PyTypeObject CalendarType;
+static PyTypeObject PropertyType;
+static PyTypeObject ReadingType;
+static PyTypeObject BufferType;
 
 static PyObject * Cal_readFile(PyObject * self, PyObject * args);
+static PyObject * Cal_readFileAsync(PyObject * self, PyObject * args);
+static PyObject * Cal_readBuffer(PyObject * self, PyObject * args);
 static PyObject * Cal_writeFile(PyObject * self, PyObject * args);
-static PyObject * Cal_freeFile(PyObject * self, PyObject * args);
+static PyObject * Cal_writeBuffer(PyObject * self, PyObject * args);
+static PyObject * Cal_info(PyObject * self, PyObject * args);
+static PyObject * Cal_extractEvents(PyObject * self, PyObject * args);
+static PyObject * Cal_extractProps(PyObject * self, PyObject * args);
+static PyObject * Cal_filter(PyObject * self, PyObject * args);
+static PyObject * Cal_combine(PyObject * self, PyObject * args);
+static PyObject * Cal_eventColumns(PyObject * self, PyObject * args);
 
 //list of methods being exported
 static PyMethodDef CalMethods[] = {
-    {"readFile", Cal_readFile, METH_VARARGS, "opens file and returns pointer to cal"},
-    {"writeFile", Cal_writeFile, METH_VARARGS, "writes calComps to file"},
-    {"freeFile", Cal_freeFile, METH_VARARGS, "frees previously read iCal file"},
-    {NULL, NULL, 0, NULL}, 
+    {"readFile", Cal_readFile, METH_VARARGS, "reads an iCal file into a Calendar"},
+    {"readFileAsync", Cal_readFileAsync, METH_VARARGS,
+      "starts reading an iCal file on another thread; returns a Reading"},
+    {"readBuffer", Cal_readBuffer, METH_VARARGS,
+      "reads an iCal calendar from bytes, or any buffer, in place into a Calendar"},
+    {"writeFile", Cal_writeFile, METH_VARARGS, "writes a Calendar's components to file"},
+    {"writeBuffer", Cal_writeBuffer, METH_VARARGS, "writes a Calendar's components to bytes"},
+    {"info", Cal_info, METH_VARARGS,
+      "info(cal): dict of what caltool -info tells of a Calendar"},
+    {"extractEvents", Cal_extractEvents, METH_VARARGS,
+      "extractEvents(cal[, from[, next]]): list of (time, summary), as caltool -extract e"},
+    {"extractProps", Cal_extractProps, METH_VARARGS,
+      "extractProps(cal): list of X- property names, as caltool -extract x"},
+    {"filter", Cal_filter, METH_VARARGS,
+      "filter(cal, 'e' or 't'[, from[, to]]): new Calendar, as caltool -filter"},
+    {"combine", Cal_combine, METH_VARARGS,
+      "combine(cal1, cal2): (new Calendar, duplicates dropped), as caltool -combine"},
+    {"eventColumns", Cal_eventColumns, METH_VARARGS,
+      "eventColumns(cal): dict of length and dtstart, dtend, summary, organizer and location "
+      "columns over the calendar's VEVENTs, each a tuple of buffers in Arrow's order"},
+    {NULL, NULL, 0, NULL},
 };
 
 //module header definition
@@ -28,242 +153,1126 @@ static struct PyModuleDef CalModule = {
     "CalModule",
     NULL,
     -1,
-    CalMethods   
+    CalMethods
 };
 
-PyMODINIT_FUNC
-PyInit_CalModule (void) {
-    return PyModule_Create(&CalModule);
-}
+/*
+Wrap a component or property of a calendar
+INPUT: component/property, the Calendar owning it
+OUTPUT: new reference, NULL if out of memory
+*/
+PyObject * newCompObject (CalComp * comp, PyObject * owner);
+PyObject * newPropObject (CalProp * prop, PyObject * owner);
 
 /*
-Check if the component is in compList
+Make a python string of text from the tree; bytes that aren't UTF-8
+are replaced rather than failing the whole read
+INPUT: text (NULL gives None)
+OUTPUT: new reference
 */
-int checkIn (int index, PyObject * compList);
+PyObject * calString (const char * text);
+
+/*
+Find a component's first property of a name
+INPUT: component, uppercase name
+OUTPUT: property, NULL if there is none
+*/
+CalProp * findProp (CalComp * comp, const char * name);
+
+/*
+Read a calendar file, without touching python
+INPUT: file name, where to put the tree, errno if the file won't open
+OUTPUT: status of the read (IOERR if the file won't open)
+*/
+CalStatus readCalendar (const char * filename, CalComp ** pcal, int * errnum);
+
+/*
+Turn a finished read into a Calendar
+INPUT: what readCalendar or readCalBuffer gave (filename NULL for a buffer)
+OUTPUT: new reference, NULL with an exception set if the read failed
+*/
+PyObject * newCalendar (const char * filename, CalComp * cal, CalStatus status, int errnum);
+
+/*
+Read a date given to extractEvents or filter: None, seconds since the
+epoch, or text read as caltool reads from and to (with DATEMSK)
+INPUT: python value, whether it ends a range, where to put the time
+OUTPUT: 0 (time 0 for None), -1 with an exception set
+*/
+int dateArg (PyObject * arg, bool end, time_t * ptime);
+
+/*
+Make an eventColumns buffer, zeroed
+INPUT: no. of items, item size, struct format
+OUTPUT: new reference, NULL with an exception set if out of memory
+*/
+CalBufferObject * newBuffer (Py_ssize_t count, Py_ssize_t itemsize, const char * format);
+
+/*
+Find what a VEVENT gives each column
+INPUT: event, where to put its dates (0 if missing) and its text
+OUTPUT: NA
+*/
+void eventFields (CalComp * event, time_t dates[NDATES], EventText texts[NCOLUMNS-NDATES]);
+
+/*
+Body of a readFileAsync thread
+INPUT: its ReadState
+OUTPUT: NULL
+*/
+void * readingThread (void * arg);
+
+/*
+Let go of a ReadState, freeing it (and a tree nobody took) with the last
+INPUT: state
+OUTPUT: NA
+*/
+void releaseReadState (ReadState * state);
 
 /*
-Remove nulls from component comp list
+Work out what writeFile or writeBuffer writes: one component if the
+list has one index, else the calendar with the listed components
+INPUT: calendar, list of component indexes, shallow copy to set
+OUTPUT: component to write (NULL for a bad index); free *pshallow after
 */
-void removeNulls (CalComp * comp);
+CalComp * writeSelection (CalComp * cal, PyObject * compList, CalComp ** pshallow);
 
 /*
-Convert PyObject to integer
+Check if the component is in compList
 */
-int pyToInt (PyObject * intObj);
+int checkIn (int index, PyObject * compList);
+
+PyMODINIT_FUNC
+PyInit_CalModule (void) {
+    PyObject * module;
+
+    if (PyType_Ready(&ComponentType) < 0 || PyType_Ready(&CalendarType) < 0 ||
+      PyType_Ready(&PropertyType) < 0 || PyType_Ready(&ReadingType) < 0 ||
+      PyType_Ready(&BufferType) < 0) {
+        return NULL;
+    }
+    module = PyModule_Create(&CalModule);
+    if (module == NULL) {
+        return NULL;
+    }
+    Py_INCREF(&CalendarType);
+    Py_INCREF(&ComponentType);
+    Py_INCREF(&PropertyType);
+    Py_INCREF(&ReadingType);
+    Py_INCREF(&BufferType);
+    if (PyModule_AddObject(module,"Calendar",(PyObject *)&CalendarType) < 0 ||
+      PyModule_AddObject(module,"Component",(PyObject *)&ComponentType) < 0 ||
+      PyModule_AddObject(module,"Property",(PyObject *)&PropertyType) < 0 ||
+      PyModule_AddObject(module,"Reading",(PyObject *)&ReadingType) < 0 ||
+      PyModule_AddObject(module,"Buffer",(PyObject *)&BufferType) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
 
 //wrapper functions
 static PyObject * Cal_readFile (PyObject * self, PyObject * args) {
+    CalStatus status;
+    CalComp * cal = NULL;
     char * filename;
-    PyObject * result;
+    int errnum;
+
+    if (!PyArg_ParseTuple(args,"s",&filename)) {
+        return NULL;
+    }
+    //the tree is plain C until it's wrapped, so other threads can run
+    Py_BEGIN_ALLOW_THREADS
+    status = readCalendar(filename,&cal,&errnum);
+    Py_END_ALLOW_THREADS
+    return newCalendar(filename,cal,status,errnum);
+}
+
+static PyObject * Cal_readBuffer (PyObject * self, PyObject * args) {
+    CalStatus status;
     CalComp * cal = NULL;
+    PyObject * source;
+    Py_buffer view;
+
+    if (!PyArg_ParseTuple(args,"O",&source)) {
+        return NULL;
+    }
+    //held until the read is done, so a bytearray can't be resized under it
+    if (PyObject_GetBuffer(source,&view,PyBUF_SIMPLE) < 0) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    status = readCalBuffer(view.buf,view.len,&cal,0);
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&view);
+    return newCalendar(NULL,cal,status,0);
+}
+
+static PyObject * Cal_readFileAsync (PyObject * self, PyObject * args) {
+    CalReadObject * reading;
+    ReadState * state;
+    pthread_t thread;
+    char * filename;
+    int error;
+
+    if (!PyArg_ParseTuple(args,"s",&filename)) {
+        return NULL;
+    }
+    state = malloc(sizeof(ReadState));
+    if (state == NULL) {
+        return PyErr_NoMemory();
+    }
+    state->filename = malloc(strlen(filename)+1);
+    if (state->filename == NULL) {
+        free(state);
+        return PyErr_NoMemory();
+    }
+    strcpy(state->filename,filename);
+    pthread_mutex_init(&state->lock,NULL);
+    pthread_cond_init(&state->finished,NULL);
+    state->refs = 1;
+    state->done = false;
+    state->cal = NULL;
+    state->errnum = 0;
+    reading = PyObject_New(CalReadObject,&ReadingType);
+    if (reading == NULL) {
+        releaseReadState(state);
+        return NULL;
+    }
+    reading->state = state;
+    reading->calendar = NULL;
+    state->refs++;
+    if ((error = pthread_create(&thread,NULL,readingThread,state)) != 0) {
+        state->refs--;
+        Py_DECREF(reading);
+        errno = error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    pthread_detach(thread);
+    return (PyObject *)reading;
+}
+
+static PyObject * Cal_writeFile (PyObject * self, PyObject * args) {
+    CalStatus status = {.code = OK, .lineto = 0, .linefrom = 0};
     FILE * file;
-    PyObject * temp;
-    CalProp * holder = NULL;
-    CalProp * sumHolder = NULL;
-    CalProp * orgHolder = NULL;
-    CalParam * CNparam = NULL;
-    CalProp * seventhHolder = NULL;
-    CalProp * locHolder = NULL;
-    int found,foundOrg,foundLoc,foundSeventh;
-
-    if (PyTuple_Size(args) == 2 && PyArg_ParseTuple(args,"sO",&filename,&result)) {
-        file = fopen(filename,"r");
-        readCalFile(file,&cal);
-        temp = Py_BuildValue("k",cal);
-        PyList_Append(result, temp);
-        for (int i = 0; i < cal->ncomps; i++) {
-            found = 0;
-            foundOrg = 0;
-            foundLoc = 0;
-            foundSeventh = 0;
-            temp = Py_None;
-            temp = Py_BuildValue("s",cal->comp[i]->name);
-            PyList_Append(result,temp);
-            temp = Py_None;
-            temp = Py_BuildValue("i",cal->comp[i]->nprops);
-            PyList_Append(result,temp);
-            temp = Py_None;
-            temp = Py_BuildValue("i",cal->comp[i]->ncomps);
-            PyList_Append(result,temp);
-            holder = cal->comp[i]->prop;
-            while (holder != NULL) {
-                if (strcmp(holder->name,"SUMMARY") == 0) {
-                    found = 1;
-                    sumHolder = holder;
-                } else if (strcmp(holder->name,"ORGANIZER") == 0) {
-                    foundOrg = 1;
-                    orgHolder = holder;
-                } else if (strcmp(holder->name,"PRIORITY") == 0 && 
-                  strcmp("VTODO",cal->comp[i]->name) == 0) {
-                    seventhHolder = holder;
-                    foundSeventh = 1;
-                } else if (strcmp("DTSTART",holder->name) == 0) {
-                    foundSeventh = 1;
-                    seventhHolder = holder;
-                } else if (strcmp("LOCATION",holder->name) == 0) {
-                    foundLoc = 1;
-                    locHolder = holder;
-                }
-                holder = holder->next;
-            }
-            temp = Py_None;
-            if (found == 1) {
-                temp = Py_BuildValue("s",sumHolder->value);
-            } else {
-                temp = Py_BuildValue("s","");
-            }
-            PyList_Append(result,temp);
- 
-            //find organizer common name
-            temp = Py_None;
-            if (foundOrg == 1) {
-                CNparam = orgHolder->param;
-                while (CNparam != NULL) {
-                    if (strcmp(CNparam->name,"CN") == 0) {
-                        break;
-                    }
-                    CNparam = CNparam->next;
-                }
-                if (CNparam != NULL) {
-                    temp = Py_BuildValue("s",CNparam->value[0]);
-                } else {
-                    temp = Py_BuildValue("s","");
-                }
-            } else {
-                temp = Py_BuildValue("s","");
+    char * filename;
+    CalCompObject * calToWrite;
+    PyObject * compList;
+    CalComp * shallow = NULL;
+    CalComp * toWrite;
+    CalWriter writer;
+
+    if (!PyArg_ParseTuple(args,"sO!O!",&filename,&CalendarType,&calToWrite,
+      &PyList_Type,&compList)) {
+        return NULL;
+    }
+    if ((file = fopen(filename,"w")) == NULL) {
+        fprintf(stderr,"file did not open\n");
+        return Py_BuildValue("s","uh oh speghetti-o, write file didnt open");
+    }
+    //what to write is worked out with the GIL, and written without it
+    if ((toWrite = writeSelection(calToWrite->comp,compList,&shallow)) == NULL) {
+        PyErr_Clear();
+        status.code = NOCAL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if (toWrite != NULL) {
+        initCalWriter(&writer,file);
+        status = calWriteComp(&writer,toWrite);
+    }
+    fclose(file);
+    Py_END_ALLOW_THREADS
+    free(shallow);
+    if (status.code == OK) {
+        return Py_BuildValue ("i",status.lineto);
+    }
+    return Py_BuildValue ("i",-1);
+}
+
+static PyObject * Cal_writeBuffer (PyObject * self, PyObject * args) {
+    CalStatus status = {.code = OK, .lineto = 0, .linefrom = 0};
+    CalCompObject * calToWrite;
+    PyObject * compList;
+    PyObject * result;
+    CalComp * shallow = NULL;
+    CalComp * toWrite;
+    CalWriter writer;
+    FILE * file;
+    char * text = NULL;
+    size_t len = 0;
+
+    if (!PyArg_ParseTuple(args,"O!O!",&CalendarType,&calToWrite,&PyList_Type,&compList)) {
+        return NULL;
+    }
+    if ((toWrite = writeSelection(calToWrite->comp,compList,&shallow)) == NULL) {
+        return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if ((file = open_memstream(&text,&len)) != NULL) {
+        initCalWriter(&writer,file);
+        status = calWriteComp(&writer,toWrite);
+        if (fclose(file) != 0) {
+            status.code = IOERR;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    free(shallow);
+    if (file == NULL || status.code != OK) {
+        free(text);
+        return PyErr_NoMemory();
+    }
+    result = PyBytes_FromStringAndSize(text,len);
+    free(text);
+    return result;
+}
+
+CalComp * writeSelection (CalComp * cal, PyObject * compList, CalComp ** pshallow) {
+    CalComp * shallow;
+    long index;
+
+    *pshallow = NULL;
+    if (PyList_Size(compList) == 1) {
+        index = PyLong_AsLong(PyList_GetItem(compList,0));
+        if (index < 0 || index >= cal->ncomps) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_IndexError,"component index out of range");
             }
-            PyList_Append(result,temp);
+            return NULL;
+        }
+        return cal->comp[index];
+    }
+    if (PyList_Size(compList) >= cal->ncomps) {
+        return cal;
+    }
+    //the calendar with only the listed components, sharing its props
+    shallow = malloc(sizeof(CalComp)+sizeof(CalComp*)*cal->ncomps);
+    if (shallow == NULL) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    *shallow = *cal;
+    shallow->ncomps = 0;
+    for (int i = 0; i < cal->ncomps; i++) {
+        if (checkIn(i,compList) == 1) {
+            shallow->comp[shallow->ncomps] = cal->comp[i];
+            shallow->ncomps++;
+        }
+    }
+    *pshallow = shallow;
+    return shallow;
+}
+
+static PyObject * Cal_info (PyObject * self, PyObject * args) {
+    CalendarObject * cal;
+    InfoDetails details;
+    PyObject * organizers;
+    PyObject * name;
+    PyObject * from;
+    PyObject * to;
+
+    if (!PyArg_ParseTuple(args,"O!",&CalendarType,&cal)) {
+        return NULL;
+    }
+    //the GIL stays held: reading dates caches them in the tree
+    calInfoDetails(cal->base.comp,&details);
+    organizers = PyList_New(details.orgSize);
+    for (int i = 0; organizers != NULL && i < details.orgSize; i++) {
+        if ((name = calString(details.organizers[i])) == NULL) {
+            Py_CLEAR(organizers);
+        } else {
+            PyList_SET_ITEM(organizers,i,name);
+        }
+    }
+    freeInfoDetails(&details);
+    if (organizers == NULL) {
+        return NULL;
+    }
+    if (details.from == 0 && details.to == 0) {
+        from = Py_None;
+        to = Py_None;
+        Py_INCREF(from);
+        Py_INCREF(to);
+    } else {
+        from = PyLong_FromLongLong(details.from);
+        to = PyLong_FromLongLong(details.to);
+    }
+    return Py_BuildValue("{s:i,s:i,s:i,s:i,s:i,s:i,s:i,s:N,s:N,s:N}",
+      "lines",cal->lines,"components",cal->base.comp->ncomps,"events",details.events,
+      "todos",details.todos,"others",details.others,"subcomponents",details.subComps,
+      "properties",details.props,"from",from,"to",to,"organizers",organizers);
+}
+
+static PyObject * Cal_extractEvents (PyObject * self, PyObject * args) {
+    CalCompObject * cal;
+    PyObject * fromArg = Py_None;
+    PyObject * events;
+    PyObject * event;
+    ExtractEvent * list;
+    time_t from;
+    int limit = 0;
+    int count;
+
+    if (!PyArg_ParseTuple(args,"O!|Oi",&CalendarType,&cal,&fromArg,&limit)) {
+        return NULL;
+    }
+    if (dateArg(fromArg,false,&from) < 0) {
+        return NULL;
+    }
+    if (limit < 0) {
+        PyErr_SetString(PyExc_ValueError,"next must not be negative");
+        return NULL;
+    }
+    count = calExtractList(cal->comp,from,limit,&list);
+    events = PyList_New(count);
+    for (int i = 0; events != NULL && i < count; i++) {
+        if ((event = Py_BuildValue("(LN)",(long long)list[i].time,
+          calString(list[i].summary))) == NULL) {
+            Py_CLEAR(events);
+        } else {
+            PyList_SET_ITEM(events,i,event);
+        }
+    }
+    free(list);
+    return events;
+}
 
-            //find organizer contact
-            temp = Py_None;
-            if (foundOrg == 1) {
-                temp = Py_BuildValue("s",orgHolder->value);
+static PyObject * Cal_extractProps (PyObject * self, PyObject * args) {
+    CalCompObject * cal;
+    PyObject * names;
+    PyObject * name;
+    char ** list;
+    int count;
+
+    if (!PyArg_ParseTuple(args,"O!",&CalendarType,&cal)) {
+        return NULL;
+    }
+    count = calExtractX(cal->comp,&list);
+    names = PyList_New(count);
+    for (int i = 0; i < count; i++) {
+        if (names != NULL) {
+            if ((name = calString(list[i])) == NULL) {
+                Py_CLEAR(names);
             } else {
-                temp = Py_BuildValue("s","");
+                PyList_SET_ITEM(names,i,name);
             }
-            PyList_Append(result,temp);
+        }
+        free(list[i]);
+    }
+    free(list);
+    return names;
+}
 
-            //set priority or dtstart
-            temp = Py_None;
-            if (foundSeventh == 1) {
-                temp = Py_BuildValue("s",seventhHolder->value);
+static PyObject * Cal_filter (PyObject * self, PyObject * args) {
+    CalStatus status = {.code = OK, .lineto = 0, .linefrom = 0};
+    CalendarObject * cal;
+    PyObject * fromArg = Py_None;
+    PyObject * toArg = Py_None;
+    PyObject * filtered;
+    CalComp * copy;
+    CalOpt content;
+    char * kind;
+    int which;
+    time_t from, to;
+
+    if (!PyArg_ParseTuple(args,"O!s|OO",&CalendarType,&cal,&kind,&fromArg,&toArg)) {
+        return NULL;
+    }
+    if (strcmp(kind,"e") == 0) {
+        content = OEVENT;
+        which = 0;
+    } else if (strcmp(kind,"t") == 0) {
+        content = OTODO;
+        which = 1;
+    } else {
+        PyErr_SetString(PyExc_ValueError,"kind must be 'e' or 't'");
+        return NULL;
+    }
+    if (dateArg(fromArg,false,&from) < 0 || dateArg(toArg,true,&to) < 0) {
+        return NULL;
+    }
+    if (from != 0 && to != 0 && to < from) {
+        PyErr_SetString(PyExc_ValueError,"date error, 'to' before 'from'");
+        return NULL;
+    }
+    //the tree never changes, so its index is built on the first filter and kept
+    if (cal->index[which] == NULL) {
+        cal->index[which] = newCalIndex(cal->base.comp,content);
+    }
+    copy = calIndexComp(cal->index[which],from,to);
+    if ((filtered = newCalendar(NULL,copy,status,0)) == NULL) {
+        freeCalComp(copy);
+    }
+    return filtered;
+}
+
+static PyObject * Cal_combine (PyObject * self, PyObject * args) {
+    CalStatus status = {.code = OK, .lineto = 0, .linefrom = 0};
+    CalCompObject * cal1;
+    CalCompObject * cal2;
+    PyObject * combined;
+    CalComp * comp;
+    int dropped = 0;
+
+    if (!PyArg_ParseTuple(args,"O!O!",&CalendarType,&cal1,&CalendarType,&cal2)) {
+        return NULL;
+    }
+    comp = calCombineComp(cal1->comp,cal2->comp,&dropped);
+    if ((combined = newCalendar(NULL,comp,status,0)) == NULL) {
+        freeCalComp(comp);
+        return NULL;
+    }
+    return Py_BuildValue("(Ni)",combined,dropped);
+}
+
+static PyObject * Cal_eventColumns (PyObject * self, PyObject * args) {
+    CalCompObject * cal;
+    CalBufferObject * valid[NCOLUMNS] = {NULL};
+    CalBufferObject * values[NCOLUMNS] = {NULL};    // dates, or text offsets
+    CalBufferObject * data[NCOLUMNS] = {NULL};      // text bytes
+    Py_ssize_t nulls[NCOLUMNS] = {0};
+    Py_ssize_t bytes[NCOLUMNS] = {0};
+    PyObject * columns[NCOLUMNS];
+    PyObject * result = NULL;
+    EventText * texts;
+    EventText * text;
+    time_t dates[NDATES];
+    Py_ssize_t nevents = 0;
+    Py_ssize_t row = 0;
+    int64_t * offsets;
+    char * at;
+
+    if (!PyArg_ParseTuple(args,"O!",&CalendarType,&cal)) {
+        return NULL;
+    }
+    for (int i = 0; i < cal->comp->ncomps; i++) {
+        if (strcmp(cal->comp->comp[i]->name,"VEVENT") == 0) {
+            nevents++;
+        }
+    }
+    texts = malloc(sizeof(EventText)*(NCOLUMNS-NDATES)*(nevents > 0 ? nevents : 1));
+    if (texts == NULL) {
+        return PyErr_NoMemory();
+    }
+    for (int c = 0; c < NCOLUMNS; c++) {
+        valid[c] = newBuffer((nevents+7)/8,1,"B");
+        if (valid[c] == NULL || (c < NDATES && (values[c] = newBuffer(nevents,8,"q")) == NULL)) {
+            goto done;
+        }
+    }
+    //dates straight into their columns, text found and measured; the
+    //GIL stays held, as reading dates caches them in the tree
+    calUseZones(cal->comp);
+    for (int i = 0; i < cal->comp->ncomps; i++) {
+        if (strcmp(cal->comp->comp[i]->name,"VEVENT") != 0) {
+            continue;
+        }
+        text = texts+row*(NCOLUMNS-NDATES);
+        eventFields(cal->comp->comp[i],dates,text);
+        for (int c = 0; c < NCOLUMNS; c++) {
+            if (c < NDATES ? dates[c] != 0 : text[c-NDATES].text != NULL) {
+                ((unsigned char *)valid[c]->data)[row/8] |= 1 << row%8;
             } else {
-                temp = Py_BuildValue("s","");
+                nulls[c]++;
             }
-            PyList_Append(result,temp);
-
-            //set location contact
-            temp = Py_None;
-            if (foundLoc == 1) {
-                temp = Py_BuildValue("s",locHolder->value);
+            if (c < NDATES) {
+                ((int64_t *)values[c]->data)[row] = dates[c] != 0 ? dates[c] : INT64_MIN;
             } else {
-                temp = Py_BuildValue("s","");
+                bytes[c] = bytes[c] + text[c-NDATES].len;
             }
-            PyList_Append(result,temp);
+        }
+        row++;
+    }
+    //then each text column's bytes, end to end
+    for (int c = NDATES; c < NCOLUMNS; c++) {
+        if ((values[c] = newBuffer(nevents+1,8,"q")) == NULL ||
+          (data[c] = newBuffer(bytes[c],1,"B")) == NULL) {
+            goto done;
+        }
+        offsets = values[c]->data;
+        at = data[c]->data;
+        for (row = 0; row < nevents; row++) {
+            text = texts+row*(NCOLUMNS-NDATES)+c-NDATES;
+            offsets[row] = at-(char *)data[c]->data;
+            if (text->len > 0) {
+                memcpy(at,text->text,text->len);
+                at = at+text->len;
+            }
+        }
+        offsets[nevents] = at-(char *)data[c]->data;
+    }
+    for (int c = 0; c < NCOLUMNS; c++) {
+        columns[c] = nulls[c] > 0 ? (PyObject *)valid[c] : Py_None;
+    }
+    result = Py_BuildValue("{s:n,s:(OO),s:(OO),s:(OOO),s:(OOO),s:(OOO)}","length",nevents,
+      "dtstart",columns[COL_DTSTART],values[COL_DTSTART],
+      "dtend",columns[COL_DTEND],values[COL_DTEND],
+      "summary",columns[COL_SUMMARY],values[COL_SUMMARY],data[COL_SUMMARY],
+      "organizer",columns[COL_ORGANIZER],values[COL_ORGANIZER],data[COL_ORGANIZER],
+      "location",columns[COL_LOCATION],values[COL_LOCATION],data[COL_LOCATION]);
+done:
+    for (int c = 0; c < NCOLUMNS; c++) {
+        Py_XDECREF(valid[c]);
+        Py_XDECREF(values[c]);
+        Py_XDECREF(data[c]);
+    }
+    free(texts);
+    return result;
+}
 
+int checkIn (int index, PyObject * compList) {
+    for (int i = 0; i < PyList_Size(compList); i++) {
+        if (PyLong_AsLong(PyList_GetItem(compList,i)) == index) {
+            return 1;
         }
-        fclose(file);
-        return Py_BuildValue ("s", "OK");
     }
-    return NULL;
+    PyErr_Clear();
+    return 0;
 }
 
-static PyObject * Cal_writeFile (PyObject * self, PyObject * args) {
-    CalStatus status = {.code = OK, .lineto = 0, .linefrom = 0};
-    FILE * file;
-    char * filename;
-    int indexInt;
-    PyObject * calToWrite;
-    PyObject * compList;
-    PyObject * indexObj;
-    CalComp * shallow = NULL;
+//Component and Calendar
+static void Component_dealloc (CalCompObject * self) {
+    Py_XDECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-    if (PyTuple_Size(args) == 3 && PyArg_ParseTuple(
-      args, "skO", &filename, (unsigned long*)&calToWrite,&compList)) {
-        status.lineto = 0;
-        status.linefrom = 0;
-        if ((file = fopen(filename,"w")) == NULL) {
-            fprintf(stderr,"file did not open\n");
-            return Py_BuildValue("s","uh oh speghetti-o, write file didnt open");
+static void Calendar_dealloc (CalendarObject * self) {
+    for (int i = 0; i < 2; i++) {
+        if (self->index[i] != NULL) {
+            freeCalIndex(self->index[i]);
         }
-        if (PyList_Size(compList) == 1) {
-            //pyToInt
-            indexObj = PyList_GetItem(compList,0);
-            indexInt = pyToInt(indexObj);
-            status =  writeCalComp(file,((CalComp *)calToWrite)->comp[indexInt]); 
-        } else {
-            if (PyList_Size(compList) < ((CalComp *)calToWrite)->ncomps) {
-                shallow = (CalComp *)calToWrite;
-                for (int i = 0; i < shallow->ncomps; i++) {
-                    if (checkIn(i,compList) == 0) {
-                        shallow->comp[i] = NULL;
-                    } 
-                } 
-                removeNulls(shallow);
-                status = writeCalComp(file,shallow);
-            } else {
-                status =  writeCalComp(file,(CalComp *)calToWrite);
+    }
+    freeCalComp(self->base.comp);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * Component_name (CalCompObject * self, void * closure) {
+    return calString(self->comp->name);
+}
+
+static PyObject * Component_nprops (CalCompObject * self, void * closure) {
+    return PyLong_FromLong(self->comp->nprops);
+}
+
+static PyObject * Component_ncomps (CalCompObject * self, void * closure) {
+    return PyLong_FromLong(self->comp->ncomps);
+}
+
+static PyObject * Component_props (CalCompObject * self, void * closure) {
+    PyObject * owner = self->owner != NULL ? self->owner : (PyObject *)self;
+    PyObject * props;
+    PyObject * prop;
+
+    props = PyTuple_New(self->comp->nprops);
+    if (props == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < self->comp->nprops; i++) {
+        if ((prop = newPropObject(calCompProp(self->comp,i),owner)) == NULL) {
+            Py_DECREF(props);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(props,i,prop);
+    }
+    return props;
+}
+
+static PyObject * Component_prop (CalCompObject * self, PyObject * args) {
+    CalProp * prop;
+    char * name;
+
+    if (!PyArg_ParseTuple(args,"s",&name)) {
+        return NULL;
+    }
+    if ((prop = findProp(self->comp,name)) == NULL) {
+        Py_RETURN_NONE;
+    }
+    return newPropObject(prop,self->owner != NULL ? self->owner : (PyObject *)self);
+}
+
+static PyObject * Component_value (CalCompObject * self, PyObject * args) {
+    CalProp * prop;
+    char * name;
+    PyObject * missing = Py_None;
+
+    if (!PyArg_ParseTuple(args,"s|O",&name,&missing)) {
+        return NULL;
+    }
+    if ((prop = findProp(self->comp,name)) == NULL) {
+        Py_INCREF(missing);
+        return missing;
+    }
+    return calString(prop->value);
+}
+
+static Py_ssize_t Component_length (CalCompObject * self) {
+    return self->comp->ncomps;
+}
+
+static PyObject * Component_item (CalCompObject * self, Py_ssize_t i) {
+    if (i < 0 || i >= self->comp->ncomps) {
+        PyErr_SetString(PyExc_IndexError,"component index out of range");
+        return NULL;
+    }
+    return newCompObject(self->comp->comp[i],
+      self->owner != NULL ? self->owner : (PyObject *)self);
+}
+
+static PyGetSetDef ComponentGetSet[] = {
+    {"name", (getter)Component_name, NULL, "component name, uppercase", NULL},
+    {"nprops", (getter)Component_nprops, NULL, "no. of properties", NULL},
+    {"ncomps", (getter)Component_ncomps, NULL, "no. of subcomponents", NULL},
+    {"props", (getter)Component_props, NULL, "tuple of its Properties", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyMethodDef ComponentMethods[] = {
+    {"prop", (PyCFunction)Component_prop, METH_VARARGS,
+      "prop(NAME): first Property of that name, or None"},
+    {"value", (PyCFunction)Component_value, METH_VARARGS,
+      "value(NAME[, missing]): value of the first Property of that name, or missing (None)"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PySequenceMethods ComponentSequence = {
+    .sq_length = (lenfunc)Component_length,
+    .sq_item = (ssizeargfunc)Component_item,
+};
+
+static PyTypeObject ComponentType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "CalModule.Component",
+    .tp_doc = "component of a Calendar; len() and [] give its subcomponents",
+    .tp_basicsize = sizeof(CalCompObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .tp_dealloc = (destructor)Component_dealloc,
+    .tp_as_sequence = &ComponentSequence,
+    .tp_getset = ComponentGetSet,
+    .tp_methods = ComponentMethods,
+};
+
+static PyMemberDef CalendarMembers[] = {
+    {"lines", T_INT, offsetof(CalendarObject,lines), READONLY,
+      "lines read to make it (0 if made by filter or combine)"},
+    {NULL, 0, 0, 0, NULL},
+};
+
+static PyTypeObject CalendarType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "CalModule.Calendar",
+    .tp_doc = "calendar read by readFile; a Component owning its tree",
+    .tp_basicsize = sizeof(CalendarObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_base = &ComponentType,
+    .tp_dealloc = (destructor)Calendar_dealloc,
+    .tp_members = CalendarMembers,
+};
+
+//Property
+static void Property_dealloc (CalPropObject * self) {
+    Py_DECREF(self->owner);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static PyObject * Property_name (CalPropObject * self, void * closure) {
+    return calString(self->prop->name);
+}
+
+static PyObject * Property_value (CalPropObject * self, void * closure) {
+    return calString(self->prop->value);
+}
+
+static PyObject * Property_params (CalPropObject * self, void * closure) {
+    PyObject * params;
+    PyObject * values;
+    PyObject * value;
+    CalParam * param;
+
+    params = PyDict_New();
+    if (params == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < self->prop->nparams; i++) {
+        param = calPropParam(self->prop,i);
+        values = PyTuple_New(param->nvalues);
+        if (values == NULL) {
+            Py_DECREF(params);
+            return NULL;
+        }
+        for (int n = 0; n < param->nvalues; n++) {
+            if ((value = calString(param->value[n])) == NULL) {
+                Py_DECREF(values);
+                Py_DECREF(params);
+                return NULL;
             }
+            PyTuple_SET_ITEM(values,n,value);
         }
-        fclose(file);
-        if (status.code == OK) {
-            return Py_BuildValue ("i",status.lineto);
+        value = calString(param->name);
+        if (value == NULL || PyDict_SetItem(params,value,values) < 0) {
+            Py_XDECREF(value);
+            Py_DECREF(values);
+            Py_DECREF(params);
+            return NULL;
         }
+        Py_DECREF(value);
+        Py_DECREF(values);
     }
-    return Py_BuildValue ("i",-1);;
+    return params;
 }
 
-static PyObject * Cal_freeFile (PyObject * self, PyObject * args) {
-    CalComp * pcal = NULL;
+static PyObject * Property_param (CalPropObject * self, PyObject * args) {
+    CalParam * param;
+    char * name;
+    PyObject * missing = Py_None;
 
-    if (PyTuple_Size(args) == 1 && PyArg_ParseTuple(args, "k", (unsigned long *)&pcal)) {
-        freeCalComp(pcal);
-        return Py_BuildValue ("s", "OK");
+    if (!PyArg_ParseTuple(args,"s|O",&name,&missing)) {
+        return NULL;
     }
-    return NULL;
+    for (int i = 0; i < self->prop->nparams; i++) {
+        param = calPropParam(self->prop,i);
+        if (strcmp(param->name,name) == 0 && param->nvalues > 0) {
+            return calString(param->value[0]);
+        }
+    }
+    Py_INCREF(missing);
+    return missing;
 }
 
-int pyToInt (PyObject * intObj) {
-    PyObject * tempList;
-    PyObject * newTuple;
-    int toReturn;
+static PyGetSetDef PropertyGetSet[] = {
+    {"name", (getter)Property_name, NULL, "property name, uppercase", NULL},
+    {"value", (getter)Property_value, NULL, "property value", NULL},
+    {"params", (getter)Property_params, NULL, "dict of parameter name to tuple of values", NULL},
+    {NULL, NULL, NULL, NULL, NULL},
+};
+
+static PyMethodDef PropertyMethods[] = {
+    {"param", (PyCFunction)Property_param, METH_VARARGS,
+      "param(NAME[, missing]): first value of that parameter, or missing (None)"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject PropertyType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "CalModule.Property",
+    .tp_doc = "property of a component",
+    .tp_basicsize = sizeof(CalPropObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)Property_dealloc,
+    .tp_getset = PropertyGetSet,
+    .tp_methods = PropertyMethods,
+};
+
+//Reading
+static void Reading_dealloc (CalReadObject * self) {
+    //a read still going finishes on its own, and frees what it made
+    releaseReadState(self->state);
+    Py_XDECREF(self->calendar);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
 
-    tempList = PyList_New(1);
-    PyList_SetItem(tempList,0,intObj);
-    newTuple = PyList_AsTuple(tempList);
-    PyArg_ParseTuple(newTuple,"i",&toReturn);   
+static PyObject * Reading_done (CalReadObject * self, PyObject * args) {
+    bool done;
 
-    return toReturn; 
+    pthread_mutex_lock(&self->state->lock);
+    done = self->state->done;
+    pthread_mutex_unlock(&self->state->lock);
+    return PyBool_FromLong(done);
 }
 
-int checkIn (int index, PyObject * compList) {
-    PyObject * listObj;
-    int listInt = 0;
+static PyObject * Reading_result (CalReadObject * self, PyObject * args) {
+    ReadState * state = self->state;
 
-    for (int i = 0; i < PyList_Size(compList); i++) {
-        listObj = PyList_GetItem(compList,i);
-        listInt = pyToInt(listObj);
-        if (listInt == index) {
-            return 1;       
+    if (self->calendar == NULL) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&state->lock);
+        while (!state->done) {
+            pthread_cond_wait(&state->finished,&state->lock);
         }
+        pthread_mutex_unlock(&state->lock);
+        Py_END_ALLOW_THREADS
+        //the thread is done with the tree, so it's ours
+        self->calendar = newCalendar(state->filename,state->cal,state->status,state->errnum);
+        if (self->calendar == NULL) {
+            //a failed read raises again on every call
+            return NULL;
+        }
+        state->cal = NULL;
+    }
+    Py_INCREF(self->calendar);
+    return self->calendar;
+}
+
+static PyMethodDef ReadingMethods[] = {
+    {"done", (PyCFunction)Reading_done, METH_NOARGS, "whether the read has finished"},
+    {"result", (PyCFunction)Reading_result, METH_NOARGS,
+      "waits for the read, then gives the Calendar or raises as readFile would"},
+    {NULL, NULL, 0, NULL},
+};
+
+static PyTypeObject ReadingType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "CalModule.Reading",
+    .tp_doc = "a read started by readFileAsync",
+    .tp_basicsize = sizeof(CalReadObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)Reading_dealloc,
+    .tp_methods = ReadingMethods,
+};
+
+//Buffer
+static void Buffer_dealloc (CalBufferObject * self) {
+    free(self->data);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Buffer_getbuffer (CalBufferObject * self, Py_buffer * view, int flags) {
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError,"column buffers are read-only");
+        view->obj = NULL;
+        return -1;
     }
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = self->data;
+    view->len = self->count*self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) == PyBUF_FORMAT ? (char *)self->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) == PyBUF_ND ? &self->count : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
     return 0;
 }
 
-void removeNulls (CalComp * comp) {
-    int origSize = comp->ncomps;
+static Py_ssize_t Buffer_length (CalBufferObject * self) {
+    return self->count;
+}
+
+static PyBufferProcs BufferProcs = {
+    .bf_getbuffer = (getbufferproc)Buffer_getbuffer,
+};
+
+static PySequenceMethods BufferSequence = {
+    .sq_length = (lenfunc)Buffer_length,
+};
+
+static PyTypeObject BufferType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "CalModule.Buffer",
+    .tp_doc = "read-only buffer of an eventColumns column; len() gives its items",
+    .tp_basicsize = sizeof(CalBufferObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor)Buffer_dealloc,
+    .tp_as_buffer = &BufferProcs,
+    .tp_as_sequence = &BufferSequence,
+};
+
+void * readingThread (void * arg) {
+    ReadState * state = arg;
+
+    state->status = readCalendar(state->filename,&state->cal,&state->errnum);
+    pthread_mutex_lock(&state->lock);
+    state->done = true;
+    pthread_cond_broadcast(&state->finished);
+    pthread_mutex_unlock(&state->lock);
+    releaseReadState(state);
+    return NULL;
+}
+
+void releaseReadState (ReadState * state) {
+    bool last;
+
+    pthread_mutex_lock(&state->lock);
+    state->refs--;
+    last = state->refs == 0;
+    pthread_mutex_unlock(&state->lock);
+    if (last) {
+        if (state->cal != NULL) {
+            freeCalComp(state->cal);
+        }
+        pthread_cond_destroy(&state->finished);
+        pthread_mutex_destroy(&state->lock);
+        free(state->filename);
+        free(state);
+    }
+}
+
+CalStatus readCalendar (const char * filename, CalComp ** pcal, int * errnum) {
+    CalStatus status = {.code = IOERR, .linefrom = 0, .lineto = 0};
+    FILE * file;
+
+    *pcal = NULL;
+    *errnum = 0;
+    if ((file = fopen(filename,"r")) == NULL) {
+        *errnum = errno;
+        return status;
+    }
+    status = readCalFileParallel(file,pcal,0);
+    fclose(file);
+    return status;
+}
+
+PyObject * newCalendar (const char * filename, CalComp * cal, CalStatus status, int errnum) {
+    CalendarObject * calendar;
+
+    if (errnum != 0) {
+        errno = errnum;
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError,filename);
+    }
+    if (status.code != OK) {
+        return PyErr_Format(PyExc_ValueError,"read calendar failed with code:%d line %d",
+          status.code,status.lineto);
+    }
+    calendar = PyObject_New(CalendarObject,&CalendarType);
+    if (calendar == NULL) {
+        return NULL;
+    }
+    calendar->base.comp = cal;
+    calendar->base.owner = NULL;
+    calendar->lines = status.lineto;
+    calendar->index[0] = NULL;
+    calendar->index[1] = NULL;
+    return (PyObject *)calendar;
+}
+
+CalBufferObject * newBuffer (Py_ssize_t count, Py_ssize_t itemsize, const char * format) {
+    CalBufferObject * buffer;
+
+    buffer = PyObject_New(CalBufferObject,&BufferType);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->count = count;
+    buffer->itemsize = itemsize;
+    buffer->format = format;
+    //never empty, so the buffer is never NULL
+    buffer->data = calloc(count > 0 ? count : 1,itemsize);
+    if (buffer->data == NULL) {
+        Py_DECREF(buffer);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    return buffer;
+}
+
+void eventFields (CalComp * event, time_t dates[NDATES], EventText texts[NCOLUMNS-NDATES]) {
+    EventText * text;
+    CalProp * prop;
+    CalParam * param;
+    time_t duration = 0;
 
-    for (int i = 0; i < origSize; i++) {
-        for (int n = 0; n < comp->ncomps; n++) {
-            if (comp->comp[n] == NULL) {
-                for (int k = n; k < comp->ncomps; k++) {
-                    if (k != comp->ncomps-1) {
-                        comp->comp[k] = comp->comp[k+1];
+    dates[COL_DTSTART] = 0;
+    dates[COL_DTEND] = 0;
+    for (int c = NDATES; c < NCOLUMNS; c++) {
+        texts[c-NDATES].text = NULL;
+        texts[c-NDATES].len = 0;
+    }
+    for (int i = 0; i < event->nprops; i++) {
+        prop = calCompProp(event,i);
+        text = NULL;
+        if (prop->kind == PROP_DTSTART) {
+            dates[COL_DTSTART] = calPropTime(prop);
+        } else if (prop->kind == PROP_DTEND) {
+            dates[COL_DTEND] = calPropTime(prop);
+        } else if (prop->kind == PROP_DURATION && parseCalDuration(prop->value,&duration) != OK) {
+            duration = 0;
+        } else if (prop->kind == PROP_SUMMARY) {
+            text = &texts[COL_SUMMARY-NDATES];
+        } else if (prop->kind == PROP_LOCATION) {
+            text = &texts[COL_LOCATION-NDATES];
+        } else if (prop->kind == PROP_ORGANIZER) {
+            for (param = prop->param; param != NULL; param = param->next) {
+                if (param->kind == PARAM_CN && param->nvalues > 0 && 
+                  texts[COL_ORGANIZER-NDATES].text == NULL) {
+                    text = &texts[COL_ORGANIZER-NDATES];
+                    text->text = param->value[0];
+                    text->len = strlen(param->value[0]);
+                    if (text->len >= 2 && text->text[0] == '"' && text->text[text->len-1] == '"') {
+                        text->text++;
+                        text->len = text->len-2;
                     }
                 }
-                comp->ncomps -= 1;
             }
+            continue;
+        }
+        //the first of each is used, as caltool uses them
+        if (text != NULL && text->text == NULL) {
+            text->text = prop->value;
+            text->len = strlen(prop->value);
         }
     }
+    if (dates[COL_DTEND] == 0 && dates[COL_DTSTART] != 0 && duration > 0) {
+        dates[COL_DTEND] = dates[COL_DTSTART]+duration;
+    }
+}
+
+int dateArg (PyObject * arg, bool end, time_t * ptime) {
+    const char * text;
+    int dateErr;
+
+    *ptime = 0;
+    if (arg == Py_None) {
+        return 0;
+    }
+    if (PyLong_Check(arg)) {
+        *ptime = PyLong_AsLongLong(arg);
+        return PyErr_Occurred() ? -1 : 0;
+    }
+    if ((text = PyUnicode_AsUTF8(arg)) == NULL) {
+        return -1;
+    }
+    if ((*ptime = calParseDate(text,end,&dateErr)) == -1 && dateErr == DATE_NOMEM) {
+        PyErr_NoMemory();
+        return -1;
+    } else if (*ptime == -1) {
+        PyErr_SetString(PyExc_ValueError,calDateError(dateErr,text));
+        return -1;
+    }
+    return 0;
+}
+
+PyObject * newCompObject (CalComp * comp, PyObject * owner) {
+    CalCompObject * object;
+
+    object = PyObject_New(CalCompObject,&ComponentType);
+    if (object == NULL) {
+        return NULL;
+    }
+    object->comp = comp;
+    Py_INCREF(owner);
+    object->owner = owner;
+    return (PyObject *)object;
+}
+
+PyObject * newPropObject (CalProp * prop, PyObject * owner) {
+    CalPropObject * object;
+
+    object = PyObject_New(CalPropObject,&PropertyType);
+    if (object == NULL) {
+        return NULL;
+    }
+    object->prop = prop;
+    Py_INCREF(owner);
+    object->owner = owner;
+    return (PyObject *)object;
+}
+
+PyObject * calString (const char * text) {
+    if (text == NULL) {
+        Py_RETURN_NONE;
+    }
+    return PyUnicode_DecodeUTF8(text,strlen(text),"replace");
 }
 
+CalProp * findProp (CalComp * comp, const char * name) {
+    CalProp * prop;
+
+    for (int i = 0; i < comp->nprops; i++) {
+        prop = calCompProp(comp,i);
+        if (strcmp(prop->name,name) == 0) {
+            return prop;
+        }
+    }
+    return NULL;
+}
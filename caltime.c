@@ -0,0 +1,1715 @@
+/*********
+caltime.c -- Date and date-time values for iCalendar
+Decodes the fixed-width DATE and DATE-TIME forms of RFC 5545 by hand
+and turns them into epoch seconds with day arithmetic, so reading a
+date takes no locks and allocates nothing.
+********/
+
+#define _GNU_SOURCE     // for tm_gmtoff
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <strings.h>
+#include <assert.h>
+#include <pthread.h>
+#include "calutil.h"
+#include "caltime.h"
+
+#define DAY_SECS 86400L
+#define MAX_YEAR 9999       // recurrences stop after this year
+#define NWEEKDAYS 7
+#define ZONE_LAST_YEAR 2199 // VTIMEZONE rules are expanded to the end of this year
+#define MAX_CACHED_ZONES 256    // compiled zones kept for reuse
+#define ANY_ZONES ((unsigned long)-1)   // CalProp zones of a time read without them
+
+struct CalRecur {
+    CalRule rule;
+    bool hasRule;           // RRULE present and readable
+    CalTime start;          // DTSTART
+    time_t first;           // its instant
+    time_t until;           // UNTIL as an instant
+    int hour, minute, second;   // DTSTART's time of day, for parts not given
+    long firstPeriod;       // period holding DTSTART (see periodOf)
+    long period;            // period being read
+    long step;              // periods from one to the next
+    bool expanded;          // period's set has been worked out
+    time_t * set;           // wall times of the period's occurrences
+    int nset, nextSet, setRoom;
+    int counted;            // occurrences of the rule so far, for COUNT
+    bool startDone;         // DTSTART has been read
+    bool ruleDone;          // rule has no more occurrences
+    time_t bound;           // latest start calRecurNext was asked for, 0 for none
+    bool held;              // rule stopped at bound rather than ran out
+    bool peeked;
+    time_t peek;            // rule's next occurrence, once read ahead
+    time_t * rdates;        // RDATE instants, sorted
+    int nrdates, nextRdate, rdateRoom;
+    time_t * exdates;       // EXDATE and excluded instants, sorted
+    int nexdates, exdateRoom;
+    bool skipping;
+    time_t skipBefore;      // calRecurSkip's time
+    bool given;
+    time_t last;            // last time handed out
+    bool fixed;             // wall times are at offset (a VTIMEZONE rule)
+    long offset;
+};
+
+typedef struct CalZoneChange {
+    time_t at;              // instant of the change
+    long from, to;          // offsets east of UTC before and after it
+} CalZoneChange;
+
+struct CalZone {            // a VTIMEZONE compiled to its offset changes
+    char * tzid;
+    char * key;             // definition it was compiled from (see zoneKey)
+    unsigned long hash;     // of key
+    int nchanges;
+    CalZoneChange * changes;    // sorted by instant
+    int refs;               // the cache's and threads' (under zoneLock)
+    unsigned long used;     // zoneTick when last asked for
+};
+
+//compiled zones are shared by every calendar and thread; the cache keeps
+//the MAX_CACHED_ZONES last asked for, and a zone goes with its last reference
+static CalZone * zoneCache[MAX_CACHED_ZONES];
+static int nzoneCache;
+static unsigned long zoneTick;
+static pthread_mutex_t zoneLock = PTHREAD_MUTEX_INITIALIZER;
+
+//zones TZID values are read with on this thread (see calUseZones), and
+//which set that is: 0 for none, else a number no other set has had
+static _Thread_local CalZone ** zonesInUse;
+static _Thread_local int nzonesInUse, zonesInUseRoom;
+static _Thread_local unsigned long zoneSet;
+static unsigned long zoneSets;      // sets made so far (under zoneLock)
+
+static const char * const weekdayName[NWEEKDAYS] = {"MO","TU","WE","TH","FR","SA","SU"};
+static const char * const freqName[] = {"SECONDLY","MINUTELY","HOURLY","DAILY","WEEKLY",
+  "MONTHLY","YEARLY"};
+
+/*
+Read a run of decimal digits
+INPUT: text, number of digits
+OUTPUT: their value, -1 if any is not a digit
+*/
+int readDigits (const char * text, int n);
+
+/*
+Number of days in a month
+INPUT: year, month (1-12)
+OUTPUT: 28 to 31
+*/
+int monthDays (int year, int month);
+
+/*
+Offset of the process time zone from UTC
+INPUT: an instant
+OUTPUT: seconds east of UTC at that instant
+*/
+long localOffset (time_t when);
+
+/*
+Place a wall-clock time in the process time zone
+INPUT: seconds since 1970-01-01T00:00:00 on the local clock
+OUTPUT: the instant that clock shows them
+*/
+time_t localFromWall (time_t wall);
+
+/*
+TZID parameter of a property
+INPUT: property
+OUTPUT: its first value, NULL if none
+*/
+const char * propTzid (const CalProp * prop);
+
+/*
+Floor division and remainder, for times before 1970
+INPUT: dividend, divisor (> 0)
+OUTPUT: quotient rounded down, remainder 0 to divisor-1
+*/
+long floorDiv (long a, long b);
+long floorMod (long a, long b);
+
+/*
+Day of the week of a day number
+INPUT: days since 1970-01-01
+OUTPUT: 0 = Monday ... 6 = Sunday
+*/
+int weekdayOf (long days);
+
+/*
+Read a number, or a comma-separated list of them into a set, from an
+RRULE part
+INPUT: text, its length, lowest and highest value, whether negative
+       values count from the end, set and offset of value 0 in it
+OUTPUT: value (-1 if not a number) / SYNTAX if a value is out of range
+*/
+int readNumber (const char * text, int len);
+CalError readRuleList (const char * text, int len, int low, int high, bool negative, 
+  bool * set, int offset);
+
+/*
+Read an RRULE's BYDAY list
+INPUT: text, its length, rule
+OUTPUT: SYNTAX if an entry is not [+/-][n]XX
+*/
+CalError readRuleDays (const char * text, int len, CalRule * rule);
+
+/*
+Find a name in a table, ignoring case
+INPUT: table, its size, text, its length
+OUTPUT: index, -1 if not there
+*/
+int findWord (const char * const * table, int size, const char * text, int len);
+
+/*
+Set up a recurrence, optionally with its floating times read at a fixed
+offset rather than in the process time zone
+INPUT: component, whether the offset is used, seconds east of UTC
+OUTPUT: recurrence, NULL if DTSTART is missing or unreadable
+*/
+CalRecur * newRecur (const CalComp * comp, bool fixed, long offset);
+
+/*
+Place a recurrence's time on the time line
+INPUT: recurrence, time
+OUTPUT: its instant
+*/
+time_t recurInstant (const CalRecur * recur, const CalTime * t);
+
+/*
+Fill in what a rule takes from DTSTART and work out its stepping
+INPUT: recurrence with start and rule set
+OUTPUT: NA
+*/
+void initRule (CalRecur * recur);
+
+/*
+Check that a rule can land on a day its day parts allow, on a BYSETPOS
+position and, DAILY and below, on a time its BYSECOND, BYMINUTE, BYHOUR
+and BYDAY parts allow; periods INTERVAL apart can miss them all
+(FREQ=SECONDLY;INTERVAL=2;BYSECOND=1 from an even second)
+INPUT: recurrence after initRule
+OUTPUT: false if the rule can never give an occurrence
+*/
+bool ruleCanMatch (const CalRecur * recur);
+long gcdOf (long a, long b);
+
+/*
+Check that some day fits a rule's BYMONTH, BYMONTHDAY, BYYEARDAY,
+BYWEEKNO and BYDAY parts together (BYMONTH=2;BYMONTHDAY=30 has none)
+INPUT: rule, months its periods can reach ([1 = January]), NULL for all
+OUTPUT: false if no day does
+*/
+bool ruleHasDay (const CalRule * rule, const bool * months);
+
+/*
+Check that a BYSETPOS position is within the most times a period can
+hold (FREQ=DAILY;BYSETPOS=2 has one a day)
+INPUT: rule
+OUTPUT: false if none is
+*/
+bool ruleHasSetPos (const CalRule * rule);
+
+/*
+Number of values in a BYxxx set
+INPUT: set, its size
+OUTPUT: count
+*/
+int setCount (const bool * set, int size);
+
+/*
+Add the times a date list property gives to a sorted array
+INPUT: recurrence, property (RDATE or EXDATE), array, its length and room
+OUTPUT: NA
+*/
+void addPropTimes (const CalRecur * recur, const CalProp * prop, time_t ** ptimes, int * ntimes, 
+  int * room);
+
+/*
+Period holding a wall-clock time, and the wall-clock times a period
+covers: a year, month (year*12 + month-1), first day of a week, day,
+hour, minute or second, depending on FREQ
+INPUT: recurrence, wall time / period, start and end of it
+OUTPUT: period / NA
+*/
+long periodOf (const CalRecur * recur, time_t wall);
+void periodSpan (const CalRecur * recur, long period, time_t * from, time_t * to);
+
+/*
+Work out the occurrences of the current period, or move to the next
+period that may have some
+INPUT: recurrence
+OUTPUT: NA / false once past MAX_YEAR, UNTIL or the bound asked for
+*/
+void expandPeriod (CalRecur * recur);
+bool nextPeriod (CalRecur * recur);
+
+/*
+First hour, minute or second in a BYxxx set at or after one
+INPUT: set, value, size of the set
+OUTPUT: that value, size if there is none
+*/
+int nextInSet (const bool * set, int from, int size);
+
+/*
+Check a day against a rule's BYMONTH, BYWEEKNO, BYYEARDAY, BYMONTHDAY
+and BYDAY parts
+INPUT: rule, day number
+OUTPUT: true if the day is wanted
+*/
+bool dayMatches (const CalRule * rule, long day);
+bool weekMatches (const CalRule * rule, long day, int year);
+
+/*
+First day of week 1 of a year (the first week with 4 of its days)
+INPUT: year, week start
+OUTPUT: day number
+*/
+long firstWeek (int year, int wkst);
+
+/*
+Next occurrence of the rule itself, counting DTSTART as the first
+INPUT: recurrence, where to put the time
+OUTPUT: false when the rule has run out
+*/
+bool nextRule (CalRecur * recur, time_t * ptime);
+
+/*
+Order two times for qsort, and find a time in a sorted array
+INPUT: times / array, its length, time
+OUTPUT: <0, 0 or >0 / index of the first element not less than time
+*/
+int timeCompare (const void * a, const void * b);
+int timeSearch (const time_t * times, int n, time_t time);
+
+/*
+Text a zone's offsets depend on: its TZID and the properties of its
+STANDARD and DAYLIGHT parts
+INPUT: VTIMEZONE, where to put its TZID
+OUTPUT: malloced key, NULL if there is no TZID
+*/
+char * zoneKey (const CalComp * vtimezone, const char ** ptzid);
+
+/*
+Work out the offset changes of a VTIMEZONE up to ZONE_LAST_YEAR
+INPUT: VTIMEZONE, its TZID, key and hash
+OUTPUT: zone (takes key)
+*/
+CalZone * compileZone (const CalComp * vtimezone, const char * tzid, char * key, 
+  unsigned long hash);
+
+/*
+Find a compiled zone in the cache, or put one in, pushing out the one
+longest unused if it is full (call with zoneLock held)
+INPUT: VTIMEZONE, its TZID, key (taken) and hash
+OUTPUT: zone
+*/
+CalZone * cachedZone (const CalComp * vtimezone, const char * tzid, char * key, 
+  unsigned long hash);
+
+/*
+Drop a reference to a zone, freeing it with the last (call with zoneLock held)
+INPUT: zone
+OUTPUT: NA
+*/
+void releaseZone (CalZone * zone);
+
+/*
+Read a UTC offset, +HHMM or -HHMMSS
+INPUT: text
+OUTPUT: seconds east of UTC / SYNTAX
+*/
+CalError readOffset (const char * text, long * poffset);
+
+/*
+Order offset changes for qsort
+INPUT: two CalZoneChange
+OUTPUT: compare result
+*/
+int changeCompare (const void * a, const void * b);
+
+/*
+Find the zone in use for a TZID, and place a wall time in a zone
+INPUT: TZID / zone, seconds since 1970-01-01T00:00:00 on its clock
+OUTPUT: zone, NULL if none / instant
+*/
+const CalZone * findZone (const char * tzid);
+time_t zoneFromWall (const CalZone * zone, time_t wall);
+
+CalError parseCalTime(const char *const value, int len, CalTime *const t) {
+    int year, month, day;
+    int hour = 0, min = 0, sec = 0;
+
+    t->form = FORM_FLOATING;
+    t->tzid = NULL;
+    t->wall = 0;
+    if (len != 8 && len != 15 && len != 16) {
+        return SYNTAX;
+    }
+    year = readDigits(value,4);
+    month = readDigits(value+4,2);
+    day = readDigits(value+6,2);
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > monthDays(year,month)) {
+        return SYNTAX;
+    }
+    if (len == 8) {
+        t->form = FORM_DATE;
+    } else {
+        if (value[8] != 'T' && value[8] != 't') {
+            return SYNTAX;
+        }
+        hour = readDigits(value+9,2);
+        min = readDigits(value+11,2);
+        sec = readDigits(value+13,2);
+        if (hour < 0 || hour > 23 || min < 0 || min > 59 || sec < 0 || sec > 60) {
+            return SYNTAX;
+        }
+        if (len == 16) {
+            if (value[15] != 'Z' && value[15] != 'z') {
+                return SYNTAX;
+            }
+            t->form = FORM_UTC;
+        }
+    }
+    t->wall = (time_t)calDaysFromCivil(year,month,day)*DAY_SECS + hour*3600 + min*60 + sec;
+    return OK;
+}
+
+CalError calPropCalTime(const CalProp *const prop, CalTime *const t) {
+    CalError error;
+
+    error = parseCalTime(prop->value,strlen(prop->value),t);
+    if (error != OK || t->form != FORM_FLOATING) {
+        return error;
+    }
+    t->tzid = propTzid(prop);
+    if (t->tzid != NULL) {
+        t->form = FORM_TZID;
+    }
+    return OK;
+}
+
+const char * propTzid (const CalProp * prop) {
+    CalParam * param;
+    const char * tzid = NULL;
+
+    for (int i = 0; i < prop->nparams; i++) {
+        param = calPropParam(prop,i);
+        if (param->kind == PARAM_TZID && param->nvalues > 0) {
+            tzid = param->value[0];
+        }
+    }
+    return tzid;
+}
+
+CalError parseCalDuration(const char *const value, time_t *const psecs) {
+    const char * next = value;
+    time_t secs = 0;
+    long n;
+    int sign = 1;
+    int unit;
+    bool inTime = false;
+    bool any = false;
+
+    if (*next == '+' || *next == '-') {
+        sign = *next == '-' ? -1 : 1;
+        next++;
+    }
+    if (toupper((unsigned char)*next) != 'P') {
+        return SYNTAX;
+    }
+    next++;
+    while (*next != '\0') {
+        if (toupper((unsigned char)*next) == 'T' && !inTime) {
+            inTime = true;
+            next++;
+            continue;
+        }
+        if (!isdigit((unsigned char)*next)) {
+            return SYNTAX;
+        }
+        for (n = 0; isdigit((unsigned char)*next) && n < 100000000; next++) {
+            n = n*10 + *next-'0';
+        }
+        unit = toupper((unsigned char)*next);
+        switch (unit) {
+            case 'W':
+                secs = secs + n*7*DAY_SECS;
+                break;
+            case 'D':
+                secs = secs + n*DAY_SECS;
+                break;
+            case 'H':
+                secs = secs + n*3600;
+                break;
+            case 'M':
+                secs = secs + n*60;
+                break;
+            case 'S':
+                secs = secs + n;
+                break;
+            default:
+                return SYNTAX;
+        }
+        if (inTime != (unit == 'H' || unit == 'M' || unit == 'S')) {
+            return SYNTAX;
+        }
+        any = true;
+        next++;
+    }
+    if (!any) {
+        return SYNTAX;
+    }
+    *psecs = sign*secs;
+    return OK;
+}
+
+time_t calTimeUTC(const CalTime *const t) {
+    const CalZone * zone;
+
+    if (t->form == FORM_UTC) {
+        return t->wall;
+    }
+    if (t->form == FORM_TZID) {
+        zone = findZone(t->tzid);
+        if (zone != NULL) {
+            return zoneFromWall(zone,t->wall);
+        }
+    }
+    //a TZID with no VTIMEZONE is read in the local zone, like a floating time
+    return localFromWall(t->wall);
+}
+
+time_t calPropTime(CalProp *const prop) {
+    CalTime t;
+
+    //a TZID time depends on the zones in use, so it is kept for that set only
+    if (prop->timed && (prop->zones == ANY_ZONES || prop->zones == zoneSet)) {
+        return prop->time;
+    }
+    prop->time = 0;
+    prop->zones = ANY_ZONES;
+    if (prop->kind == PROP_DTSTART || prop->kind == PROP_DTEND || prop->kind == PROP_DUE ||
+      prop->kind == PROP_COMPLETED || prop->kind == PROP_CREATED || prop->kind == PROP_DTSTAMP ||
+      prop->kind == PROP_LAST_MODIFIED || prop->kind == PROP_RECURRENCE_ID) {
+        if (calPropCalTime(prop,&t) == OK) {
+            prop->time = calTimeUTC(&t);
+            if (t.form == FORM_TZID) {
+                prop->zones = zoneSet;
+            }
+        }
+    }
+    prop->timed = true;
+    return prop->time;
+}
+
+long calDaysFromCivil(int year, int month, int day) {
+    long era;
+    int yoe, doy, doe;
+
+    //count years from March so the leap day ends the year
+    if (month <= 2) {
+        year--;
+    }
+    era = (year >= 0 ? year : year-399) / 400;
+    yoe = year - era*400;
+    doy = (153*(month > 2 ? month-3 : month+9) + 2)/5 + day-1;
+    doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    return era*146097 + doe - 719468;
+}
+
+void calCivilFromDays(long days, int *const year, int *const month, int *const day) {
+    long era, doe, yoe, doy, mp;
+
+    days = days + 719468;
+    era = (days >= 0 ? days : days-146096) / 146097;
+    doe = days - era*146097;
+    yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    doy = doe - (365*yoe + yoe/4 - yoe/100);
+    mp = (5*doy + 2)/153;
+    *day = doy - (153*mp + 2)/5 + 1;
+    *month = mp < 10 ? mp+3 : mp-9;
+    *year = yoe + era*400 + (*month <= 2);
+}
+
+int readDigits(const char * text, int n) {
+    int value = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (text[i] < '0' || text[i] > '9') {
+            return -1;
+        }
+        value = value*10 + text[i]-'0';
+    }
+    return value;
+}
+
+int monthDays(int year, int month) {
+    static const int days[12] = {31,28,31,30,31,30,31,31,30,31,30,31};
+
+    if (month == 2 && year%4 == 0 && (year%100 != 0 || year%400 == 0)) {
+        return 29;
+    }
+    return days[month-1];
+}
+
+long localOffset(time_t when) {
+    struct tm timeStruct;
+
+    if (localtime_r(&when,&timeStruct) == NULL) {
+        return 0;
+    }
+    return timeStruct.tm_gmtoff;
+}
+
+static _Thread_local time_t zoneFrom = 1, zoneTo = 0;  // instants known to share zoneOffset
+static _Thread_local long zoneOffset;
+
+time_t localFromWall(time_t wall) {
+    long before, after;
+
+    if (wall-DAY_SECS >= zoneFrom && wall+DAY_SECS <= zoneTo) {
+        return wall - zoneOffset;
+    }
+    //a zone's offset is at most a day away from the wall clock, so these
+    //bracket any change that could touch this time; zones never change
+    //twice in two days, so the offset holds between them
+    before = localOffset(wall-DAY_SECS);
+    after = localOffset(wall+DAY_SECS);
+    if (before == after) {
+        if (before == zoneOffset && wall-DAY_SECS <= zoneTo && wall+DAY_SECS >= zoneFrom) {
+            //times are usually read in order, so reach on past this one
+            if (wall-DAY_SECS < zoneFrom) {
+                zoneFrom = localOffset(wall-3*DAY_SECS) == before ? wall-3*DAY_SECS : wall-DAY_SECS;
+            }
+            if (wall+DAY_SECS > zoneTo) {
+                zoneTo = localOffset(wall+3*DAY_SECS) == before ? wall+3*DAY_SECS : wall+DAY_SECS;
+            }
+        } else {
+            zoneFrom = wall-DAY_SECS;
+            zoneTo = wall+DAY_SECS;
+            zoneOffset = before;
+        }
+        return wall - before;
+    }
+    //across a change RFC 5545 3.3.5 takes the first of two repeated times,
+    //and reads a skipped time with the offset from before the gap
+    if (localOffset(wall-before) == before) {
+        if (localOffset(wall-after) == after && wall-after < wall-before) {
+            return wall - after;
+        }
+        return wall - before;
+    }
+    if (localOffset(wall-after) == after) {
+        return wall - after;
+    }
+    return wall - before;
+}
+
+long floorDiv(long a, long b) {
+    return a >= 0 ? a/b : -((-a+b-1)/b);
+}
+
+long floorMod(long a, long b) {
+    return a - floorDiv(a,b)*b;
+}
+
+int weekdayOf(long days) {
+    return floorMod(days+3,NWEEKDAYS);  //1970-01-01 was a Thursday
+}
+
+CalError parseCalRule(const char *const value, CalRule *const rule) {
+    const char * part = value;
+    const char * end;
+    const char * equals;
+    const char * text;
+    int nameLen, len, n, by;
+    CalError error = OK;
+    bool hasFreq = false;
+    bool hasDay;
+
+    memset(rule,0,sizeof(CalRule));
+    rule->interval = 1;
+    while (*part != '\0' && error == OK) {
+        end = strchr(part,';');
+        if (end == NULL) {
+            end = part + strlen(part);
+        }
+        equals = memchr(part,'=',end-part);
+        if (equals == NULL) {
+            return SYNTAX;
+        }
+        nameLen = equals-part;
+        text = equals+1;
+        len = end-text;
+        if (nameLen == 4 && strncasecmp(part,"FREQ",4) == 0) {
+            n = findWord(freqName,FREQ_YEARLY+1,text,len);
+            rule->freq = n;
+            hasFreq = n >= 0;
+            error = hasFreq ? OK : SYNTAX;
+        } else if (nameLen == 8 && strncasecmp(part,"INTERVAL",8) == 0) {
+            rule->interval = readNumber(text,len);
+            error = rule->interval > 0 ? OK : SYNTAX;
+        } else if (nameLen == 5 && strncasecmp(part,"COUNT",5) == 0) {
+            rule->count = readNumber(text,len);
+            error = rule->count > 0 ? OK : SYNTAX;
+        } else if (nameLen == 5 && strncasecmp(part,"UNTIL",5) == 0) {
+            error = parseCalTime(text,len,&rule->until);
+            rule->hasUntil = true;
+        } else if (nameLen == 4 && strncasecmp(part,"WKST",4) == 0) {
+            rule->wkst = findWord(weekdayName,NWEEKDAYS,text,len);
+            error = rule->wkst >= 0 ? OK : SYNTAX;
+        } else if (nameLen == 8 && strncasecmp(part,"BYSECOND",8) == 0) {
+            error = readRuleList(text,len,0,60,false,rule->second,0);
+            rule->by |= BY_SECOND;
+        } else if (nameLen == 8 && strncasecmp(part,"BYMINUTE",8) == 0) {
+            error = readRuleList(text,len,0,59,false,rule->minute,0);
+            rule->by |= BY_MINUTE;
+        } else if (nameLen == 6 && strncasecmp(part,"BYHOUR",6) == 0) {
+            error = readRuleList(text,len,0,23,false,rule->hour,0);
+            rule->by |= BY_HOUR;
+        } else if (nameLen == 5 && strncasecmp(part,"BYDAY",5) == 0) {
+            error = readRuleDays(text,len,rule);
+            rule->by |= BY_DAY;
+        } else if (nameLen == 10 && strncasecmp(part,"BYMONTHDAY",10) == 0) {
+            error = readRuleList(text,len,1,31,true,rule->monthday,31);
+            rule->by |= BY_MONTHDAY;
+        } else if (nameLen == 9 && strncasecmp(part,"BYYEARDAY",9) == 0) {
+            error = readRuleList(text,len,1,366,true,rule->yearday,366);
+            rule->by |= BY_YEARDAY;
+        } else if (nameLen == 8 && strncasecmp(part,"BYWEEKNO",8) == 0) {
+            error = readRuleList(text,len,1,53,true,rule->weekno,53);
+            rule->by |= BY_WEEKNO;
+        } else if (nameLen == 7 && strncasecmp(part,"BYMONTH",7) == 0) {
+            error = readRuleList(text,len,1,12,false,rule->month,0);
+            rule->by |= BY_MONTH;
+        } else if (nameLen == 8 && strncasecmp(part,"BYSETPOS",8) == 0) {
+            error = readRuleList(text,len,1,366,true,rule->setpos,366);
+            rule->by |= BY_SETPOS;
+        }
+        //other (x-name) parts are left alone
+        part = *end == '\0' ? end : end+1;
+    }
+    if (error != OK || !hasFreq || (rule->count > 0 && rule->hasUntil)) {
+        return SYNTAX;
+    }
+    //a rule no day can satisfy is as good as none; BYDAY is left to
+    //ruleCanMatch, as its ordinals only mean something once initRule has run
+    by = rule->by;
+    rule->by = rule->by & ~BY_DAY;
+    hasDay = ruleHasDay(rule,NULL);
+    rule->by = by;
+    return hasDay ? OK : SYNTAX;
+}
+
+int readNumber(const char * text, int len) {
+    if (len < 1 || len > 9) {
+        return -1;
+    }
+    return readDigits(text,len);
+}
+
+CalError readRuleList(const char * text, int len, int low, int high, bool negative, 
+  bool * set, int offset) {
+    const char * end = text+len;
+    const char * comma;
+    int sign, value;
+
+    while (text < end) {
+        comma = memchr(text,',',end-text);
+        if (comma == NULL) {
+            comma = end;
+        }
+        sign = 1;
+        if (*text == '+' || (*text == '-' && negative)) {
+            sign = *text == '-' ? -1 : 1;
+            text++;
+        }
+        value = readNumber(text,comma-text);
+        if (value < low || value > high) {
+            return SYNTAX;
+        }
+        set[sign*value+offset] = true;
+        text = comma < end ? comma+1 : end;
+    }
+    return OK;
+}
+
+CalError readRuleDays(const char * text, int len, CalRule * rule) {
+    const char * end = text+len;
+    const char * comma;
+    int sign, nth, day;
+
+    while (text < end) {
+        comma = memchr(text,',',end-text);
+        if (comma == NULL) {
+            comma = end;
+        }
+        sign = 1;
+        nth = 0;
+        if (*text == '+' || *text == '-') {
+            sign = *text == '-' ? -1 : 1;
+            text++;
+        }
+        if (comma-text > 2) {
+            nth = readNumber(text,comma-text-2);
+            if (nth < 1 || nth > 53) {
+                return SYNTAX;
+            }
+            text = comma-2;
+        }
+        day = findWord(weekdayName,NWEEKDAYS,text,comma-text);
+        if (day < 0 || (sign < 0 && nth == 0)) {
+            return SYNTAX;
+        }
+        if (nth == 0) {
+            rule->weekday[day] = true;
+        } else {
+            rule->nthday[sign*nth+53][day] = true;
+        }
+        text = comma < end ? comma+1 : end;
+    }
+    return OK;
+}
+
+int findWord(const char * const * table, int size, const char * text, int len) {
+    for (int i = 0; i < size; i++) {
+        if (strncasecmp(table[i],text,len) == 0 && table[i][len] == '\0') {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool calCompRecurs(const CalComp *const comp) {
+    CalProp * prop;
+
+    for (int i = 0; i < comp->nprops; i++) {
+        prop = calCompProp(comp,i);
+        if (prop->kind == PROP_RRULE || prop->kind == PROP_RDATE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+CalRecur * newCalRecur(const CalComp *const comp) {
+    return newRecur(comp,false,0);
+}
+
+CalRecur * newRecur(const CalComp * comp, bool fixed, long offset) {
+    CalRecur * recur;
+    CalProp * prop;
+    CalProp * dtstart = NULL;
+    CalProp * rrule = NULL;
+    CalTime start;
+
+    for (int i = 0; i < comp->nprops; i++) {
+        prop = calCompProp(comp,i);
+        if (prop->kind == PROP_DTSTART && dtstart == NULL) {
+            dtstart = prop;
+        } else if (prop->kind == PROP_RRULE && rrule == NULL) {
+            rrule = prop;
+        }
+    }
+    if (dtstart == NULL || calPropCalTime(dtstart,&start) != OK) {
+        return NULL;
+    }
+    recur = malloc(sizeof(CalRecur));
+    assert(recur != NULL);
+    memset(recur,0,sizeof(CalRecur));
+    recur->fixed = fixed;
+    recur->offset = offset;
+    recur->start = start;
+    recur->first = recurInstant(recur,&start);
+    recur->hasRule = rrule != NULL && parseCalRule(rrule->value,&recur->rule) == OK;
+    if (recur->hasRule) {
+        initRule(recur);
+        //one that can't is left with DTSTART alone, rather than searched to MAX_YEAR
+        recur->hasRule = ruleCanMatch(recur);
+    }
+    for (int i = 0; i < comp->nprops; i++) {
+        prop = calCompProp(comp,i);
+        if (prop->kind == PROP_RDATE) {
+            addPropTimes(recur,prop,&recur->rdates,&recur->nrdates,&recur->rdateRoom);
+        } else if (prop->kind == PROP_EXDATE) {
+            addPropTimes(recur,prop,&recur->exdates,&recur->nexdates,&recur->exdateRoom);
+        }
+    }
+    return recur;
+}
+
+time_t recurInstant(const CalRecur * recur, const CalTime * t) {
+    if (recur->fixed && t->form != FORM_UTC) {
+        return t->wall - recur->offset;
+    }
+    return calTimeUTC(t);
+}
+
+void initRule(CalRecur * recur) {
+    CalRule * rule = &recur->rule;
+    CalTime until;
+    long day;
+    int year, month, mday, weekday;
+
+    day = floorDiv(recur->start.wall,DAY_SECS);
+    calCivilFromDays(day,&year,&month,&mday);
+    weekday = weekdayOf(day);
+    recur->hour = (recur->start.wall - day*DAY_SECS)/3600;
+    recur->minute = (recur->start.wall - day*DAY_SECS)/60%60;
+    recur->second = (recur->start.wall - day*DAY_SECS)%60;
+    //parts a rule leaves out come from DTSTART (RFC 5545 3.3.10)
+    if (!(rule->by & (BY_DAY|BY_MONTHDAY|BY_YEARDAY|BY_WEEKNO))) {
+        if (rule->freq == FREQ_YEARLY) {
+            if (!(rule->by & BY_MONTH)) {
+                rule->month[month] = true;
+                rule->by |= BY_MONTH;
+            }
+            rule->monthday[mday+31] = true;
+            rule->by |= BY_MONTHDAY;
+        } else if (rule->freq == FREQ_MONTHLY) {
+            rule->monthday[mday+31] = true;
+            rule->by |= BY_MONTHDAY;
+        } else if (rule->freq == FREQ_WEEKLY) {
+            rule->weekday[weekday] = true;
+            rule->by |= BY_DAY;
+        }
+    }
+    //an ordinal only means something within a month or year
+    if (rule->freq != FREQ_MONTHLY && rule->freq != FREQ_YEARLY) {
+        for (int n = 0; n < 107; n++) {
+            for (int d = 0; d < NWEEKDAYS; d++) {
+                rule->weekday[d] = rule->weekday[d] || rule->nthday[n][d];
+            }
+        }
+    }
+    if (rule->hasUntil) {
+        until = rule->until;
+        if (until.form == FORM_DATE) {
+            until.wall = until.wall + DAY_SECS-1;
+            until.form = FORM_FLOATING;
+        }
+        if (until.form != FORM_UTC) {
+            until.form = recur->start.form == FORM_DATE ? FORM_FLOATING : recur->start.form;
+            until.tzid = recur->start.tzid;
+        }
+        recur->until = recurInstant(recur,&until);
+    }
+    recur->step = rule->freq == FREQ_WEEKLY ? rule->interval*NWEEKDAYS : rule->interval;
+    recur->firstPeriod = periodOf(recur,recur->start.wall);
+    recur->period = recur->firstPeriod;
+}
+
+bool ruleCanMatch(const CalRecur * recur) {
+    const CalRule * rule = &recur->rule;
+    time_t first, to, stride;
+    const time_t week = NWEEKDAYS*DAY_SECS;
+    bool months[13];
+
+    //months INTERVAL apart reach only some of the year's
+    for (int m = 1; m <= 12; m++) {
+        months[m] = floorMod(m-1 - recur->firstPeriod,gcdOf(recur->step,12)) == 0;
+    }
+    if (!ruleHasDay(rule,rule->freq == FREQ_MONTHLY ? months : NULL) || !ruleHasSetPos(rule)) {
+        return false;
+    }
+    if (rule->freq > FREQ_DAILY || !(rule->by & (BY_SECOND|BY_MINUTE|BY_HOUR|BY_DAY))) {
+        return true;
+    }
+    //the starts of the periods reached repeat each week, stride apart
+    periodSpan(recur,recur->firstPeriod,&first,&to);
+    stride = gcdOf(recur->step*(to-first),week);
+    for (time_t at = floorMod(first,stride); at < week; at = at+stride) {
+        if (rule->freq == FREQ_SECONDLY && (rule->by & BY_SECOND) && !rule->second[at%60]) {
+            continue;
+        }
+        if (rule->freq <= FREQ_MINUTELY && (rule->by & BY_MINUTE) && !rule->minute[at/60%60]) {
+            continue;
+        }
+        if (rule->freq <= FREQ_HOURLY && (rule->by & BY_HOUR) && !rule->hour[at/3600%24]) {
+            continue;
+        }
+        if ((rule->by & BY_DAY) && !rule->weekday[weekdayOf(at/DAY_SECS)]) {
+            continue;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool ruleHasDay(const CalRule * rule, const bool * months) {
+    long day;
+    int mlen;
+
+    if (months == NULL && !(rule->by & (BY_MONTH|BY_MONTHDAY|BY_YEARDAY|BY_WEEKNO))) {
+        return true;
+    }
+    //2001 to 2028 start on every weekday, leap year or not
+    for (int year = 2001; year <= 2028; year++) {
+        for (int month = 1; month <= 12; month++) {
+            if ((months != NULL && !months[month]) || ((rule->by & BY_MONTH) && !rule->month[month])) {
+                continue;
+            }
+            day = calDaysFromCivil(year,month,1);
+            mlen = monthDays(year,month);
+            for (int mday = 1; mday <= mlen; mday++) {
+                if ((rule->by & BY_MONTHDAY) && !rule->monthday[mday+31] && 
+                  !rule->monthday[mday-mlen-1+31]) {
+                    continue;
+                }
+                if (dayMatches(rule,day+mday-1)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+bool ruleHasSetPos(const CalRule * rule) {
+    const int days[] = {1, 1, 1, 1, NWEEKDAYS, 31, 366};
+    long most;
+
+    if (!(rule->by & BY_SETPOS)) {
+        return true;
+    }
+    most = days[rule->freq];
+    if (rule->freq >= FREQ_DAILY) {
+        most = most * ((rule->by & BY_HOUR) ? setCount(rule->hour,24) : 1);
+    }
+    if (rule->freq >= FREQ_HOURLY) {
+        most = most * ((rule->by & BY_MINUTE) ? setCount(rule->minute,60) : 1);
+    }
+    if (rule->freq >= FREQ_MINUTELY) {
+        most = most * ((rule->by & BY_SECOND) ? setCount(rule->second,61) : 1);
+    }
+    for (long n = 1; n <= 366 && n <= most; n++) {
+        if (rule->setpos[n+366] || rule->setpos[-n+366]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int setCount(const bool * set, int size) {
+    int count = 0;
+
+    for (int i = 0; i < size; i++) {
+        count = count + set[i];
+    }
+    return count;
+}
+
+long gcdOf(long a, long b) {
+    long r;
+
+    while (b != 0) {
+        r = a%b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+void addPropTimes(const CalRecur * recur, const CalProp * prop, time_t ** ptimes, int * ntimes, 
+  int * room) {
+    const char * text = prop->value;
+    const char * end;
+    const char * tzid;
+    CalTime t;
+    int len;
+
+    tzid = propTzid(prop);
+    while (*text != '\0') {
+        end = strchr(text,',');
+        if (end == NULL) {
+            end = text + strlen(text);
+        }
+        len = end-text;
+        //a PERIOD starts with its start time
+        if (memchr(text,'/',len) != NULL) {
+            len = (const char *)memchr(text,'/',len) - text;
+        }
+        if (parseCalTime(text,len,&t) == OK) {
+            if (t.form == FORM_FLOATING && tzid != NULL) {
+                t.form = FORM_TZID;
+                t.tzid = tzid;
+            }
+            if (*ntimes == *room) {
+                *room = *room == 0 ? 8 : *room*2;
+                *ptimes = realloc(*ptimes,sizeof(time_t)*(*room));
+                assert(*ptimes != NULL);
+            }
+            (*ptimes)[*ntimes] = recurInstant(recur,&t);
+            *ntimes = *ntimes + 1;
+        }
+        text = *end == '\0' ? end : end+1;
+    }
+    qsort(*ptimes,*ntimes,sizeof(time_t),timeCompare);
+}
+
+long periodOf(const CalRecur * recur, time_t wall) {
+    long day = floorDiv(wall,DAY_SECS);
+    int year, month, mday;
+
+    switch (recur->rule.freq) {
+        case FREQ_YEARLY:
+            calCivilFromDays(day,&year,&month,&mday);
+            return year;
+        case FREQ_MONTHLY:
+            calCivilFromDays(day,&year,&month,&mday);
+            return year*12L + month-1;
+        case FREQ_WEEKLY:
+            return day - floorMod(weekdayOf(day)-recur->rule.wkst,NWEEKDAYS);
+        case FREQ_DAILY:
+            return day;
+        case FREQ_HOURLY:
+            return floorDiv(wall,3600);
+        case FREQ_MINUTELY:
+            return floorDiv(wall,60);
+        default:
+            return wall;
+    }
+}
+
+void periodSpan(const CalRecur * recur, long period, time_t * from, time_t * to) {
+    int year, month;
+
+    switch (recur->rule.freq) {
+        case FREQ_YEARLY:
+            *from = calDaysFromCivil(period,1,1)*DAY_SECS;
+            *to = calDaysFromCivil(period+1,1,1)*DAY_SECS;
+            break;
+        case FREQ_MONTHLY:
+            year = floorDiv(period,12);
+            month = period - year*12L + 1;
+            *from = calDaysFromCivil(year,month,1)*DAY_SECS;
+            *to = *from + monthDays(year,month)*DAY_SECS;
+            break;
+        case FREQ_WEEKLY:
+            *from = period*DAY_SECS;
+            *to = *from + NWEEKDAYS*DAY_SECS;
+            break;
+        case FREQ_DAILY:
+            *from = period*DAY_SECS;
+            *to = *from + DAY_SECS;
+            break;
+        case FREQ_HOURLY:
+            *from = period*3600;
+            *to = *from + 3600;
+            break;
+        case FREQ_MINUTELY:
+            *from = period*60;
+            *to = *from + 60;
+            break;
+        default:
+            *from = period;
+            *to = period+1;
+    }
+}
+
+void expandPeriod(CalRecur * recur) {
+    CalRule * rule = &recur->rule;
+    time_t from, to, wall;
+    int hours[24], minutes[60], seconds[61];
+    int nhours = 0, nminutes = 0, nseconds = 0;
+    int kept = 0;
+
+    periodSpan(recur,recur->period,&from,&to);
+    recur->nset = 0;
+    recur->nextSet = 0;
+    recur->expanded = true;
+    //times of day: the rule's, else DTSTART's; below the FREQ only the period's own
+    for (int h = 0; h < 24; h++) {
+        if (rule->freq < FREQ_DAILY && h != floorMod(floorDiv(from,3600),24)) {
+            continue;
+        }
+        if ((rule->by & BY_HOUR) ? rule->hour[h] : rule->freq < FREQ_DAILY || h == recur->hour) {
+            hours[nhours++] = h;
+        }
+    }
+    for (int m = 0; m < 60; m++) {
+        if (rule->freq < FREQ_HOURLY && m != floorMod(floorDiv(from,60),60)) {
+            continue;
+        }
+        if ((rule->by & BY_MINUTE) ? rule->minute[m] : rule->freq < FREQ_HOURLY || m == recur->minute) {
+            minutes[nminutes++] = m;
+        }
+    }
+    for (int s = 0; s < 61; s++) {
+        if (rule->freq < FREQ_MINUTELY && s != floorMod(from,60)) {
+            continue;
+        }
+        if ((rule->by & BY_SECOND) ? rule->second[s] : rule->freq < FREQ_MINUTELY || s == recur->second) {
+            seconds[nseconds++] = s;
+        }
+    }
+    for (long day = floorDiv(from,DAY_SECS); day*DAY_SECS < to; day++) {
+        if (!dayMatches(rule,day)) {
+            continue;
+        }
+        for (int h = 0; h < nhours; h++) {
+            for (int m = 0; m < nminutes; m++) {
+                for (int s = 0; s < nseconds; s++) {
+                    wall = day*DAY_SECS + hours[h]*3600 + minutes[m]*60 + seconds[s];
+                    if (wall < from || wall >= to) {
+                        continue;
+                    }
+                    if (recur->nset == recur->setRoom) {
+                        recur->setRoom = recur->setRoom == 0 ? 16 : recur->setRoom*2;
+                        recur->set = realloc(recur->set,sizeof(time_t)*recur->setRoom);
+                        assert(recur->set != NULL);
+                    }
+                    recur->set[recur->nset++] = wall;
+                }
+            }
+        }
+    }
+    if (rule->by & BY_SETPOS) {
+        for (int i = 0; i < recur->nset; i++) {
+            if ((i < 366 && rule->setpos[i+1+366]) || 
+              (i-recur->nset >= -366 && rule->setpos[i-recur->nset+366])) {
+                recur->set[kept++] = recur->set[i];
+            }
+        }
+        recur->nset = kept;
+    }
+}
+
+bool nextPeriod(CalRecur * recur) {
+    CalRule * rule = &recur->rule;
+    time_t from, to, next;
+    long day;
+    int hour, minute;
+
+    if (recur->expanded) {
+        periodSpan(recur,recur->period,&from,&to);
+        next = to;
+        //below a day, jump over days, hours and minutes the rule can't use
+        if (recur->nset == 0 && rule->freq < FREQ_DAILY) {
+            day = floorDiv(from,DAY_SECS);
+            hour = floorMod(floorDiv(from,3600),24);
+            minute = floorMod(floorDiv(from,60),60);
+            if (!dayMatches(rule,day)) {
+                next = (day+1)*DAY_SECS;
+            } else if ((rule->by & BY_HOUR) && !rule->hour[hour]) {
+                next = day*DAY_SECS + nextInSet(rule->hour,hour,24)*3600L;
+            } else if ((rule->by & BY_MINUTE) && !rule->minute[minute]) {
+                next = floorDiv(from,3600)*3600 + nextInSet(rule->minute,minute,60)*60L;
+            } else if (rule->freq == FREQ_SECONDLY && (rule->by & BY_SECOND) && 
+              !rule->second[floorMod(from,60)]) {
+                next = floorDiv(from,60)*60 + nextInSet(rule->second,floorMod(from,60),60);
+            }
+        }
+        day = periodOf(recur,next) - recur->firstPeriod;
+        recur->period = recur->firstPeriod + (floorDiv(day-1,recur->step)+1)*recur->step;
+    }
+    periodSpan(recur,recur->period,&from,&to);
+    if (from >= calDaysFromCivil(MAX_YEAR+1,1,1)*DAY_SECS) {
+        return false;
+    }
+    //a wall time is within a day of its instant, so nothing here is before UNTIL
+    if (rule->hasUntil && from - DAY_SECS > recur->until) {
+        return false;
+    }
+    //past the bound the period is left unread, for a later call to go on from
+    if (recur->bound != 0 && from - DAY_SECS > recur->bound) {
+        recur->expanded = false;
+        recur->held = true;
+        return false;
+    }
+    expandPeriod(recur);
+    return true;
+}
+
+int nextInSet(const bool * set, int from, int size) {
+    while (from < size && !set[from]) {
+        from++;
+    }
+    return from;
+}
+
+bool dayMatches(const CalRule * rule, long day) {
+    int year, month, mday, weekday, yday, ylen, mlen;
+    int nth = 0, last = 0;
+
+    calCivilFromDays(day,&year,&month,&mday);
+    if ((rule->by & BY_MONTH) && !rule->month[month]) {
+        return false;
+    }
+    mlen = monthDays(year,month);
+    if ((rule->by & BY_MONTHDAY) && !rule->monthday[mday+31] && !rule->monthday[mday-mlen-1+31]) {
+        return false;
+    }
+    yday = day - calDaysFromCivil(year,1,1) + 1;
+    ylen = calDaysFromCivil(year+1,1,1) - calDaysFromCivil(year,1,1);
+    if ((rule->by & BY_YEARDAY) && !rule->yearday[yday+366] && !rule->yearday[yday-ylen-1+366]) {
+        return false;
+    }
+    if ((rule->by & BY_WEEKNO) && !weekMatches(rule,day,year)) {
+        return false;
+    }
+    if (rule->by & BY_DAY) {
+        weekday = weekdayOf(day);
+        if (rule->weekday[weekday]) {
+            return true;
+        }
+        //1FR is the first Friday of the month, or of the year with no BYMONTH
+        if (rule->freq == FREQ_MONTHLY || (rule->freq == FREQ_YEARLY && (rule->by & BY_MONTH))) {
+            nth = (mday-1)/7 + 1;
+            last = -((mlen-mday)/7 + 1);
+        } else if (rule->freq == FREQ_YEARLY) {
+            nth = (yday-1)/7 + 1;
+            last = -((ylen-yday)/7 + 1);
+        }
+        return nth != 0 && (rule->nthday[nth+53][weekday] || rule->nthday[last+53][weekday]);
+    }
+    return true;
+}
+
+long firstWeek(int year, int wkst) {
+    long jan1 = calDaysFromCivil(year,1,1);
+    int before = floorMod(weekdayOf(jan1)-wkst,NWEEKDAYS);
+
+    return before > 3 ? jan1-before+NWEEKDAYS : jan1-before;
+}
+
+bool weekMatches(const CalRule * rule, long day, int year) {
+    long start = firstWeek(year,rule->wkst);
+    int weeks, week;
+
+    //the first and last days of a year can be in the next or last year's weeks
+    if (day < start) {
+        year--;
+    } else if (day >= firstWeek(year+1,rule->wkst)) {
+        year++;
+    }
+    start = firstWeek(year,rule->wkst);
+    weeks = (firstWeek(year+1,rule->wkst) - start)/NWEEKDAYS;
+    week = (day-start)/NWEEKDAYS + 1;
+    return rule->weekno[week+53] || rule->weekno[week-weeks-1+53];
+}
+
+bool nextRule(CalRecur * recur, time_t * ptime) {
+    CalTime t = recur->start;
+
+    if (!recur->startDone) {
+        recur->startDone = true;
+        recur->counted = 1;
+        *ptime = recur->first;
+        return true;
+    }
+    if (!recur->hasRule) {
+        return false;
+    }
+    while (recur->rule.count == 0 || recur->counted < recur->rule.count) {
+        if (!recur->expanded || recur->nextSet == recur->nset) {
+            if (!nextPeriod(recur)) {
+                return false;
+            }
+            continue;
+        }
+        t.wall = recur->set[recur->nextSet++];
+        //DTSTART was the first occurrence whether or not the rule gives it
+        if (t.wall <= recur->start.wall) {
+            continue;
+        }
+        *ptime = recurInstant(recur,&t);
+        if (recur->rule.hasUntil && *ptime > recur->until) {
+            return false;
+        }
+        recur->counted++;
+        return true;
+    }
+    return false;
+}
+
+void calRecurSkip(CalRecur *const recur, time_t from) {
+    long target;
+    int n;
+
+    recur->skipping = true;
+    recur->skipBefore = from;
+    n = timeSearch(recur->rdates,recur->nrdates,from);
+    if (n > recur->nextRdate) {
+        recur->nextRdate = n;
+    }
+    //with a COUNT every occurrence before has to be counted, so no jumping
+    if (!recur->hasRule || recur->rule.count > 0) {
+        return;
+    }
+    //an instant's wall clock time is within a day of it
+    target = periodOf(recur,from - 2*DAY_SECS) - recur->firstPeriod;
+    if (target <= 0) {
+        return;
+    }
+    target = recur->firstPeriod + floorDiv(target,recur->step)*recur->step;
+    if (target > recur->period || !recur->expanded) {
+        recur->period = target;
+        recur->expanded = false;
+        recur->peeked = false;
+    }
+}
+
+bool calRecurNext(CalRecur *const recur, time_t to, time_t *const ptime) {
+    time_t time;
+    int n;
+
+    recur->bound = to;
+    while (true) {
+        if (!recur->peeked && !recur->ruleDone) {
+            recur->held = false;
+            recur->peeked = nextRule(recur,&recur->peek);
+            recur->ruleDone = !recur->peeked && !recur->held;
+        }
+        if (recur->peeked && (recur->nextRdate == recur->nrdates || 
+          recur->peek <= recur->rdates[recur->nextRdate])) {
+            time = recur->peek;
+            recur->peeked = false;
+        } else if (recur->nextRdate < recur->nrdates && (to == 0 || recur->peeked || 
+          recur->ruleDone || recur->rdates[recur->nextRdate] <= to)) {
+            time = recur->rdates[recur->nextRdate++];
+        } else {
+            return false;
+        }
+        if ((recur->given && time == recur->last) || (recur->skipping && time < recur->skipBefore)) {
+            continue;
+        }
+        n = timeSearch(recur->exdates,recur->nexdates,time);
+        if (n < recur->nexdates && recur->exdates[n] == time) {
+            continue;
+        }
+        recur->given = true;
+        recur->last = time;
+        *ptime = time;
+        return true;
+    }
+}
+
+void calRecurExclude(CalRecur *const recur, time_t time) {
+    int n;
+
+    if (recur->nexdates == recur->exdateRoom) {
+        recur->exdateRoom = recur->exdateRoom == 0 ? 8 : recur->exdateRoom*2;
+        recur->exdates = realloc(recur->exdates,sizeof(time_t)*recur->exdateRoom);
+        assert(recur->exdates != NULL);
+    }
+    n = timeSearch(recur->exdates,recur->nexdates,time);
+    memmove(recur->exdates+n+1,recur->exdates+n,sizeof(time_t)*(recur->nexdates-n));
+    recur->exdates[n] = time;
+    recur->nexdates++;
+}
+
+time_t calRecurLast(CalRecur *const recur) {
+    time_t time, last = 0;
+
+    if (!calRecurBounded(recur)) {
+        return 0;
+    }
+    //UNTIL caps a rule without walking it
+    if (recur->hasRule && recur->rule.hasUntil) {
+        last = recur->until > recur->first ? recur->until : recur->first;
+        if (recur->nrdates > 0 && recur->rdates[recur->nrdates-1] > last) {
+            last = recur->rdates[recur->nrdates-1];
+        }
+        return last;
+    }
+    while (calRecurNext(recur,0,&time)) {
+        last = time;
+    }
+    return last;
+}
+
+bool calRecurBounded(const CalRecur *const recur) {
+    return !recur->hasRule || recur->rule.count > 0 || recur->rule.hasUntil;
+}
+
+void freeCalRecur(CalRecur *const recur) {
+    free(recur->set);
+    free(recur->rdates);
+    free(recur->exdates);
+    free(recur);
+}
+
+int timeCompare(const void * a, const void * b) {
+    const time_t * first = a;
+    const time_t * second = b;
+
+    return *first < *second ? -1 : *first > *second;
+}
+
+int timeSearch(const time_t * times, int n, time_t time) {
+    int low = 0;
+    int high = n;
+    int mid;
+
+    while (low < high) {
+        mid = (low+high)/2;
+        if (times[mid] < time) {
+            low = mid+1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void calUseZones(const CalComp *const cal) {
+    pthread_mutex_lock(&zoneLock);
+    for (int i = 0; i < nzonesInUse; i++) {
+        releaseZone(zonesInUse[i]);
+    }
+    pthread_mutex_unlock(&zoneLock);
+    nzonesInUse = 0;
+    zoneSet = 0;
+    if (cal == NULL) {
+        free(zonesInUse);
+        zonesInUse = NULL;
+        zonesInUseRoom = 0;
+        return;
+    }
+    for (int i = 0; i < cal->ncomps; i++) {
+        if (strcmp(cal->comp[i]->name,"VTIMEZONE") == 0) {
+            calAddZone(cal->comp[i]);
+        }
+    }
+}
+
+void calAddZone(const CalComp *const vtimezone) {
+    CalZone * zone;
+    const char * tzid;
+    char * key;
+    unsigned long hash = 5381;
+    int n;
+
+    key = zoneKey(vtimezone,&tzid);
+    if (key == NULL) {
+        return;
+    }
+    for (const char * c = key; *c != '\0'; c++) {
+        hash = hash*33 ^ (unsigned char)*c;
+    }
+    //a later definition of a TZID replaces an earlier one
+    for (n = 0; n < nzonesInUse; n++) {
+        if (strcmp(zonesInUse[n]->tzid,tzid) == 0) {
+            break;
+        }
+    }
+    if (n == zonesInUseRoom) {
+        zonesInUseRoom = zonesInUseRoom == 0 ? 8 : zonesInUseRoom*2;
+        zonesInUse = realloc(zonesInUse,sizeof(CalZone*)*zonesInUseRoom);
+        assert(zonesInUse != NULL);
+    }
+    pthread_mutex_lock(&zoneLock);
+    zone = cachedZone(vtimezone,tzid,key,hash);
+    zone->refs++;
+    if (n < nzonesInUse) {
+        releaseZone(zonesInUse[n]);
+    }
+    zoneSet = ++zoneSets;
+    pthread_mutex_unlock(&zoneLock);
+    zonesInUse[n] = zone;
+    if (n == nzonesInUse) {
+        nzonesInUse++;
+    }
+}
+
+CalZone * cachedZone(const CalComp * vtimezone, const char * tzid, char * key, 
+  unsigned long hash) {
+    CalZone * zone;
+    int oldest = 0;
+
+    zoneTick++;
+    //calendars written by the same program mostly repeat the same zones
+    for (int i = 0; i < nzoneCache; i++) {
+        if (zoneCache[i]->hash == hash && strcmp(zoneCache[i]->key,key) == 0) {
+            free(key);
+            zoneCache[i]->used = zoneTick;
+            return zoneCache[i];
+        }
+        if (zoneCache[i]->used < zoneCache[oldest]->used) {
+            oldest = i;
+        }
+    }
+    zone = compileZone(vtimezone,tzid,key,hash);
+    zone->refs = 1;
+    zone->used = zoneTick;
+    if (nzoneCache < MAX_CACHED_ZONES) {
+        zoneCache[nzoneCache++] = zone;
+    } else {
+        //threads still using the one pushed out keep it until they're done
+        releaseZone(zoneCache[oldest]);
+        zoneCache[oldest] = zone;
+    }
+    return zone;
+}
+
+void releaseZone(CalZone * zone) {
+    zone->refs--;
+    if (zone->refs == 0) {
+        free(zone->tzid);
+        free(zone->key);
+        free(zone->changes);
+        free(zone);
+    }
+}
+
+char * zoneKey(const CalComp * vtimezone, const char ** ptzid) {
+    const CalComp * part;
+    CalProp * prop;
+    char * key;
+    size_t len;
+
+    *ptzid = NULL;
+    for (int i = 0; i < vtimezone->nprops; i++) {
+        prop = calCompProp(vtimezone,i);
+        if (prop->kind == PROP_TZID) {
+            *ptzid = prop->value;
+            break;
+        }
+    }
+    if (*ptzid == NULL) {
+        return NULL;
+    }
+    len = strlen(*ptzid)+1;
+    for (int i = 0; i < vtimezone->ncomps; i++) {
+        part = vtimezone->comp[i];
+        len = len + strlen(part->name)+1;
+        for (int j = 0; j < part->nprops; j++) {
+            prop = calCompProp(part,j);
+            len = len + strlen(prop->name)+strlen(prop->value)+2;
+        }
+    }
+    key = malloc(sizeof(char)*(len+1));
+    assert(key != NULL);
+    len = sprintf(key,"%s\n",*ptzid);
+    for (int i = 0; i < vtimezone->ncomps; i++) {
+        part = vtimezone->comp[i];
+        len = len + sprintf(key+len,"%s\n",part->name);
+        for (int j = 0; j < part->nprops; j++) {
+            prop = calCompProp(part,j);
+            len = len + sprintf(key+len,"%s:%s\n",prop->name,prop->value);
+        }
+    }
+    return key;
+}
+
+CalZone * compileZone(const CalComp * vtimezone, const char * tzid, char * key, 
+  unsigned long hash) {
+    CalZone * zone;
+    const CalComp * part;
+    CalProp * prop;
+    CalRecur * recur;
+    long from, to;
+    bool hasFrom, hasTo;
+    time_t at;
+    time_t end = (time_t)calDaysFromCivil(ZONE_LAST_YEAR+1,1,1)*DAY_SECS;
+    int room = 0;
+
+    zone = malloc(sizeof(CalZone));
+    assert(zone != NULL);
+    zone->tzid = malloc(sizeof(char)*(strlen(tzid)+1));
+    assert(zone->tzid != NULL);
+    strcpy(zone->tzid,tzid);
+    zone->key = key;
+    zone->hash = hash;
+    zone->nchanges = 0;
+    zone->changes = NULL;
+    for (int i = 0; i < vtimezone->ncomps; i++) {
+        part = vtimezone->comp[i];
+        if (strcmp(part->name,"STANDARD") != 0 && strcmp(part->name,"DAYLIGHT") != 0) {
+            continue;
+        }
+        hasFrom = false;
+        hasTo = false;
+        for (int j = 0; j < part->nprops; j++) {
+            prop = calCompProp(part,j);
+            if (prop->kind == PROP_TZOFFSETFROM) {
+                hasFrom = readOffset(prop->value,&from) == OK;
+            } else if (prop->kind == PROP_TZOFFSETTO) {
+                hasTo = readOffset(prop->value,&to) == OK;
+            }
+        }
+        //each onset is written on the clock in use before it
+        recur = hasFrom && hasTo ? newRecur(part,true,from) : NULL;
+        if (recur == NULL) {
+            continue;
+        }
+        while (calRecurNext(recur,end,&at) && at < end) {
+            if (zone->nchanges == room) {
+                room = room == 0 ? 16 : room*2;
+                zone->changes = realloc(zone->changes,sizeof(CalZoneChange)*room);
+                assert(zone->changes != NULL);
+            }
+            zone->changes[zone->nchanges].at = at;
+            zone->changes[zone->nchanges].from = from;
+            zone->changes[zone->nchanges].to = to;
+            zone->nchanges++;
+        }
+        freeCalRecur(recur);
+    }
+    qsort(zone->changes,zone->nchanges,sizeof(CalZoneChange),changeCompare);
+    return zone;
+}
+
+CalError readOffset(const char * text, long * poffset) {
+    int hours, minutes, seconds = 0;
+    int len = strlen(text);
+
+    if ((len != 5 && len != 7) || (text[0] != '+' && text[0] != '-')) {
+        return SYNTAX;
+    }
+    hours = readDigits(text+1,2);
+    minutes = readDigits(text+3,2);
+    if (len == 7) {
+        seconds = readDigits(text+5,2);
+    }
+    if (hours < 0 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 59) {
+        return SYNTAX;
+    }
+    *poffset = (text[0] == '-' ? -1 : 1) * (hours*3600L + minutes*60 + seconds);
+    return OK;
+}
+
+int changeCompare(const void * a, const void * b) {
+    const CalZoneChange * first = a;
+    const CalZoneChange * second = b;
+
+    return first->at < second->at ? -1 : first->at > second->at;
+}
+
+const CalZone * findZone(const char * tzid) {
+    for (int i = 0; i < nzonesInUse; i++) {
+        if (strcmp(zonesInUse[i]->tzid,tzid) == 0) {
+            return zonesInUse[i]->nchanges > 0 ? zonesInUse[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+time_t zoneFromWall(const CalZone * zone, time_t wall) {
+    const CalZoneChange * change;
+    int low = 0;
+    int high = zone->nchanges;
+    int mid;
+
+    //the new offset holds from the later of the two clock readings of a
+    //change: a repeated hour is read before it (its first occurrence) and
+    //a skipped one with the offset from before the gap (RFC 5545 3.3.5)
+    while (low < high) {
+        mid = (low+high)/2;
+        change = &zone->changes[mid];
+        if (change->at + (change->from > change->to ? change->from : change->to) <= wall) {
+            low = mid+1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return wall - zone->changes[0].from;
+    }
+    return wall - zone->changes[low-1].to;
+}
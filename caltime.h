@@ -0,0 +1,126 @@
+/*********************
+caltime.h - Prototypes and structures for caltime.c
+Date and date-time values (RFC 5545 3.3.4, 3.3.5) read straight from
+their fixed-width text, without strptime or mktime.
+********/
+
+#ifndef CALTIME_H
+#define CALTIME_H
+
+#include <time.h>
+#include "calutil.h"
+
+/* A decoded DATE or DATE-TIME. wall counts seconds from 1970-01-01
+   00:00:00 on the clock the value was written for; only a UTC value
+   is already an instant. calTimeUTC places a floating value with the
+   process time zone, and a TZID value with that TZID's VTIMEZONE (see
+   below), or the process time zone if it has none. */
+
+typedef enum {
+    FORM_FLOATING = 0,  // 19980118T230000: local wall-clock time
+    FORM_UTC,           // 19980119T070000Z
+    FORM_TZID,          // TZID=America/New_York:19980119T020000
+    FORM_DATE,          // VALUE=DATE:19970714, a whole (local) day
+} CalTimeForm;
+
+typedef struct CalTime {
+    CalTimeForm form;
+    time_t wall;        // seconds since 1970-01-01T00:00:00, wall clock
+    const char *tzid;   // TZID parameter value (FORM_TZID only)
+} CalTime;
+
+CalError parseCalTime( const char *const value, int len, CalTime *const t );
+CalError parseCalDuration( const char *const value, time_t *const psecs );
+CalError calPropCalTime( const CalProp *const prop, CalTime *const t );
+time_t calTimeUTC( const CalTime *const t );
+time_t calPropTime( CalProp *const prop );
+long calDaysFromCivil( int year, int month, int day );
+void calCivilFromDays( long days, int *const year, int *const month, int *const day );
+
+/* Recurrence (RFC 5545 3.3.10, 3.8.5). A CalRecur hands out the start
+   times of a component's occurrences in order, one at a time: DTSTART,
+   then those of its RRULE, merged with its RDATEs and less its EXDATEs.
+   Nothing is expanded ahead of the period being read, and without a
+   COUNT calRecurSkip moves straight to the period holding a time
+   rather than stepping there from DTSTART. Rules run on the wall clock
+   of DTSTART, so a 9:00 meeting stays at 9:00 across a clock change.
+   calRecurNext searches no further than the latest start it is given
+   (0 for none), so a rule that never gives one more costs no more than
+   the range asked for; past it, it may give false and go on from there
+   when asked again with a later one. A rule no day or time can satisfy
+   is read as no rule. calRecurLast gives the latest start a bounded
+   recurrence can have (UNTIL, or its last time once read through), 0
+   for an endless one. */
+
+typedef enum {
+    FREQ_SECONDLY = 0,
+    FREQ_MINUTELY,
+    FREQ_HOURLY,
+    FREQ_DAILY,
+    FREQ_WEEKLY,
+    FREQ_MONTHLY,
+    FREQ_YEARLY,
+} CalFreq;
+
+typedef enum {      // BYxxx parts present in a CalRule
+    BY_SECOND = 1,
+    BY_MINUTE = 2,
+    BY_HOUR = 4,
+    BY_DAY = 8,
+    BY_MONTHDAY = 16,
+    BY_YEARDAY = 32,
+    BY_WEEKNO = 64,
+    BY_MONTH = 128,
+    BY_SETPOS = 256,
+} CalByPart;
+
+typedef struct CalRule {    // a parsed RRULE; list parts are kept as sets
+    CalFreq freq;
+    int interval;
+    int count;              // 0 if not limited by COUNT
+    bool hasUntil;
+    CalTime until;
+    int wkst;               // week start, 0 = MO ... 6 = SU
+    int by;                 // CalByPart bits
+    bool second[61];
+    bool minute[60];
+    bool hour[24];
+    bool weekday[7];        // BYDAY without an ordinal, [0 = MO]
+    bool nthday[107][7];    // BYDAY with one, [n+53][weekday]
+    bool monthday[63];      // [n+31]
+    bool yearday[733];      // [n+366]
+    bool weekno[107];       // [n+53]
+    bool month[13];         // [1 = January]
+    bool setpos[733];       // [n+366]
+} CalRule;
+
+typedef struct CalRecur CalRecur;   // private to caltime.c
+
+CalError parseCalRule( const char *const value, CalRule *const rule );
+CalRecur *newCalRecur( const CalComp *const comp );
+void calRecurExclude( CalRecur *const recur, time_t time );
+void calRecurSkip( CalRecur *const recur, time_t from );
+bool calRecurNext( CalRecur *const recur, time_t to, time_t *const ptime );
+bool calRecurBounded( const CalRecur *const recur );
+time_t calRecurLast( CalRecur *const recur );
+void freeCalRecur( CalRecur *const recur );
+bool calCompRecurs( const CalComp *const comp );
+
+/* Time zones (RFC 5545 3.6.5). A VTIMEZONE is compiled once into a
+   sorted table of its UTC offset changes, its STANDARD and DAYLIGHT
+   rules expanded up to ZONE_LAST_YEAR, after which its last offset
+   holds. Tables are shared by every calendar with the same definition,
+   and the last few hundred asked for are kept for the next, so reading
+   one is a binary search. calUseZones makes TZID values on this thread
+   read with a calendar's VTIMEZONEs, however many it has; calAddZone
+   adds one more, as a stream is read. calUseZones(NULL) lets go of the
+   thread's zones, as a thread should before it ends.
+   The time calPropTime keeps in a TZID property holds only while the
+   same zones are in use. */
+
+typedef struct CalZone CalZone;     // private to caltime.c
+
+void calUseZones( const CalComp *const cal );
+void calAddZone( const CalComp *const vtimezone );
+
+#endif
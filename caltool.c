@@ -10,17 +10,26 @@ Geofferson Camp (gcamp@mail.uoguelph.ca)
 #include <stdlib.h>
 #include <string.h>
 #include "calutil.h"
+#include "caltime.h"
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
-#define MAX_DATESTRING 20
+#define MAX_DATESTRING 24
 #define MAX_FILENAME 1000
 #define MAX_ORG 1000
 #define MAX_ORGNAME 300
-#define MAX_EVENTS 5000
+#define EXTRACT_ROOM 1024               // events extract makes room for at first
+#define EXTRACT_AHEAD (366*24*3600L)    // endless recurrences listed up to a year from now
+#define MERGE_WAY 64                    // sorted runs merged at once
+#define COMP_TABLE_SIZE 1024            // first size of the -combine table (a power of two)
+#define SPOOL_SIZE 65536                // bytes copied at a time into a spool file
 #define MAX_XPROPS 5000
-#define MAX_SUMMARY 2000
 #define MAX_XNAME 100
 #define MATCH_STRING 10
 #define ARG_KEY_LENGTH 5
@@ -63,6 +72,13 @@ OUTPUT: time specified in seconds since epoche
 */
 time_t getToFromTime (int toFrom, char ** argv, int argc);
 
+/*
+Parse a number given after a key, as with "next 20"
+INPUT: command line args, key
+OUTPUT: number, 0 if not given, -1 if not a positive number
+*/
+int getNumber (char ** argv, int argc, const char * key);
+
 /*
 Prints information on fatal main errors
 INPUT: CalStatus'
@@ -70,29 +86,42 @@ OUTPUT: NA
 */
 void printError (CalStatus tool, CalStatus util);
 
+#ifndef NO_MAIN     // CalModule links these functions without caltool's main
 int main (int argc, char ** argv) {
     ComType handle; 
     CalStatus utilStatus = {.code = OK, .lineto = 0, .linefrom = 0};
     CalStatus toolStatus = {.code = OK, .lineto = 0, .linefrom = 0};
     bool overHeadOk = true;
-    CalComp * stdComp;
-    CalComp * combMore;
+    CalComp * stdComp = NULL;
     CalOpt kind = NOKIND;
     time_t datefrom = 0, dateto = 0;
-    FILE * combineFile; 
+    FILE ** combineFiles;
+    char ** combineNames;
+    int ncombine = 1;
+    int combineFailed = -1;
+    bool sorted = false;
+    int limit = 0;
+    int budget = 0;
+    int dropped = 0;
 
     if (argc < 2) {
         fprintf(stderr, "invalid command. caltool option required.\n");
         return EXIT_FAILURE;
     }
 
-    utilStatus = readCalFile(stdin,&stdComp); 
+    handle = modSelect(argv);
+    if (handle == EXTRACT) {
+        budget = getNumber(argv,argc,"mem");
+    }
+    //-filter, -combine and -extract e mem read stdin as they go; -batch doesn't use it
+    if (handle != FILTER && handle != COMBINE && handle != BATCH && budget == 0) {
+        utilStatus = readCalFileParallel(stdin,&stdComp,0); 
+    }
 
     if (utilStatus.code != OK) {
         fprintf(stderr,"read calendar failed with code:%d line %d\n",utilStatus.code, utilStatus.lineto);
         return EXIT_FAILURE;
     }
-    handle = modSelect(argv);
     switch (handle) {
         case INFO:
             if (argc < 2 || argc > 2) {
@@ -103,13 +132,41 @@ int main (int argc, char ** argv) {
             }
             break;
         case EXTRACT:
-            if (argc < 3 || argc > 3) {
-                fprintf(stderr,"Invalid input. Correct usage eg: caltool -extract e < events.ics\n");
+            //-extract e can be given a day to start from, a number of events, and
+            //megabytes to sort in before using disk
+            for (int i = 3; i < argc; i = i+2) {
+                if (i+1 == argc || (strcmp(argv[i],"from") != 0 && strcmp(argv[i],"next") != 0 && 
+                  strcmp(argv[i],"mem") != 0)) {
+                    overHeadOk = false;
+                }
+            }
+            if (argc < 3 || argc > 9 || overHeadOk == false) {
+                fprintf(stderr,"Invalid input. Correct usage eg: caltool -extract e "
+                  "[from 2016-03-01] [next 20] [mem 64] < events.ics\n");
                 overHeadOk = false;
             } else {
                 kind = getKind(argv[2]);
-                if (kind == OEVENT || kind == OPROP) {
+                if (kind == OEVENT) {
+                    datefrom = getToFromTime(DATE_FROM,argv,argc);
+                    limit = getNumber(argv,argc,"next");
+                    if (datefrom == -1 || limit == -1 || budget == -1) {
+                        overHeadOk = false;
+                    } else if (budget > 0) {
+                        toolStatus = calExtractStream(stdin,datefrom,limit,(size_t)budget*1024*1024,
+                          stdout,&utilStatus);
+                        if (utilStatus.code != OK) {
+                            fprintf(stderr,"read calendar failed with code:%d line %d\n",
+                              utilStatus.code,utilStatus.lineto);
+                            return EXIT_FAILURE;
+                        }
+                    } else {
+                        toolStatus = calExtractEvents(stdComp,datefrom,limit,stdout);
+                    }
+                } else if (kind == OPROP && argc == 3) {
                     toolStatus = calExtract(stdComp,kind,stdout);
+                } else if (kind == OPROP) {
+                    fprintf(stderr,"Invalid input. from, next and mem only go with -extract e\n");
+                    overHeadOk = false;
                 } else {
                    fprintf(stderr,"Invalid input argument. second arg must be 'x' or 'e'\n");
                    overHeadOk = false;
@@ -136,7 +193,12 @@ int main (int argc, char ** argv) {
                 kind = NOKIND;
             }
             if ((kind == OEVENT || kind == OTODO) && overHeadOk == true) {
-                toolStatus = calFilter(stdComp, kind, datefrom, dateto, stdout);
+                toolStatus = calFilterStream(stdin, kind, datefrom, dateto, stdout, &utilStatus);
+                if (utilStatus.code != OK) {
+                    fprintf(stderr,"read calendar failed with code:%d line %d\n",utilStatus.code, 
+                      utilStatus.lineto);
+                    return EXIT_FAILURE;
+                }
             } else {
                 if (overHeadOk != false) {
                     fprintf(stderr,"Invalid argument. Second arg must be 't' or 'e' \n"); 
@@ -145,33 +207,71 @@ int main (int argc, char ** argv) {
             }
             break;
         case COMBINE:
-             if (argc < 3) {
+            //stdin, then each file named; -sort merges them by DTSTART
+            combineFiles = malloc(sizeof(FILE*)*argc);
+            assert(combineFiles != NULL);
+            combineNames = malloc(sizeof(char*)*argc);
+            assert(combineNames != NULL);
+            combineFiles[0] = stdin;
+            combineNames[0] = "stdin";
+            for (int i = 2; i < argc && overHeadOk == true; i++) {
+                if (strcmp(argv[i],"-sort") == 0) {
+                    sorted = true;
+                } else if ((combineFiles[ncombine] = fopen(argv[i],"r")) != NULL) {
+                    combineNames[ncombine] = argv[i];
+                    ncombine++;
+                } else {
+                    fprintf(stderr,"iCalendar file %s could not be opened\n",argv[i]);
+                    overHeadOk = false;
+                }
+            }
+            if (ncombine < 2 && overHeadOk == true) {
+                fprintf(stderr,"Invalid input. Correct usage eg: "
+                  "caltool -combine [-sort] events2.ics [events3.ics ...] < events.ics\n");
+                overHeadOk = false;
+            }
+            if (overHeadOk == true) {
+                toolStatus = calCombineStream(combineFiles,ncombine,sorted,true,stdout,&utilStatus,
+                  &combineFailed,&dropped);
+                if (dropped > 0 && combineFailed == -1 && toolStatus.code == OK) {
+                    fprintf(stderr,"combine: %d duplicate components dropped\n",dropped);
+                }
+                if (combineFailed == 0) {
+                    fprintf(stderr,"read calendar failed with code:%d line %d\n",utilStatus.code, 
+                      utilStatus.lineto);
+                } else if (combineFailed > 0) {
+                    fprintf(stderr,"iCalendar file %s could not be read\n",
+                      combineNames[combineFailed]);
+                }
+            }
+            for (int i = 1; i < ncombine; i++) {
+                fclose(combineFiles[i]);
+            }
+            free(combineFiles);
+            free(combineNames);
+            if (combineFailed == 0) {
+                return EXIT_FAILURE;
+            }
+            break;
+        case BATCH:
+            if (argc < 3) {
                 fprintf(stderr,
-                  "Invalid input. Correct usage eg: caltool -combine events2.ics < events.ics\n");
+                  "Invalid input. Correct usage eg: caltool -batch calendars/ more.ics ...\n");
                 overHeadOk = false;
             } else {
-                if ((combineFile = fopen(argv[2],"r")) != NULL) {
-                    utilStatus = readCalFile(combineFile,&combMore);
-                    if (utilStatus.code == OK) {
-                        toolStatus = calCombine(stdComp,combMore,stdout);
-                        freeCalComp(combMore);
-                        fclose(combineFile);
-                    } else {
-                        fprintf(stderr,"second iCalendar file could not be read\n");
-                    }  
-                } else {
-                    fprintf(stderr,"second iCalendar file could not be opened\n");
+                //each file's result has been reported already
+                if (calBatch(argv+2,argc-2,stdout).code != OK) {
                     overHeadOk = false;
                 }
             }
             break;
         default:
-            fprintf(stderr,
-              "Invalid input. Must use -info, -extract, -filter, or -combine as first arg\n");
+            fprintf(stderr,"Invalid input. "
+              "Must use -info, -extract, -filter, -combine or -batch as first arg\n");
             overHeadOk = false;
             break;
     } 
-    if (utilStatus.code == OK) {
+    if (stdComp != NULL) {
         freeCalComp(stdComp);
     }
     if (toolStatus.code == OK && utilStatus.code == OK && overHeadOk == true) { 
@@ -181,6 +281,7 @@ int main (int argc, char ** argv) {
         return EXIT_FAILURE;
     }
 }
+#endif
 
 void printError (CalStatus tool, CalStatus util) {
     if (tool.code != OK) {
@@ -198,8 +299,6 @@ void printError (CalStatus tool, CalStatus util) {
 time_t getToFromTime(int toFrom, char ** argv, int argc) {
     int dateKey = 0;
     int dateErr = 0;
-    struct tm dateStruct = {0};
-    char dateString[MAX_DATESTRING];
     time_t toReturn = 0;
 
     if (toFrom == DATE_FROM) {
@@ -211,31 +310,65 @@ time_t getToFromTime(int toFrom, char ** argv, int argc) {
         toReturn = 0;
     } else if (dateKey == -1) {
         toReturn = getNowTime(toFrom);    
+    } else if ((toReturn = calParseDate(argv[dateKey],toFrom == DATE_TO,&dateErr)) == -1) {
+        fprintf(stderr,"%s\n",calDateError(dateErr,argv[dateKey]));
+    }
+    return toReturn;
+}
+
+time_t calParseDate(const char * text, bool end, int * const dateErr) {
+    struct tm dateStruct = {0};
+    char dateString[MAX_DATESTRING] = {'\0'};
+
+    *dateErr = 0;
+    if (strcmp(text,"today") == 0) {
+        return getNowTime(end ? DATE_TO : DATE_FROM);
+    }
+    strncpy(dateString,text,MAX_DATESTRING-1);
+    if ((*dateErr = getdate_r(dateString,&dateStruct)) != 0) {
+        return -1;
+    }
+    if (end) {
+        dateStruct.tm_hour = 23;
+        dateStruct.tm_min = 59;
+        dateStruct.tm_sec = 0;
     } else {
-        strncpy(dateString,argv[dateKey],MAX_DATESTRING);
-        if ((dateErr = getdate_r(dateString,&dateStruct)) != 0) {
-            assert(dateErr != 6);
-            if (dateErr == 1 || dateErr == 2 || dateErr == 3 || dateErr == 4 || dateErr == 5) {
-                fprintf(stderr,"Problem with DATEMSK environment variable or template file\n");
-            } else if (dateErr == 7 || dateErr == 8) {
-                fprintf(stderr,"Date \"%s\" could not be interpreted\n",argv[dateKey]);
-            }
-            toReturn = -1;
-        } else {
-            if (toFrom == DATE_TO) {
-                dateStruct.tm_hour = 23;
-                dateStruct.tm_min = 59;
-                dateStruct.tm_sec = 0;
-            } else {
-                dateStruct.tm_hour = 0;
-                dateStruct.tm_min = 0;
-                dateStruct.tm_sec = 0;
+        dateStruct.tm_hour = 0;
+        dateStruct.tm_min = 0;
+        dateStruct.tm_sec = 0;
+    }
+    dateStruct.tm_isdst = -1;
+    return mktime(&dateStruct);
+}
+
+const char * calDateError(int dateErr, const char * text) {
+    static _Thread_local char message[MAX_DATESTRING+40];
+
+    if (dateErr >= 1 && dateErr <= 5) {
+        return "Problem with DATEMSK environment variable or template file";
+    } else if (dateErr == DATE_NOMEM) {
+        return "Out of memory reading date";
+    }
+    snprintf(message,sizeof(message),"Date \"%.*s\" could not be interpreted",
+      MAX_DATESTRING-1,text);
+    return message;
+}
+
+int getNumber (char ** argv, int argc, const char * key) {
+    char * end;
+    long number;
+
+    for (int i = 0; i < argc-1; i++) {
+        if (strcmp(argv[i],key) == 0) {
+            number = strtol(argv[i+1],&end,10);
+            if (*end != '\0' || number < 1 || number > INT_MAX) {
+                fprintf(stderr,"Number \"%s\" after %s could not be interpreted\n",argv[i+1],key);
+                return -1;
             }
-            dateStruct.tm_isdst = -1;
-            toReturn = mktime((&dateStruct)); 
+            return number;
         }
     }
-    return toReturn;
+    return 0;
 }
 
 time_t getNowTime (int toFrom) {
@@ -294,6 +427,8 @@ ComType modSelect(char ** input) {
         toReturn = FILTER;
     } else if (strcmp(input[1],"-combine") == 0) {
         toReturn = COMBINE;
+    } else if (strcmp(input[1],"-batch") == 0) {
+        toReturn = BATCH;
     } else {
         toReturn = NONE;
     }
@@ -307,6 +442,13 @@ OUTPUT: address of comp copy
 */
 CalComp * makeCopy (const CalComp * comp, CalOpt content, time_t from, time_t to, ComType caller);
 
+/*
+Copy a component's name and props, leaving its subcomponents to the caller
+INPUT: component, room for subcomponents
+OUTPUT: address of the copy, with ncomps 0
+*/
+CalComp * copyHead (const CalComp * comp, int room);
+
 /*
 Make a copy or a calProp
 INPUT: calProp to copy
@@ -321,13 +463,6 @@ OUTPUT: address of param copy
 */
 CalParam * copyParam (CalParam * param);
 
-/*
-Add a parameter to a property
-INPUT: calParam and calProp 
-OUTPUT: NA
-*/
-void addParam (CalProp * prop, CalParam * param);
-
 /*
 Add top level props from comp2 to comp1
 INPUT: Two CalComps
@@ -335,10 +470,100 @@ OUTPUT: NA
 */
 void copyProps (CalComp * copy1, CalComp * copy2);
 
-CalStatus calCombine (const CalComp * comp1, const CalComp * comp2, FILE * const icsfile) {
+/*
+Read an input up to its next component, passing its top level props on
+INPUT: input, header to collect props in (NULL once written), writer,
+       whether VERSION and PRODID are dropped
+OUTPUT: CalStatus of any writes
+*/
+CalStatus nextCombineComp (CombineInput * input, CalComp * header, CalWriter * writer, bool dropReq);
+
+/*
+Find the version of each component -combine keeps, reading every input
+through once and leaving it where it started; an input that can't be
+read again (a pipe) is first copied to a temporary file
+INPUT: inputs (replaced by their copy if spooled), how many, table
+OUTPUT: OK, or IOERR if an input couldn't be copied or put back
+*/
+CalError findCombineVersions (FILE ** ics, bool * spooled, int nics, CompTable * table);
+
+/*
+Work out what identifies a component across calendars, its UID and
+RECURRENCE-ID (a VTIMEZONE's TZID), and what ranks its versions
+INPUT: component, where to put its SEQUENCE and LAST-MODIFIED
+OUTPUT: malloced key, NULL if it has no UID (or TZID)
+*/
+char * compKey (const CalComp * comp, long * sequence, time_t * modified);
+
+/*
+Hash table of the components -combine keeps, by key. Each key keeps
+its version with the highest SEQUENCE, then the latest LAST-MODIFIED,
+then the first found
+INPUT: table, component, its input and position in it / key and hash
+OUTPUT: NA / whether the component is kept / slot of the key (empty if absent)
+*/
+CompTable * newCompTable (void);
+void compTableOffer (CompTable * table, const CalComp * comp, int input, int ordinal);
+bool compTableKeeps (const CompTable * table, const CalComp * comp, int input, int ordinal);
+int compTableFind (const CompTable * table, const char * key, unsigned long hash);
+unsigned long compKeyHash (const char * key);
+void freeCompTable (CompTable * table);
+
+/*
+Find when a component starts
+INPUT: component
+OUTPUT: DTSTART in seconds since epoche, 0 if there is none
+*/
+time_t compStart (CalComp * comp);
+
+/*
+Check if comp contains a parameter within the date range
+INPUT: comp to check and date range
+OUTPUT: if in range indicator
+*/
+int checkDate (CalComp * comp, time_t from, time_t to, ComType caller);
+
+/*
+Searches property for a date and makes not of it accordingly
+INPUT: CalProp to search for time value, caller (FILTER skips CREATED,
+       DTSTAMP and LAST-MODIFIED)
+OUTPUT: int indicating if prop has a time/date, returns 0 if no date 
+*/
+time_t findDate (CalProp * prop, ComType caller);
+
+/*
+Check the occurrences of a recurring VEVENT, VTODO or VJOURNAL against a
+date range: one matches if it starts or ends in it
+INPUT: component, date range (0 for an open end)
+OUTPUT: 1 if an occurrence is in range, 0 if not
+*/
+int checkRecur (CalComp * comp, time_t from, time_t to);
+
+/*
+Length of a component's occurrences, from DTEND, DUE or DURATION
+INPUT: component
+OUTPUT: seconds, 0 if none is given
+*/
+time_t compLength (CalComp * comp);
+
+CalStatus calCombine (const CalComp * comp1, const CalComp * comp2, FILE * const icsfile, 
+  int * dropped) {
+    CalComp * combined;
+    CalStatus toReturn = {.code =0, .linefrom = 0, .lineto = 0};
+    CalWriter writer;
+
+    combined = calCombineComp(comp1,comp2,dropped);
+    initCalWriter(&writer,icsfile);
+    toReturn = calWriteComp(&writer,combined); 
+    freeCalComp(combined);
+    return toReturn;
+}
+
+CalComp * calCombineComp (const CalComp * comp1, const CalComp * comp2, int * dropped) {
     CalComp * comp1copy;
     CalComp * comp2copy;
-    CalStatus toReturn = {.code =0, .linefrom = 0, .lineto = 0};
+    CompTable * table;
+    int kept = 0;
 
     comp1copy = makeCopy(comp1,ALL,0,0,COMBINE);
     comp2copy = makeCopy(comp2,ALL,0,0,COMBINE);
@@ -354,47 +579,408 @@ CalStatus calCombine (const CalComp * comp1, const CalComp * comp2, FILE * const
         comp1copy->comp[comp1copy->ncomps] = comp2copy->comp[i];
         comp1copy->ncomps = comp1copy->ncomps + 1;
     }
-    
-    //write copy1
-    toReturn = writeCalComp(icsfile,comp1copy); 
 
-    //free copies
-    freeCalComp(comp1copy);
+    //an event in both keeps only its latest version
+    table = newCompTable();
+    for (int i = 0; i<comp1copy->ncomps; i++) {
+        compTableOffer(table,comp1copy->comp[i],0,i);
+    }
+    for (int i = 0; i<comp1copy->ncomps; i++) {
+        if (compTableKeeps(table,comp1copy->comp[i],0,i)) {
+            comp1copy->comp[kept] = comp1copy->comp[i];
+            kept++;
+        } else {
+            freeCalComp(comp1copy->comp[i]);
+        }
+    }
+    comp1copy->ncomps = kept;
+    *dropped = table->dropped;
+    freeCompTable(table);
+
+    //copy2's comps and props now belong to copy1
     free(comp2copy->name);
+    free(comp2copy->propv);
     free(comp2copy);
+    return comp1copy;
+}
+
+CalStatus calCombineStream (FILE * const * ics, int nics, bool sorted, bool dedupe, 
+  FILE * const icsfile, CalStatus * readStatus, int * failed, int * dropped) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    CombineInput * input;
+    CalComp * header;
+    CalWriter writer;
+    CompTable * table = NULL;
+    FILE ** files;
+    bool * spooled;
+    int next;
+
+    *failed = -1;
+    *dropped = 0;
+    files = malloc(sizeof(FILE*)*nics);
+    assert(files != NULL);
+    memcpy(files,ics,sizeof(FILE*)*nics);
+    spooled = calloc(nics,sizeof(bool));
+    assert(spooled != NULL);
+    //which version of a component to keep is only known once all are read
+    if (dedupe) {
+        table = newCompTable();
+        toReturn.code = findCombineVersions(files,spooled,nics,table);
+        *dropped = table->dropped;
+        if (toReturn.code != OK) {
+            for (int i = 0; i < nics; i++) {
+                if (spooled[i]) {
+                    fclose(files[i]);
+                }
+            }
+            freeCompTable(table);
+            free(files);
+            free(spooled);
+            return toReturn;
+        }
+    }
+    input = malloc(sizeof(CombineInput)*nics);
+    assert(input != NULL);
+    header = malloc(sizeof(CalComp));
+    assert(header != NULL);
+    header->name = malloc(sizeof(char)*(strlen("VCALENDAR")+1));
+    assert(header->name != NULL);
+    strcpy(header->name,"VCALENDAR");
+    header->nprops = 0;
+    header->prop = NULL;
+    header->propv = NULL;
+    header->arena = NULL;
+    header->ncomps = 0;
+    initCalWriter(&writer,icsfile);
+    calUseZones(NULL);
+
+    //every input's top level props go in the header, before any component
+    for (int i = 0; i < nics; i++) {
+        input[i].parser = newCalParser(files[i],NULL);
+        input[i].number = i;
+        input[i].ordinal = 0;
+        input[i].table = table;
+        nextCombineComp(&input[i],header,&writer,i > 0);
+        if (input[i].status.code != OK && *failed == -1) {
+            *failed = i;
+        }
+    }
+    if (*failed == -1) {
+        toReturn = calWriteBegin(&writer,header);
+    }
+    //write the waiting component with the earliest start, or in input order
+    while (*failed == -1 && toReturn.code == OK) {
+        next = -1;
+        for (int i = 0; i < nics; i++) {
+            if (input[i].comp != NULL && (next == -1 || 
+              (sorted && input[i].start < input[next].start))) {
+                next = i;
+            }
+        }
+        if (next == -1) {
+            toReturn = calWriteEnd(&writer,header);
+            break;
+        }
+        toReturn = calWriteComp(&writer,input[next].comp);
+        if (toReturn.code == OK) {
+            toReturn = nextCombineComp(&input[next],NULL,&writer,next > 0);
+        }
+        if (input[next].status.code != OK) {
+            *failed = next;
+        }
+    }
+    if (*failed != -1) {
+        *readStatus = input[*failed].status;
+    }
+    for (int i = 0; i < nics; i++) {
+        freeCalParser(input[i].parser);
+        if (spooled[i]) {
+            fclose(files[i]);
+        }
+    }
+    if (table != NULL) {
+        freeCompTable(table);
+    }
+    freeCalComp(header);
+    free(input);
+    free(files);
+    free(spooled);
+    return toReturn;
+}
+
+CalStatus nextCombineComp (CombineInput * input, CalComp * header, CalWriter * writer, bool dropReq) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    CalEvent event;
+
+    input->comp = NULL;
+    do {
+        input->status = readCalEvent(input->parser,&event);
+        if (input->status.code != OK) {
+            break;
+        }
+        if (event.kind == EVPROP && event.depth == 1) {
+            if (dropReq && (event.prop->kind == PROP_VERSION || event.prop->kind == PROP_PRODID)) {
+                continue;
+            }
+            if (header != NULL) {
+                addProp(header,copyProp(event.prop));
+            } else {
+                toReturn = calWriteProp(writer,event.prop);
+            }
+        } else if (event.kind == EVBEGIN && event.depth == 2) {
+            input->status = readCalEventComp(input->parser,&event,&input->comp);
+            input->ordinal++;
+            if (input->status.code != OK) {
+                input->comp = NULL;
+            } else if (input->table != NULL && 
+              !compTableKeeps(input->table,input->comp,input->number,input->ordinal-1)) {
+                input->comp = NULL;
+                continue;
+            } else {
+                if (strcmp(input->comp->name,"VTIMEZONE") == 0) {
+                    calAddZone(input->comp);
+                }
+                input->start = compStart(input->comp);
+            }
+            break;
+        }
+    } while (event.kind != EVDONE && toReturn.code == OK);
+    return toReturn;
+}
+
+CalError findCombineVersions (FILE ** ics, bool * spooled, int nics, CompTable * table) {
+    CalParser * parser;
+    CalEvent event;
+    CalStatus status;
+    CalComp * comp;
+    FILE * spool;
+    char * buffer;
+    size_t got;
+    off_t start;
+    int ordinal;
+
+    for (int i = 0; i < nics; i++) {
+        start = ftello(ics[i]);
+        if (start < 0) {
+            spool = tmpfile();
+            if (spool == NULL) {
+                return IOERR;
+            }
+            buffer = malloc(sizeof(char)*SPOOL_SIZE);
+            assert(buffer != NULL);
+            while ((got = fread(buffer,sizeof(char),SPOOL_SIZE,ics[i])) > 0) {
+                if (fwrite(buffer,sizeof(char),got,spool) != got) {
+                    break;
+                }
+            }
+            free(buffer);
+            ics[i] = spool;
+            spooled[i] = true;
+            if (ferror(spool) || fflush(spool) != 0) {
+                return IOERR;
+            }
+            start = 0;
+            rewind(spool);
+        }
+        //a read error here is found again, and reported, as the input is combined
+        parser = newCalParser(ics[i],NULL);
+        ordinal = 0;
+        do {
+            status = readCalEvent(parser,&event);
+            if (status.code != OK) {
+                break;
+            }
+            if (event.kind == EVBEGIN && event.depth == 2) {
+                status = readCalEventComp(parser,&event,&comp);
+                if (status.code != OK) {
+                    break;
+                }
+                compTableOffer(table,comp,i,ordinal);
+                freeCalComp(comp);
+                ordinal++;
+            }
+        } while (event.kind != EVDONE);
+        freeCalParser(parser);
+        if (fseeko(ics[i],start,SEEK_SET) != 0) {
+            return IOERR;
+        }
+    }
+    return OK;
+}
+
+char * compKey (const CalComp * comp, long * sequence, time_t * modified) {
+    CalProp * holder;
+    const char * uid = NULL;
+    const char * recurrenceId = "";
+    char * key;
+
+    *sequence = 0;
+    *modified = 0;
+    for (int i = 0; i < comp->nprops; i++) {
+        holder = calCompProp(comp,i);
+        if (holder->kind == PROP_UID) {
+            uid = holder->value;
+        } else if (holder->kind == PROP_TZID && strcmp(comp->name,"VTIMEZONE") == 0) {
+            //a calendar may define each TZID once (RFC 5545 3.6.5)
+            uid = holder->value;
+        } else if (holder->kind == PROP_RECURRENCE_ID) {
+            recurrenceId = holder->value;
+        } else if (holder->kind == PROP_SEQUENCE) {
+            *sequence = strtol(holder->value,NULL,10);
+        } else if (holder->kind == PROP_LAST_MODIFIED) {
+            *modified = calPropTime(holder);
+        }
+    }
+    if (uid == NULL) {
+        return NULL;
+    }
+    key = malloc(sizeof(char)*(strlen(comp->name)+strlen(uid)+strlen(recurrenceId)+3));
+    assert(key != NULL);
+    sprintf(key,"%s\n%s\n%s",comp->name,uid,recurrenceId);
+    return key;
+}
 
+CompTable * newCompTable (void) {
+    CompTable * table;
+
+    table = malloc(sizeof(CompTable));
+    assert(table != NULL);
+    table->size = COMP_TABLE_SIZE;
+    table->count = 0;
+    table->dropped = 0;
+    table->slots = calloc(table->size,sizeof(CompTableEntry));
+    assert(table->slots != NULL);
+    return table;
+}
+
+void compTableOffer (CompTable * table, const CalComp * comp, int input, int ordinal) {
+    CompTableEntry * old;
+    CompTableEntry * entry;
+    char * key;
+    unsigned long hash;
+    long sequence;
+    time_t modified;
+    int oldSize;
+
+    key = compKey(comp,&sequence,&modified);
+    if (key == NULL) {
+        return;
+    }
+    hash = compKeyHash(key);
+    //kept at most half full, so probes stay short
+    if ((table->count+1)*2 > table->size) {
+        old = table->slots;
+        oldSize = table->size;
+        table->size = table->size*2;
+        table->slots = calloc(table->size,sizeof(CompTableEntry));
+        assert(table->slots != NULL);
+        for (int i = 0; i < oldSize; i++) {
+            if (old[i].key != NULL) {
+                table->slots[compTableFind(table,old[i].key,old[i].hash)] = old[i];
+            }
+        }
+        free(old);
+    }
+    entry = &table->slots[compTableFind(table,key,hash)];
+    if (entry->key == NULL) {
+        entry->key = key;
+        entry->hash = hash;
+        entry->input = input;
+        entry->ordinal = ordinal;
+        entry->sequence = sequence;
+        entry->modified = modified;
+        table->count++;
+        return;
+    }
+    free(key);
+    table->dropped++;
+    if (sequence > entry->sequence || (sequence == entry->sequence && modified > entry->modified)) {
+        entry->input = input;
+        entry->ordinal = ordinal;
+        entry->sequence = sequence;
+        entry->modified = modified;
+    }
+}
+
+bool compTableKeeps (const CompTable * table, const CalComp * comp, int input, int ordinal) {
+    const CompTableEntry * entry;
+    char * key;
+    long sequence;
+    time_t modified;
+
+    key = compKey(comp,&sequence,&modified);
+    if (key == NULL) {
+        return true;
+    }
+    entry = &table->slots[compTableFind(table,key,compKeyHash(key))];
+    free(key);
+    return entry->key == NULL || (entry->input == input && entry->ordinal == ordinal);
+}
+
+int compTableFind (const CompTable * table, const char * key, unsigned long hash) {
+    int slot = hash & (table->size-1);
+
+    //linear probing
+    while (table->slots[slot].key != NULL && (table->slots[slot].hash != hash || 
+      strcmp(table->slots[slot].key,key) != 0)) {
+        slot = (slot+1) & (table->size-1);
+    }
+    return slot;
+}
+
+unsigned long compKeyHash (const char * key) {
+    unsigned long hash = 5381;
+
+    for (const char * c = key; *c != '\0'; c++) {
+        hash = hash*33 ^ (unsigned char)*c;
+    }
+    //spread the high bits into those the table size masks
+    return hash ^ (hash >> 29);
+}
+
+void freeCompTable (CompTable * table) {
+    for (int i = 0; i < table->size; i++) {
+        free(table->slots[i].key);
+    }
+    free(table->slots);
+    free(table);
+}
+
+time_t compStart (CalComp * comp) {
+    CalProp * holder;
+    time_t toReturn = 0;
+
+    holder = comp->prop;
+    while (holder != NULL) {
+        if (holder->kind == PROP_DTSTART) {
+            toReturn = findDate(holder,COMBINE);
+            break;
+        }
+        holder = holder->next;
+    }
     return toReturn;
 }
 
 void copyProps(CalComp * copy1, CalComp * copy2) {
     CalProp * propHolder = NULL;
-    CalProp * copy1End = NULL;
+    CalProp * nextProp = NULL;
     CalProp * copy2Prod = NULL;
     CalProp * copy2Ver = NULL;
 
-    propHolder = copy1->prop;
-    if (propHolder == NULL) {
-        copy1End = NULL;
-    } else {
-        while (propHolder->next != NULL) {
-            propHolder = propHolder->next;    
-        }
-        copy1End = propHolder;
-    } 
     propHolder = copy2->prop;
     while (propHolder != NULL) {
-        if (strcmp(propHolder->name,"VERSION") != 0 && strcmp(propHolder->name,"PRODID") != 0) {
-            copy1End->next = propHolder;
-            copy1End = propHolder;
-            copy1->nprops++;
+        nextProp = propHolder->next;
+        if (propHolder->kind != PROP_VERSION && propHolder->kind != PROP_PRODID) {
+            propHolder->next = NULL;
+            addProp(copy1,propHolder);
         } else {
-            if (strcmp(propHolder->name,"VERSION") == 0) {
+            if (propHolder->kind == PROP_VERSION) {
                 copy2Ver = propHolder;
             } else {
                 copy2Prod = propHolder;
             }
         }
-        propHolder = propHolder->next;
+        propHolder = nextProp;
     }
 
     //free properties not copied
@@ -406,42 +992,62 @@ void copyProps(CalComp * copy1, CalComp * copy2) {
     free(copy2Prod);    
 }
 
-/*
-Check if comp contains a parameter within the date range
-INPUT: comp to check and date range
-OUTPUT: if in range indicator
-*/
-int checkDate (CalComp * comp, time_t from, time_t to, ComType caller);
-
-/*
-Searches property for a date and makes not of it accordingly
-INPUT: CalProp to search for time value
-OUTPUT: int indicating if prop has a time/date, returns 0 if no date 
-*/
-time_t findDate (CalProp * prop, struct tm ** timeStruct, ComType caller);
-
 CalStatus calFilter(const CalComp * comp, CalOpt content, time_t datefrom, time_t dateto, 
   FILE * const icsfile) {
     CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
     CalComp * copiedComp;
+    CalWriter writer;
        
-    copiedComp = makeCopy(comp,content,datefrom,dateto,FILTER);
+    copiedComp = calFilterComp(comp,content,datefrom,dateto);
 
     if (copiedComp->ncomps == 0) {
         toReturn.code = NOCAL;
     } else {
-        toReturn = writeCalComp(icsfile,copiedComp);
+        initCalWriter(&writer,icsfile);
+        toReturn = calWriteComp(&writer,copiedComp);
     }
 
     freeCalComp(copiedComp);
     return toReturn;
 }
 
-CalComp * makeCopy (const CalComp * comp, CalOpt content, time_t from, time_t to, ComType caller) {
-    CalComp * compCopy;
-    CalProp * propHolder;
-    CalProp  * propCopy;
-    CalComp * compToAdd;
+CalComp * calFilterComp(const CalComp * comp, CalOpt content, time_t datefrom, time_t dateto) {
+    calUseZones(comp);
+    return makeCopy(comp,content,datefrom,dateto,FILTER);
+}
+
+/*
+Add the filter dates of a component and its subcomponents to an index
+INPUT: index, component, its index in the calendar, room left in dates
+OUTPUT: NA
+*/
+void indexDates (CalIndex * index, CalComp * comp, int compNo, int * room);
+
+/*
+Order index dates by time, or component numbers by value
+INPUT: two IndexDate or two int
+OUTPUT: <0, 0 or >0 as for qsort
+*/
+int indexDateCompare (const void * a, const void * b);
+int compNoCompare (const void * a, const void * b);
+
+/*
+Add a recurring component's span to an index
+INPUT: index, component, its index in the calendar
+OUTPUT: NA
+*/
+void indexSpan (CalIndex * index, CalComp * comp, int compNo);
+
+/*
+Order index spans by first start
+INPUT: two IndexSpan
+OUTPUT: <0, 0 or >0 as for qsort
+*/
+int indexSpanCompare (const void * a, const void * b);
+
+CalIndex * newCalIndex (const CalComp * comp, CalOpt content) {
+    CalIndex * index;
+    int room = 16;
     char toMatch[MATCH_STRING];
 
     if (content == OEVENT) {
@@ -449,51 +1055,384 @@ CalComp * makeCopy (const CalComp * comp, CalOpt content, time_t from, time_t to
     } else {
         strncpy(toMatch,"VTODO",MATCH_STRING);
     }
-    propHolder = comp->prop;
-    compCopy = malloc(sizeof(CalComp) + sizeof(CalComp*)*comp->ncomps);
-    assert(compCopy != NULL);
-    compCopy->name = malloc(sizeof(char)*strlen(comp->name)+1);
-    assert(compCopy->name != NULL);
-    strncpy(compCopy->name,comp->name,strlen(comp->name)+1);
-    compCopy->prop = NULL;
-    while (propHolder != NULL) { 
-        propCopy = copyProp(propHolder);
-        addProp(compCopy,propCopy);       
-        propHolder = propHolder->next;
-        propCopy = NULL;
-    }
-    compCopy->ncomps = 0;
-    for (int i =0; i<comp->ncomps; i++) {
-        compToAdd = NULL;
-        if (strcmp(toMatch,comp->comp[i]->name) == 0 || content == ALL) {
-            compToAdd = makeCopy(comp->comp[i],ALL,from,to,caller);
-            if (checkDate(compToAdd,from,to,caller) == 1) {
-                compCopy->comp[compCopy->ncomps] = compToAdd;
-                compCopy->ncomps = compCopy->ncomps + 1;
-            } else {
-                freeCalComp(compToAdd);
+    calUseZones(comp);
+    index = malloc(sizeof(CalIndex));
+    assert(index != NULL);
+    index->cal = comp;
+    index->content = content;
+    index->ndates = 0;
+    index->dates = malloc(sizeof(IndexDate)*room);
+    assert(index->dates != NULL);
+    index->ncomps = 0;
+    index->comps = malloc(sizeof(int)*(comp->ncomps+1));
+    assert(index->comps != NULL);
+    index->nrecur = 0;
+    index->recur = malloc(sizeof(IndexSpan)*(comp->ncomps+1));
+    assert(index->recur != NULL);
+    for (int i = 0; i < comp->ncomps; i++) {
+        if (strcmp(comp->comp[i]->name,toMatch) == 0) {
+            index->comps[index->ncomps] = i;
+            index->ncomps++;
+            indexDates(index,comp->comp[i],i,&room);
+            if (calCompRecurs(comp->comp[i])) {
+                indexSpan(index,comp->comp[i],i);
             }
-       }  
+        }
+    }
+    qsort(index->dates,index->ndates,sizeof(IndexDate),indexDateCompare);
+    qsort(index->recur,index->nrecur,sizeof(IndexSpan),indexSpanCompare);
+    return index;
+}
+
+void indexSpan (CalIndex * index, CalComp * comp, int compNo) {
+    CalRecur * recur;
+    IndexSpan * span;
+    time_t first, last;
+
+    recur = newCalRecur(comp);
+    //without a first occurrence checkRecur never matches it
+    if (recur == NULL || !calRecurNext(recur,0,&first)) {
+        if (recur != NULL) {
+            freeCalRecur(recur);
+        }
+        return;
+    }
+    span = &index->recur[index->nrecur];
+    span->from = first;
+    span->to = 0;
+    span->comp = compNo;
+    if (calRecurBounded(recur)) {
+        last = calRecurLast(recur);
+        span->to = (last > first ? last : first) + compLength(comp);
+    }
+    index->nrecur++;
+    freeCalRecur(recur);
+}
+
+void indexDates (CalIndex * index, CalComp * comp, int compNo, int * room) {
+    time_t time;
+
+    for (int i = 0; i < comp->nprops; i++) {
+        time = findDate(calCompProp(comp,i),FILTER);
+        if (time == 0) {
+            continue;
+        }
+        if (index->ndates == *room) {
+            *room = *room*2;
+            index->dates = realloc(index->dates,sizeof(IndexDate)*(*room));
+            assert(index->dates != NULL);
+        }
+        index->dates[index->ndates].time = time;
+        index->dates[index->ndates].comp = compNo;
+        index->ndates++;
+    }
+    for (int i = 0; i < comp->ncomps; i++) {
+        indexDates(index,comp->comp[i],compNo,room);
+    }
+}
+
+int calIndexFind (const CalIndex * index, time_t datefrom, time_t dateto, int ** const pfound) {
+    int low = 0;
+    int high = index->ndates;
+    int mid, end;
+    int nfound = 0;
+    int * found;
+    const IndexSpan * span;
+
+    //no dates given matches everything, as checkDate does
+    if (datefrom == 0 && dateto == 0) {
+        *pfound = malloc(sizeof(int)*(index->ncomps+1));
+        assert(*pfound != NULL);
+        memcpy(*pfound,index->comps,sizeof(int)*index->ncomps);
+        return index->ncomps;
+    }
+    if (datefrom != 0) {
+        while (low < high) {
+            mid = (low+high)/2;
+            if (index->dates[mid].time < datefrom) {
+                low = mid+1;
+            } else {
+                high = mid;
+            }
+        }
+    }
+    end = low;
+    while (end < index->ndates && (dateto == 0 || index->dates[end].time <= dateto)) {
+        end++;
+    }
+    found = malloc(sizeof(int)*(end-low+index->nrecur+1));
+    assert(found != NULL);
+    for (int i = low; i < end; i++) {
+        found[nfound] = index->dates[i].comp;
+        nfound++;
+    }
+    //a recurring component's occurrences are only walked if the range meets its span
+    if (index->nrecur > 0) {
+        calUseZones(index->cal);
+    }
+    for (int i = 0; i < index->nrecur && (dateto == 0 || index->recur[i].from <= dateto); i++) {
+        span = &index->recur[i];
+        if (datefrom != 0 && span->to != 0 && span->to < datefrom) {
+            continue;
+        }
+        if (checkRecur(index->cal->comp[span->comp],datefrom,dateto) == 1) {
+            found[nfound] = span->comp;
+            nfound++;
+        }
+    }
+    //a component with several dates in range is only found once, in file order
+    qsort(found,nfound,sizeof(int),compNoCompare);
+    high = 0;
+    for (int i = 0; i < nfound; i++) {
+        if (high == 0 || found[i] != found[high-1]) {
+            found[high] = found[i];
+            high++;
+        }
+    }
+    *pfound = found;
+    return high;
+}
+
+CalStatus calFilterIndex (const CalIndex * index, time_t datefrom, time_t dateto, 
+  FILE * const icsfile) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    CalComp * copiedComp;
+    CalWriter writer;
+    int * found;
+    int nfound;
+
+    nfound = calIndexFind(index,datefrom,dateto,&found);
+    if (nfound == 0) {
+        toReturn.code = NOCAL;
+    } else {
+        calUseZones(index->cal);
+        initCalWriter(&writer,icsfile);
+        toReturn = calWriteBegin(&writer,index->cal);
+        for (int i = 0; i < nfound && toReturn.code == OK; i++) {
+            copiedComp = makeCopy(index->cal->comp[found[i]],ALL,datefrom,dateto,FILTER);
+            toReturn = calWriteComp(&writer,copiedComp);
+            freeCalComp(copiedComp);
+        }
+        if (toReturn.code == OK) {
+            toReturn = calWriteEnd(&writer,index->cal);
+        }
+    }
+    free(found);
+    return toReturn;
+}
+
+CalComp * calIndexComp (const CalIndex * index, time_t datefrom, time_t dateto) {
+    CalComp * copiedComp;
+    int * found;
+    int nfound;
+
+    nfound = calIndexFind(index,datefrom,dateto,&found);
+    calUseZones(index->cal);
+    copiedComp = copyHead(index->cal,nfound);
+    for (int i = 0; i < nfound; i++) {
+        copiedComp->comp[i] = makeCopy(index->cal->comp[found[i]],ALL,datefrom,dateto,FILTER);
+    }
+    copiedComp->ncomps = nfound;
+    free(found);
+    return copiedComp;
+}
+
+void freeCalIndex (CalIndex * const index) {
+    free(index->dates);
+    free(index->comps);
+    free(index->recur);
+    free(index);
+}
+
+int indexDateCompare (const void * a, const void * b) {
+    const IndexDate * first = a;
+    const IndexDate * second = b;
+
+    if (first->time < second->time) {
+        return -1;
+    } else if (first->time > second->time) {
+        return 1;
+    }
+    return first->comp - second->comp;
+}
+
+int indexSpanCompare (const void * a, const void * b) {
+    const IndexSpan * first = a;
+    const IndexSpan * second = b;
+
+    if (first->from < second->from) {
+        return -1;
+    } else if (first->from > second->from) {
+        return 1;
+    }
+    return first->comp - second->comp;
+}
+
+int compNoCompare (const void * a, const void * b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+Drop subcomponents with no date in range, as makeCopy does for filter
+INPUT: comp to prune, date range
+OUTPUT: NA
+*/
+void pruneDates (CalComp * comp, time_t from, time_t to);
+
+CalStatus calFilterStream (FILE * const ics, CalOpt content, time_t datefrom, time_t dateto, 
+  FILE * const icsfile, CalStatus * readStatus) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    CalParser * parser;
+    CalEvent event;
+    CalComp * header;
+    CalComp * comp;
+    CalWriter writer;
+    bool started = false;
+    char toMatch[MATCH_STRING];
+
+    if (content == OEVENT) {
+        strncpy(toMatch,"VEVENT",MATCH_STRING);
+    } else {
+        strncpy(toMatch,"VTODO",MATCH_STRING);
+    }
+    //VCALENDAR properties are held until the first component passes
+    header = malloc(sizeof(CalComp));
+    assert(header != NULL);
+    header->name = malloc(sizeof(char)*(strlen("VCALENDAR")+1));
+    assert(header->name != NULL);
+    strcpy(header->name,"VCALENDAR");
+    header->nprops = 0;
+    header->prop = NULL;
+    header->propv = NULL;
+    header->arena = NULL;
+    header->ncomps = 0;
+    initCalWriter(&writer,icsfile);
+    calUseZones(NULL);
+    parser = newCalParser(ics,NULL);
+    do {
+        *readStatus = readCalEvent(parser,&event);
+        if (readStatus->code != OK) {
+            break;
+        }
+        if (event.kind == EVBEGIN && event.depth == 2 && strcmp(event.name,"VTIMEZONE") == 0) {
+            //zones come before the components that use them
+            *readStatus = readCalEventComp(parser,&event,&comp);
+            if (readStatus->code != OK) {
+                break;
+            }
+            calAddZone(comp);
+        } else if (event.kind == EVPROP && event.depth == 1) {
+            if (!started) {
+                addProp(header,copyProp(event.prop));
+            } else {
+                toReturn = calWriteProp(&writer,event.prop);
+            }
+        } else if (event.kind == EVBEGIN && event.depth == 2 && strcmp(event.name,toMatch) == 0) {
+            *readStatus = readCalEventComp(parser,&event,&comp);
+            if (readStatus->code != OK) {
+                break;
+            }
+            pruneDates(comp,datefrom,dateto);
+            if (checkDate(comp,datefrom,dateto,FILTER) == 1) {
+                if (!started) {
+                    toReturn = calWriteBegin(&writer,header);
+                    started = true;
+                }
+                if (toReturn.code == OK) {
+                    toReturn = calWriteComp(&writer,comp);
+                }
+            }
+        }
+    } while (event.kind != EVDONE && toReturn.code == OK);
+    freeCalParser(parser);
+    if (readStatus->code == OK && toReturn.code == OK) {
+        if (!started) {
+            toReturn.code = NOCAL;
+        } else {
+            toReturn = calWriteEnd(&writer,header);
+        }
+    }
+    freeCalComp(header);
+    return toReturn;
+}
+
+void pruneDates (CalComp * comp, time_t from, time_t to) {
+    int kept = 0;
+
+    for (int i = 0; i < comp->ncomps; i++) {
+        pruneDates(comp->comp[i],from,to);
+        if (checkDate(comp->comp[i],from,to,FILTER) == 1) {
+            comp->comp[kept] = comp->comp[i];
+            kept++;
+        }
+    }
+    comp->ncomps = kept;
+}
+
+CalComp * makeCopy (const CalComp * comp, CalOpt content, time_t from, time_t to, ComType caller) {
+    CalComp * compCopy;
+    CalComp * compToAdd;
+    char toMatch[MATCH_STRING];
+
+    if (content == OEVENT) {
+        strncpy(toMatch,"VEVENT",MATCH_STRING);
+    } else {
+        strncpy(toMatch,"VTODO",MATCH_STRING);
+    }
+    compCopy = copyHead(comp,comp->ncomps);
+    for (int i =0; i<comp->ncomps; i++) {
+        compToAdd = NULL;
+        if (strcmp(toMatch,comp->comp[i]->name) == 0 || content == ALL) {
+            compToAdd = makeCopy(comp->comp[i],ALL,from,to,caller);
+            if (checkDate(compToAdd,from,to,caller) == 1) {
+                compCopy->comp[compCopy->ncomps] = compToAdd;
+                compCopy->ncomps = compCopy->ncomps + 1;
+            } else {
+                freeCalComp(compToAdd);
+            }
+       }  
     }
     return compCopy;
 }
 
+CalComp * copyHead (const CalComp * comp, int room) {
+    CalComp * compCopy;
+    CalProp * propHolder;
+    CalProp  * propCopy;
+
+    propHolder = comp->prop;
+    compCopy = malloc(sizeof(CalComp) + sizeof(CalComp*)*room);
+    assert(compCopy != NULL);
+    compCopy->name = malloc(sizeof(char)*strlen(comp->name)+1);
+    assert(compCopy->name != NULL);
+    strncpy(compCopy->name,comp->name,strlen(comp->name)+1);
+    compCopy->nprops = 0;
+    compCopy->prop = NULL;
+    compCopy->propv = NULL;
+    compCopy->arena = NULL;
+    while (propHolder != NULL) { 
+        propCopy = copyProp(propHolder);
+        addProp(compCopy,propCopy);       
+        propHolder = propHolder->next;
+        propCopy = NULL;
+    }
+    compCopy->ncomps = 0;
+    return compCopy;
+}
+
 int checkDate (CalComp * comp, time_t from, time_t to, ComType caller) {
     CalProp * holder;
     time_t time = 0;
-    struct tm * timeStruct;
     int toReturn = 0;
 
-    holder = comp->prop;
-
     //if dates arent set, dont filter by date
     if (to == 0 && from == 0) {
         return 1;
     }
-    while (holder != NULL) {
-        time = findDate(holder,&timeStruct,caller);
+    for (int i = 0; i < comp->nprops; i++) {
+        holder = calCompProp(comp,i);
+        time = findDate(holder,caller);
         if (time == 0) {
-            holder = holder->next;
             continue;
         }
         if (from != 0 && to != 0) {
@@ -511,7 +1450,9 @@ int checkDate (CalComp * comp, time_t from, time_t to, ComType caller) {
         } else if (to == 0 && from == 0) {
             return 1;
         }
-        holder = holder->next;        
+    }
+    if (caller == FILTER && checkRecur(comp,from,to) == 1) {
+        return 1;
     }
     for (int i = 0; i<comp->ncomps; i++) {
         toReturn = checkDate(comp->comp[i],from,to,caller);
@@ -522,6 +1463,52 @@ int checkDate (CalComp * comp, time_t from, time_t to, ComType caller) {
     return toReturn;
 }
 
+int checkRecur (CalComp * comp, time_t from, time_t to) {
+    CalRecur * recur;
+    time_t start, length;
+    int toReturn = 0;
+
+    if ((strcmp(comp->name,"VEVENT") != 0 && strcmp(comp->name,"VTODO") != 0 && 
+      strcmp(comp->name,"VJOURNAL") != 0) || !calCompRecurs(comp)) {
+        return 0;
+    }
+    recur = newCalRecur(comp);
+    if (recur == NULL) {
+        return 0;
+    }
+    length = compLength(comp);
+    if (from != 0) {
+        calRecurSkip(recur,from-length);
+    }
+    while (toReturn == 0 && calRecurNext(recur,to,&start) && (to == 0 || start <= to)) {
+        if (from == 0 || start >= from || (start+length >= from && (to == 0 || start+length <= to))) {
+            toReturn = 1;
+        }
+    }
+    freeCalRecur(recur);
+    return toReturn;
+}
+
+time_t compLength (CalComp * comp) {
+    CalProp * holder;
+    time_t start = 0, end = 0, length = 0;
+
+    for (int i = 0; i < comp->nprops; i++) {
+        holder = calCompProp(comp,i);
+        if (holder->kind == PROP_DTSTART) {
+            start = calPropTime(holder);
+        } else if (holder->kind == PROP_DTEND || holder->kind == PROP_DUE) {
+            end = calPropTime(holder);
+        } else if (holder->kind == PROP_DURATION && parseCalDuration(holder->value,&length) != OK) {
+            length = 0;
+        }
+    }
+    if (start != 0 && end > start) {
+        length = end - start;
+    }
+    return length > 0 ? length : 0;
+}
+
 CalProp * copyProp (CalProp * prop) {
     CalProp * propCopy;
     CalParam * paramHolder;
@@ -536,9 +1523,14 @@ CalProp * copyProp (CalProp * prop) {
     propCopy->value = malloc(sizeof(char)*strlen(prop->value)+1); 
     assert(propCopy->value != NULL);
     propCopy->next = NULL;  
+    propCopy->kind = prop->kind;
+    //a TZID time is read again with the zones of the tree it goes to
+    propCopy->timed = false;
     strncpy(propCopy->name,prop->name,strlen(prop->name)+1);
     strncpy(propCopy->value,prop->value,strlen(prop->value)+1);
     propCopy->param = NULL;   
+    propCopy->paramv = NULL;
+    propCopy->nparams = 0;
     while (paramHolder != NULL) {
         paramCopy = copyParam(paramHolder);
         addParam(propCopy,paramCopy);
@@ -556,6 +1548,7 @@ CalParam * copyParam (CalParam * param) {
     paramCopy->name = malloc(sizeof(char)*strlen(param->name)+1);
     assert(paramCopy->name != NULL);
     paramCopy->nvalues = param->nvalues;
+    paramCopy->kind = param->kind;
     paramCopy->next = NULL;
     strncpy(paramCopy->name,param->name,strlen(param->name)+1);
     for (int i = 0; i<paramCopy->nvalues; i++) {
@@ -566,22 +1559,6 @@ CalParam * copyParam (CalParam * param) {
     return paramCopy;
 }
 
-void addParam (CalProp * prop, CalParam * param) {
-    CalParam * nextP; 
- 
-    nextP = prop->param;
- 
-    if (nextP != NULL) {
-        while (nextP->next != NULL) {
-            nextP = nextP->next;
-        }   
-        nextP->next = param;
-    } else {
-        prop->param = param;
-    }        
-    prop->nparams++;
-}
-
 /*
 Get comp details recursively
 INPUT: component to search, cal details struct, nest level
@@ -610,12 +1587,50 @@ OUTPUT: int indicating compare result
 */
 int nameCompare (const void * a, const void * b);
 
+void calInfoDetails(const CalComp * comp, InfoDetails * const details) {
+    int distinct = 0;
+
+    calUseZones(comp);
+    details->events = 0;
+    details->todos = 0;
+    details->others = 0;
+    details->subComps = 0;
+    details->props = comp->nprops;
+    details->orgSize = 0;
+    details->orgRoom = MAX_ORG;
+    details->from = 0;
+    details->to = 0;
+    details->organizers = malloc(sizeof(char *)*MAX_ORG);
+    assert(details->organizers != NULL);
+    for (int i = 0; i < comp->ncomps; i++) {
+        countComp(comp->comp[i],details,1,"CAL");
+    }
+    //names in order of first letter, each once
+    qsort(details->organizers,details->orgSize,sizeof(char*),nameCompare);
+    for (int i = 0; i < details->orgSize; i++) {
+        if (distinct > 0 && strcmp(details->organizers[distinct-1],details->organizers[i]) == 0) {
+            free(details->organizers[i]);
+        } else {
+            details->organizers[distinct] = details->organizers[i];
+            distinct++;
+        }
+    }
+    details->orgSize = distinct;
+}
+
+void freeInfoDetails(InfoDetails * const details) {
+    for (int k = 0; k < details->orgSize; k++) {
+        free(details->organizers[k]);
+    }
+    free(details->organizers);
+}
+
 CalStatus calInfo(const CalComp * comp, int lines, FILE * const txtfile) {
     CalStatus toReturn;
     char toPrint[MAX_DATESTRING];
     char fromPrint[MAX_DATESTRING];
-    InfoDetails details = {.events = 0, .todos = 0, .others = 0, .props = 0, 
-      .subComps = 0, .orgSize = 0, .to = 0, .from = 0, .toStruct = NULL, .fromStruct = NULL};
+    InfoDetails details;
+    struct tm timeStruct;
     char lineBuilder[6] = "lines\0";
     char compBuilder[11] = "components\0";
     char eventBuilder[7] = "events\0";
@@ -623,23 +1638,11 @@ CalStatus calInfo(const CalComp * comp, int lines, FILE * const txtfile) {
     char otherBuilder[7] = "others\0";
     char subBuilder[14] = "subcomponents\0";
     char propBuilder[11] = "properties\0";
-    char orgHolder[MAX_ORGNAME] = {'\0'};
  
-    details.organizers = malloc(sizeof(char *)*MAX_ORG);
-    assert(details.organizers != NULL);
-    details.toStruct = malloc(sizeof(struct tm*));
-    assert(details.toStruct != NULL);
-    details.fromStruct = malloc(sizeof(struct tm*));
-    assert(details.fromStruct != NULL);
-    details.toStruct[0] = NULL;
-    details.fromStruct[0] = NULL;
     toReturn.code = OK;
     toReturn.lineto = 0;
     toReturn.linefrom = 0; 
-    details.props = details.props + comp->nprops;
-    for (int i = 0; i < comp->ncomps; i++) {
-        countComp(comp->comp[i],&details,1,"CAL");
-    } 
+    calInfoDetails(comp,&details);
     //print info 
     if (lines == 1) {
         lineBuilder[4] = '\0';
@@ -693,15 +1696,14 @@ CalStatus calInfo(const CalComp * comp, int lines, FILE * const txtfile) {
             toReturn.lineto++; 
         }
     } else {
-        strftime(toPrint,MAX_DATESTRING,"%Y-%b-%d",details.toStruct[0]);
-        strftime(fromPrint,MAX_DATESTRING,"%Y-%b-%d",details.fromStruct[0]);
+        strftime(toPrint,MAX_DATESTRING,"%Y-%b-%d",localtime_r(&details.to,&timeStruct));
+        strftime(fromPrint,MAX_DATESTRING,"%Y-%b-%d",localtime_r(&details.from,&timeStruct));
         if (fprintf(txtfile,"From %s to %s\n",fromPrint,toPrint) < 0) {
             toReturn.code = IOERR;
         } else {
             toReturn.lineto++; 
         }
     }
-    qsort(details.organizers,details.orgSize,sizeof(char*),nameCompare);
     if (details.orgSize != 0) {
         if (fprintf(txtfile,"Organizers:\n") < 0) {
             toReturn.code = IOERR;
@@ -716,35 +1718,21 @@ CalStatus calInfo(const CalComp * comp, int lines, FILE * const txtfile) {
         }
     }
     for (int i = 0; i < details.orgSize; i++) {
-        if (strcmp(orgHolder,details.organizers[i]) != 0) {
-           if (fprintf(txtfile,"%s\n",details.organizers[i]) < 0) {
-               toReturn.code = IOERR;
-           } else {
-               toReturn.lineto++; 
-           } 
-           strncpy(orgHolder,details.organizers[i],MAX_ORGNAME);
-        }
-    }
-    //free
-    for (int k = 0; k<details.orgSize; k++) {
-        free(details.organizers[k]);
-    } 
-    free(details.organizers);
-    if (details.toStruct[0] != NULL) {
-        free(details.toStruct[0]);
-    }
-    free(details.toStruct);
-    if (details.fromStruct[0] != NULL) {
-        free(details.fromStruct[0]);
+        if (fprintf(txtfile,"%s\n",details.organizers[i]) < 0) {
+            toReturn.code = IOERR;
+        } else {
+            toReturn.lineto++; 
+        } 
     }
-    free(details.fromStruct); 
+    freeInfoDetails(&details);
     toReturn.linefrom = toReturn.lineto;
     return toReturn;        
 }
 
 /*
-Compare function for date qsort
-INPUT: two dates to compare
+Compare function for date qsort; events at the same time keep the
+order they were found in
+INPUT: two ExtractEvent to compare
 OUTPUT: result of compare
 */
 int eDateCompare (const void * a, const void * b);
@@ -758,84 +1746,138 @@ int xCompare (const void * a, const void * b);
 
 /*
 Find all X- properties
-INPUT: component to search, storage list for X-, number of props in storage
+INPUT: component to search, storage list for X- (grown as needed), number of
+       props in storage, room in it
 OUTPUT: New starage count
 */
-int lookForX (const CalComp * comp, char ** list,int count);
+int lookForX (const CalComp * comp, char *** plist, int count, int * room);
+
+/*
+Offer an event to the list extract prints. Without a limit the list
+grows to take it; with one the list is a heap of the earliest events
+seen, latest on top, and the event replaces the top if before it
+INPUT: list, start time, summary
+OUTPUT: NA
+*/
+void addExtractEvent (ExtractList * list, time_t time, const char * summary);
+
+/*
+Check whether an event starting at a time would be kept
+INPUT: list, start time
+OUTPUT: true if addExtractEvent would keep it
+*/
+bool extractWants (const ExtractList * list, time_t time);
+
+/*
+Latest start a rule need be searched to for a list: the last event kept
+once a limited list is full, else the horizon
+INPUT: list, horizon (0 for none)
+OUTPUT: bound for calRecurNext, 0 for none
+*/
+time_t extractBound (const ExtractList * list, time_t horizon);
+
+/*
+Restore the heap order of a limited list after an event moved
+INPUT: heap, its size, position of the event
+OUTPUT: NA
+*/
+void extractHeapUp (ExtractEvent * heap, int i);
+void extractHeapDown (ExtractEvent * heap, int n, int i);
+
+/*
+Find the events that replace one occurrence of a recurring event
+INPUT: calendar, where to put the number found
+OUTPUT: RECURRENCE-IDs with their UIDs, sorted by UID
+*/
+RecurOverride * findOverrides (const CalComp * comp, int * noverrides);
+
+/*
+Sort overrides by UID, then time
+INPUT: two RecurOverride
+OUTPUT: compare result
+*/
+int overrideCompare (const void * a, const void * b);
+
+/*
+Find the overrides of one recurring event
+INPUT: overrides sorted by overrideCompare, their number, UID
+OUTPUT: index of the first with that UID (n if none)
+*/
+int findOverride (const RecurOverride * overrides, int n, const char * uid);
+
+/*
+Read what extract lists from an event
+INPUT: event, where to put its DTSTART time, SUMMARY ("(na)" if none) and UID
+OUTPUT: NA
+*/
+void readExtractEvent (const CalComp * event, time_t * time, const char ** summary, 
+  const char ** uid);
+
+/*
+Write one "date: summary" line of an event extract
+INPUT: output file, time, summary
+OUTPUT: OK or IOERR
+*/
+CalError writeExtractLine (FILE * txtfile, time_t time, const char * summary);
+
+/*
+Hold an event for calExtractStream, first writing the records held to
+disk as a run if they would go over budget
+INPUT: runs, start time, summary, UID of a recurring event (or NULL)
+OUTPUT: OK or IOERR
+*/
+CalError addRunRecord (ExtractRuns * runs, time_t time, const char * summary, const char * uid);
+
+/*
+Sort the records held and write them to a temporary file as a run
+INPUT: runs
+OUTPUT: OK or IOERR
+*/
+CalError writeRun (ExtractRuns * runs);
+
+/*
+Write a record to a run, and read the next one back
+INPUT: file, record / reader
+OUTPUT: OK or IOERR / false at the end of the run
+*/
+CalError writeRunRecord (FILE * file, const RunRecord * record);
+bool readRunRecord (RunReader * reader);
+
+/*
+Merge sorted runs, into one run or into extract lines; lines leave out
+occurrences an override replaced and stop at the limit
+INPUT: runs, how many, output file, whether to write lines, overrides
+       and their number, limit (0 = none), where to count lines
+OUTPUT: OK or IOERR
+*/
+CalError mergeRuns (FILE ** files, int nfiles, FILE * out, bool lines, 
+  const RecurOverride * overrides, int noverrides, int limit, int * nlines);
+
+/*
+Order run records by time, then order found; and keep a heap of runs
+being merged in that order of their next records
+INPUT: two RunRecord / heap, its size, position of the run that moved
+OUTPUT: compare result / NA
+*/
+int runRecordCompare (const void * a, const void * b);
+void runHeapDown (RunReader ** heap, int n, int i);
 
 CalStatus calExtract(const CalComp * comp, CalOpt kind, FILE * const txtfile) {
     CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
-    ExtractEvent ** eventList;
-    int eListCount = 0;
-    CalProp * propHolder;
-    char date[MAX_DATESTRING] = {'\0'};
     int xListCount = 0;
     char ** xList;
-    char xHolder[MAX_XNAME] = {'\0'};
     
     if (kind == OEVENT) {
-        eventList = malloc(sizeof(ExtractEvent*)*MAX_EVENTS);      
-        assert(eventList != NULL);
-        for (int i = 0; i<comp->ncomps; i++) {
-            if (strcmp(comp->comp[i]->name,"VEVENT") == 0 && kind == OEVENT) {
-                eventList[eListCount] = malloc(sizeof(ExtractEvent));
-                assert(eventList[eListCount] != NULL);
-                eventList[eListCount]->timeStruct = malloc(sizeof(struct tm*));
-                assert(eventList[eListCount]->timeStruct != NULL);
-                eventList[eListCount]->summary = malloc(sizeof(char)*MAX_SUMMARY);
-                assert(eventList[eListCount]->summary != NULL);
-                strncpy(eventList[eListCount]->summary,"\0",MAX_SUMMARY);
-                propHolder = comp->comp[i]->prop;
-                while (propHolder != NULL) {
-                    if (strcmp(propHolder->name,"DTSTART") == 0) {
-                         eventList[eListCount]->time = 
-                           findDate(propHolder,eventList[eListCount]->timeStruct,EXTRACT);
-                    }
-                    if (strcmp(propHolder->name,"SUMMARY") == 0) {
-                        strncpy(eventList[eListCount]->summary,propHolder->value,MAX_SUMMARY);
-                    }
-                    propHolder = propHolder->next;
-                }
-                if (strlen(eventList[eListCount]->summary) == 0) {
-                    strncpy(eventList[eListCount]->summary,"(na)",MAX_SUMMARY);
-                } 
-                eListCount++;
-            } 
-        }
-        qsort(eventList,eListCount,sizeof(ExtractEvent*),eDateCompare);
-        for (int j = 0; j<eListCount; j++) {
-            strftime(date,MAX_DATESTRING,"%Y-%b-%d %l:%M ",eventList[j]->timeStruct[0]);
-            if (eventList[j]->timeStruct[0]->tm_hour > 11) {
-                strcat(date,"PM");
-            } else {
-                strcat(date,"AM");
-            }
-            if (toReturn.code != IOERR) {
-                if (fprintf(txtfile,"%s: %s\n",date,eventList[j]->summary) < 0) {
-                    toReturn.code = IOERR;
-                } else {
-                    toReturn.lineto++;
-                }
-            }
-            free(eventList[j]->timeStruct[0]);
-            free(eventList[j]->timeStruct);
-            free(eventList[j]->summary);
-            free(eventList[j]);
-        }
-        free(eventList);
+        return calExtractEvents(comp,0,0,txtfile);
     } else {
-        xList = malloc(sizeof(char*)*MAX_XPROPS);
-        assert(xList != NULL);
-        xListCount = lookForX(comp,xList,xListCount);
-        qsort(xList,xListCount,sizeof(char*),xCompare);
+        xListCount = calExtractX(comp,&xList);
         for (int k = 0; k<xListCount; k++) {
-            if (toReturn.code == OK && strcmp(xList[k],xHolder) != 0) {
+            if (toReturn.code == OK) {
                 if (fprintf(txtfile,"%s\n",xList[k]) < 0) {
                     toReturn.code = IOERR;
                 } else {
                     toReturn.lineto++;
                 }
-                strncpy(xHolder,xList[k],MAX_XNAME);
             }
             free(xList[k]);
         }
@@ -845,22 +1887,243 @@ CalStatus calExtract(const CalComp * comp, CalOpt kind, FILE * const txtfile) {
     return toReturn;
 }
 
-int lookForX (const CalComp * comp, char ** list,int count) {
+int calExtractX(const CalComp * comp, char *** pnames) {
+    char ** xList;
+    int xListCount;
+    int distinct = 0;
+    int xRoom = MAX_XPROPS;
+
+    xList = malloc(sizeof(char*)*xRoom);
+    assert(xList != NULL);
+    xListCount = lookForX(comp,&xList,0,&xRoom);
+    qsort(xList,xListCount,sizeof(char*),xCompare);
+    for (int k = 0; k < xListCount; k++) {
+        if (distinct > 0 && strcmp(xList[distinct-1],xList[k]) == 0) {
+            free(xList[k]);
+        } else {
+            xList[distinct] = xList[k];
+            distinct++;
+        }
+    }
+    *pnames = xList;
+    return distinct;
+}
+
+CalStatus calExtractEvents(const CalComp * comp, time_t from, int limit, FILE * const txtfile) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    ExtractEvent * events;
+    int count;
+
+    count = calExtractList(comp,from,limit,&events);
+    for (int j = 0; j<count && toReturn.code == OK; j++) {
+        toReturn.code = writeExtractLine(txtfile,events[j].time,events[j].summary);
+        if (toReturn.code == OK) {
+            toReturn.lineto++;
+        }
+    }
+    free(events);
+    toReturn.linefrom = toReturn.lineto;
+    return toReturn;
+}
+
+int calExtractList(const CalComp * comp, time_t from, int limit, ExtractEvent ** pevents) {
+    ExtractList list = {.events = NULL, .count = 0, .room = 0, .limit = limit, .added = 0};
+    const char * summary;
+    const char * uid;
+    time_t time, horizon, ahead;
+    CalRecur * recur;
+    RecurOverride * overrides;
+    int noverrides;
+    bool first, bounded;
+
+    calUseZones(comp);
+    list.room = limit > 0 ? limit : EXTRACT_ROOM;
+    list.events = malloc(sizeof(ExtractEvent)*list.room);
+    assert(list.events != NULL);
+    overrides = findOverrides(comp,&noverrides);
+    horizon = (from != 0 ? from : getNowTime(DATE_FROM)) + EXTRACT_AHEAD;
+    for (int i = 0; i<comp->ncomps; i++) {
+        if (strcmp(comp->comp[i]->name,"VEVENT") == 0) {
+            readExtractEvent(comp->comp[i],&time,&summary,&uid);
+            recur = calCompRecurs(comp->comp[i]) ? newCalRecur(comp->comp[i]) : NULL;
+            if (recur == NULL) {
+                if (from == 0 || time >= from) {
+                    addExtractEvent(&list,time,summary);
+                }
+                continue;
+            }
+            //occurrences moved by a RECURRENCE-ID are listed by their own event
+            for (int j = uid == NULL ? noverrides : findOverride(overrides,noverrides,uid); 
+              j < noverrides && strcmp(overrides[j].uid,uid) == 0; j++) {
+                calRecurExclude(recur,overrides[j].time);
+            }
+            if (from != 0) {
+                calRecurSkip(recur,from);
+            }
+            //a limit stops a rule once it is past the events kept; without one
+            //an endless rule is listed a year ahead, but always shows its first time
+            first = true;
+            bounded = calRecurBounded(recur);
+            ahead = bounded ? 0 : time > horizon ? time : horizon;
+            while (calRecurNext(recur,extractBound(&list,ahead),&time) && 
+              (limit > 0 ? extractWants(&list,time) : bounded || first || time <= horizon)) {
+                addExtractEvent(&list,time,summary);
+                first = false;
+            }
+            freeCalRecur(recur);
+        } 
+    }
+    free(overrides);
+    qsort(list.events,list.count,sizeof(ExtractEvent),eDateCompare);
+    *pevents = list.events;
+    return list.count;
+}
+
+CalStatus calExtractStream (FILE * const ics, time_t from, int limit, size_t budget, 
+  FILE * const txtfile, CalStatus * readStatus) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    ExtractRuns runs = {.budget = budget, .used = 0, .records = NULL, .nrecords = 0, 
+      .recordRoom = 0, .seq = 0, .files = NULL, .nfiles = 0, .fileRoom = 0};
+    CalParser * parser;
+    CalEvent event;
+    CalComp * comp;
+    CalProp * holder;
+    RecurOverride * overrides = NULL;
+    int noverrides = 0;
+    int overrideRoom = 0;
+    CalRecur * recur;
+    const char * summary;
+    const char * uid;
+    time_t time, horizon, ahead, recurrenceId;
+    bool first, bounded;
+    FILE * merged;
+
+    horizon = (from != 0 ? from : getNowTime(DATE_FROM)) + EXTRACT_AHEAD;
+    calUseZones(NULL);
+    parser = newCalParser(ics,NULL);
+    do {
+        *readStatus = readCalEvent(parser,&event);
+        if (readStatus->code != OK) {
+            break;
+        }
+        if (event.kind != EVBEGIN || event.depth != 2 || (strcmp(event.name,"VEVENT") != 0 && 
+          strcmp(event.name,"VTIMEZONE") != 0)) {
+            continue;
+        }
+        *readStatus = readCalEventComp(parser,&event,&comp);
+        if (readStatus->code != OK) {
+            break;
+        }
+        if (strcmp(comp->name,"VTIMEZONE") == 0) {
+            calAddZone(comp);
+            continue;
+        }
+        readExtractEvent(comp,&time,&summary,&uid);
+        //an override may come after the event it replaces, so they are
+        //gathered here and taken out in the merge
+        recurrenceId = 0;
+        for (int i = 0; i < comp->nprops; i++) {
+            holder = calCompProp(comp,i);
+            if (holder->kind == PROP_RECURRENCE_ID) {
+                recurrenceId = calPropTime(holder);
+            }
+        }
+        if (uid != NULL && recurrenceId != 0) {
+            if (noverrides == overrideRoom) {
+                overrideRoom = overrideRoom == 0 ? 16 : overrideRoom*2;
+                overrides = realloc(overrides,sizeof(RecurOverride)*overrideRoom);
+                assert(overrides != NULL);
+            }
+            overrides[noverrides].uid = malloc(sizeof(char)*(strlen(uid)+1));
+            assert(overrides[noverrides].uid != NULL);
+            strcpy(overrides[noverrides].uid,uid);
+            overrides[noverrides].time = recurrenceId;
+            noverrides++;
+        }
+        recur = calCompRecurs(comp) ? newCalRecur(comp) : NULL;
+        if (recur == NULL) {
+            if (from == 0 || time >= from) {
+                toReturn.code = addRunRecord(&runs,time,summary,NULL);
+            }
+            continue;
+        }
+        if (from != 0) {
+            calRecurSkip(recur,from);
+        }
+        first = true;
+        bounded = calRecurBounded(recur);
+        ahead = bounded ? 0 : time > horizon ? time : horizon;
+        while (toReturn.code == OK && calRecurNext(recur,ahead,&time) && 
+          (bounded || first || time <= horizon)) {
+            toReturn.code = addRunRecord(&runs,time,summary,uid);
+            first = false;
+        }
+        freeCalRecur(recur);
+    } while (event.kind != EVDONE && toReturn.code == OK);
+    freeCalParser(parser);
+
+    if (readStatus->code == OK && toReturn.code == OK && runs.nrecords > 0) {
+        toReturn.code = writeRun(&runs);
+    }
+    //merge MERGE_WAY runs at a time into longer ones until one pass is left
+    while (readStatus->code == OK && toReturn.code == OK && runs.nfiles > MERGE_WAY) {
+        merged = tmpfile();
+        if (merged == NULL) {
+            toReturn.code = IOERR;
+            break;
+        }
+        toReturn.code = mergeRuns(runs.files,MERGE_WAY,merged,false,NULL,0,0,NULL);
+        for (int i = 0; i < MERGE_WAY; i++) {
+            fclose(runs.files[i]);
+        }
+        memmove(runs.files,runs.files+MERGE_WAY,sizeof(FILE*)*(runs.nfiles-MERGE_WAY));
+        runs.nfiles = runs.nfiles - MERGE_WAY + 1;
+        runs.files[runs.nfiles-1] = merged;
+    }
+    if (readStatus->code == OK && toReturn.code == OK) {
+        if (noverrides > 0) {
+            qsort(overrides,noverrides,sizeof(RecurOverride),overrideCompare);
+        }
+        toReturn.code = mergeRuns(runs.files,runs.nfiles,txtfile,true,overrides,noverrides,limit,
+          &toReturn.lineto);
+    }
+
+    for (int i = 0; i < runs.nrecords; i++) {
+        free(runs.records[i].summary);
+    }
+    free(runs.records);
+    for (int i = 0; i < runs.nfiles; i++) {
+        fclose(runs.files[i]);
+    }
+    free(runs.files);
+    for (int i = 0; i < noverrides; i++) {
+        free(overrides[i].uid);
+    }
+    free(overrides);
+    toReturn.linefrom = toReturn.lineto;
+    return toReturn;
+}
+
+int lookForX (const CalComp * comp, char *** plist, int count, int * room) {
     CalProp * propHolder;
     int addToCount = count;
 
-    propHolder = comp->prop;
-    while (propHolder != NULL) {
-        if (propHolder->name[0] == 'X' && propHolder->name[1] == '-') {
-            list[addToCount] = malloc(sizeof(char)*MAX_XNAME);
-            assert(list[addToCount] != NULL);
-            strncpy(list[addToCount],propHolder->name,MAX_XNAME);
+    for (int i = 0; i < comp->nprops; i++) {
+        propHolder = calCompProp(comp,i);
+        if (propHolder->kind == PROP_OTHER && propHolder->name[0] == 'X' && propHolder->name[1] == '-') {
+            if (addToCount == *room) {
+                *room = *room*2;
+                *plist = realloc(*plist,sizeof(char *)*(*room));
+                assert(*plist != NULL);
+            }
+            (*plist)[addToCount] = malloc(sizeof(char)*(strlen(propHolder->name)+1));
+            assert((*plist)[addToCount] != NULL);
+            strcpy((*plist)[addToCount],propHolder->name);
             addToCount++;
         }
-        propHolder = propHolder->next;
     }
     for (int i = 0; i<comp->ncomps; i++) {
-        addToCount = lookForX(comp->comp[i],list,addToCount);
+        addToCount = lookForX(comp->comp[i],plist,addToCount,room);
     }
     return addToCount;
 }
@@ -869,41 +2132,391 @@ int xCompare (const void * a, const void * b) {
     return strcmp(*(char**)a,*(char**)b);
 }
 
-int eDateCompare (const void * a, const void * b) {
-    time_t dateA,dateB = 0;
+void addExtractEvent (ExtractList * list, time_t time, const char * summary) {
+    ExtractEvent event = {.time = time, .summary = summary, .seq = list->added};
+
+    list->added++;
+    if (list->limit == 0) {
+        if (list->count == list->room) {
+            list->room = list->room*2;
+            list->events = realloc(list->events,sizeof(ExtractEvent)*list->room);
+            assert(list->events != NULL);
+        }
+        list->events[list->count] = event;
+        list->count++;
+    } else if (list->count < list->limit) {
+        list->events[list->count] = event;
+        extractHeapUp(list->events,list->count);
+        list->count++;
+    } else if (eDateCompare(&event,&list->events[0]) < 0) {
+        list->events[0] = event;
+        extractHeapDown(list->events,list->count,0);
+    }
+}
+
+bool extractWants (const ExtractList * list, time_t time) {
+    //a later event never goes before one kept, even at the same time
+    return list->limit == 0 || list->count < list->limit || time < list->events[0].time;
+}
 
-    ExtractEvent ** toCompA = (ExtractEvent**)a;
-    ExtractEvent ** toCompB = (ExtractEvent**)b;
-    dateA = toCompA[0]->time;
-    dateB = toCompB[0]->time;
+time_t extractBound (const ExtractList * list, time_t horizon) {
+    if (list->limit > 0) {
+        return list->count < list->limit ? 0 : list->events[0].time;
+    }
+    return horizon;
+}
+
+void extractHeapUp (ExtractEvent * heap, int i) {
+    ExtractEvent holder;
+
+    while (i > 0 && eDateCompare(&heap[(i-1)/2],&heap[i]) < 0) {
+        holder = heap[i];
+        heap[i] = heap[(i-1)/2];
+        heap[(i-1)/2] = holder;
+        i = (i-1)/2;
+    }
+}
+
+void extractHeapDown (ExtractEvent * heap, int n, int i) {
+    ExtractEvent holder;
+    int child;
+
+    while (2*i+1 < n) {
+        child = 2*i+1;
+        if (child+1 < n && eDateCompare(&heap[child],&heap[child+1]) < 0) {
+            child++;
+        }
+        if (eDateCompare(&heap[i],&heap[child]) >= 0) {
+            break;
+        }
+        holder = heap[i];
+        heap[i] = heap[child];
+        heap[child] = holder;
+        i = child;
+    }
+}
+
+RecurOverride * findOverrides (const CalComp * comp, int * noverrides) {
+    RecurOverride * overrides;
+    CalProp * holder;
+    char * uid;
+    time_t time;
+
+    overrides = malloc(sizeof(RecurOverride)*(comp->ncomps+1));
+    assert(overrides != NULL);
+    *noverrides = 0;
+    for (int i = 0; i < comp->ncomps; i++) {
+        uid = NULL;
+        time = 0;
+        for (int j = 0; j < comp->comp[i]->nprops; j++) {
+            holder = calCompProp(comp->comp[i],j);
+            if (holder->kind == PROP_UID) {
+                uid = holder->value;
+            } else if (holder->kind == PROP_RECURRENCE_ID) {
+                time = calPropTime(holder);
+            }
+        }
+        if (uid != NULL && time != 0) {
+            overrides[*noverrides].uid = uid;
+            overrides[*noverrides].time = time;
+            *noverrides = *noverrides + 1;
+        }
+    }
+    qsort(overrides,*noverrides,sizeof(RecurOverride),overrideCompare);
+    return overrides;
+}
+
+int overrideCompare (const void * a, const void * b) {
+    const RecurOverride * first = a;
+    const RecurOverride * second = b;
+    int order;
+
+    order = strcmp(first->uid,second->uid);
+    if (order == 0) {
+        order = first->time < second->time ? -1 : first->time > second->time;
+    }
+    return order;
+}
+
+int findOverride (const RecurOverride * overrides, int n, const char * uid) {
+    int low = 0;
+    int high = n;
+    int mid;
+
+    while (low < high) {
+        mid = (low+high)/2;
+        if (strcmp(overrides[mid].uid,uid) < 0) {
+            low = mid+1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+void readExtractEvent (const CalComp * event, time_t * time, const char ** summary, 
+  const char ** uid) {
+    CalProp * propHolder;
+
+    *time = 0;
+    *summary = "(na)";
+    *uid = NULL;
+    propHolder = event->prop;
+    while (propHolder != NULL) {
+        if (propHolder->kind == PROP_DTSTART) {
+             *time = findDate(propHolder,EXTRACT);
+        }
+        if (propHolder->kind == PROP_SUMMARY && strlen(propHolder->value) > 0) {
+            *summary = propHolder->value;
+        }
+        if (propHolder->kind == PROP_UID) {
+            *uid = propHolder->value;
+        }
+        propHolder = propHolder->next;
+    }
+}
+
+CalError writeExtractLine (FILE * txtfile, time_t time, const char * summary) {
+    char date[MAX_DATESTRING] = {'\0'};
+    struct tm timeStruct;
 
-    if (dateA > dateB) {
+    localtime_r(&time,&timeStruct);
+    strftime(date,MAX_DATESTRING,"%Y-%b-%d %l:%M ",&timeStruct);
+    if (timeStruct.tm_hour > 11) {
+        strcat(date,"PM");
+    } else {
+        strcat(date,"AM");
+    }
+    if (fprintf(txtfile,"%s: %s\n",date,summary) < 0) {
+        return IOERR;
+    }
+    return OK;
+}
+
+CalError addRunRecord (ExtractRuns * runs, time_t time, const char * summary, const char * uid) {
+    RunRecord * record;
+    size_t size;
+    CalError error;
+
+    size = strlen(summary)+1 + (uid == NULL ? 0 : strlen(uid)+1);
+    //the budget counts records and their text, not malloc's own overhead
+    if (runs->nrecords > 0 && runs->used + sizeof(RunRecord) + size > runs->budget) {
+        error = writeRun(runs);
+        if (error != OK) {
+            return error;
+        }
+    }
+    if (runs->nrecords == runs->recordRoom) {
+        runs->recordRoom = runs->recordRoom == 0 ? 1024 : runs->recordRoom*2;
+        runs->records = realloc(runs->records,sizeof(RunRecord)*runs->recordRoom);
+        assert(runs->records != NULL);
+    }
+    record = &runs->records[runs->nrecords];
+    record->time = time;
+    record->seq = runs->seq;
+    record->summary = malloc(sizeof(char)*size);
+    assert(record->summary != NULL);
+    strcpy(record->summary,summary);
+    record->uid = NULL;
+    if (uid != NULL) {
+        record->uid = record->summary + strlen(summary)+1;
+        strcpy(record->uid,uid);
+    }
+    runs->seq++;
+    runs->nrecords++;
+    runs->used = runs->used + sizeof(RunRecord) + size;
+    return OK;
+}
+
+CalError writeRun (ExtractRuns * runs) {
+    FILE * file;
+    CalError error = OK;
+
+    qsort(runs->records,runs->nrecords,sizeof(RunRecord),runRecordCompare);
+    file = tmpfile();
+    if (file == NULL) {
+        error = IOERR;
+    }
+    for (int i = 0; i < runs->nrecords; i++) {
+        if (error == OK) {
+            error = writeRunRecord(file,&runs->records[i]);
+        }
+        free(runs->records[i].summary);
+    }
+    runs->nrecords = 0;
+    runs->used = 0;
+    if (file != NULL) {
+        if (error == OK && fflush(file) != 0) {
+            error = IOERR;
+        }
+        if (runs->nfiles == runs->fileRoom) {
+            runs->fileRoom = runs->fileRoom == 0 ? 16 : runs->fileRoom*2;
+            runs->files = realloc(runs->files,sizeof(FILE*)*runs->fileRoom);
+            assert(runs->files != NULL);
+        }
+        runs->files[runs->nfiles] = file;
+        runs->nfiles++;
+    }
+    return error;
+}
+
+CalError writeRunRecord (FILE * file, const RunRecord * record) {
+    int lengths[2];
+
+    //time, order found, text lengths (-1 for no UID), then the text
+    lengths[0] = strlen(record->summary);
+    lengths[1] = record->uid == NULL ? -1 : (int)strlen(record->uid);
+    if (fwrite(&record->time,sizeof(time_t),1,file) != 1 || 
+      fwrite(&record->seq,sizeof(long),1,file) != 1 || fwrite(lengths,sizeof(int),2,file) != 2 ||
+      fwrite(record->summary,sizeof(char),lengths[0],file) != (size_t)lengths[0] ||
+      (lengths[1] > 0 && fwrite(record->uid,sizeof(char),lengths[1],file) != (size_t)lengths[1])) {
+        return IOERR;
+    }
+    return OK;
+}
+
+bool readRunRecord (RunReader * reader) {
+    RunRecord * record = &reader->record;
+    int lengths[2];
+    size_t size;
+
+    if (fread(&record->time,sizeof(time_t),1,reader->file) != 1 || 
+      fread(&record->seq,sizeof(long),1,reader->file) != 1 || 
+      fread(lengths,sizeof(int),2,reader->file) != 2) {
+        return false;
+    }
+    size = lengths[0]+1 + (lengths[1] < 0 ? 0 : lengths[1]+1);
+    if (size > reader->room) {
+        reader->room = size*2;
+        record->summary = realloc(record->summary,sizeof(char)*reader->room);
+        assert(record->summary != NULL);
+    }
+    if (fread(record->summary,sizeof(char),lengths[0],reader->file) != (size_t)lengths[0]) {
+        return false;
+    }
+    record->summary[lengths[0]] = '\0';
+    record->uid = NULL;
+    if (lengths[1] >= 0) {
+        record->uid = record->summary + lengths[0]+1;
+        if (fread(record->uid,sizeof(char),lengths[1],reader->file) != (size_t)lengths[1]) {
+            return false;
+        }
+        record->uid[lengths[1]] = '\0';
+    }
+    return true;
+}
+
+CalError mergeRuns (FILE ** files, int nfiles, FILE * out, bool lines, 
+  const RecurOverride * overrides, int noverrides, int limit, int * nlines) {
+    RunReader * readers;
+    RunReader ** heap;
+    RunRecord * record;
+    CalError error = OK;
+    bool replaced;
+    int nheap = 0;
+
+    readers = malloc(sizeof(RunReader)*(nfiles+1));
+    assert(readers != NULL);
+    heap = malloc(sizeof(RunReader*)*(nfiles+1));
+    assert(heap != NULL);
+    for (int i = 0; i < nfiles; i++) {
+        readers[i].file = files[i];
+        readers[i].record.summary = NULL;
+        readers[i].room = 0;
+        rewind(files[i]);
+        if (readRunRecord(&readers[i])) {
+            heap[nheap] = &readers[i];
+            nheap++;
+        }
+    }
+    for (int i = nheap/2-1; i >= 0; i--) {
+        runHeapDown(heap,nheap,i);
+    }
+    while (nheap > 0 && error == OK && (!lines || limit == 0 || *nlines < limit)) {
+        record = &heap[0]->record;
+        if (!lines) {
+            error = writeRunRecord(out,record);
+        } else {
+            replaced = false;
+            for (int j = record->uid == NULL ? noverrides : findOverride(overrides,noverrides,record->uid);
+              j < noverrides && strcmp(overrides[j].uid,record->uid) == 0; j++) {
+                replaced = replaced || overrides[j].time == record->time;
+            }
+            if (!replaced) {
+                error = writeExtractLine(out,record->time,record->summary);
+                if (error == OK) {
+                    *nlines = *nlines + 1;
+                }
+            }
+        }
+        if (!readRunRecord(heap[0])) {
+            heap[0] = heap[nheap-1];
+            nheap--;
+        }
+        runHeapDown(heap,nheap,0);
+    }
+    for (int i = 0; i < nfiles; i++) {
+        if (ferror(files[i])) {
+            error = IOERR;
+        }
+        free(readers[i].record.summary);
+    }
+    free(readers);
+    free(heap);
+    if (!lines && error == OK && fflush(out) != 0) {
+        error = IOERR;
+    }
+    return error;
+}
+
+int runRecordCompare (const void * a, const void * b) {
+    const RunRecord * first = a;
+    const RunRecord * second = b;
+
+    if (first->time != second->time) {
+        return first->time < second->time ? -1 : 1;
+    }
+    return first->seq < second->seq ? -1 : first->seq > second->seq;
+}
+
+void runHeapDown (RunReader ** heap, int n, int i) {
+    RunReader * holder;
+    int child;
+
+    while (2*i+1 < n) {
+        child = 2*i+1;
+        if (child+1 < n && runRecordCompare(&heap[child+1]->record,&heap[child]->record) < 0) {
+            child++;
+        }
+        if (runRecordCompare(&heap[i]->record,&heap[child]->record) <= 0) {
+            break;
+        }
+        holder = heap[i];
+        heap[i] = heap[child];
+        heap[child] = holder;
+        i = child;
+    }
+}
+
+int eDateCompare (const void * a, const void * b) {
+    const ExtractEvent * toCompA = a;
+    const ExtractEvent * toCompB = b;
+
+    if (toCompA->time > toCompB->time) {
         return 1;
-    } else if (dateA < dateB) {
+    } else if (toCompA->time < toCompB->time) {
         return -1;
     } else {
-        return 0;
+        return toCompA->seq - toCompB->seq;
     }
 }
 
-time_t findDate(CalProp * prop, struct tm ** timeStruct, ComType caller) {
-
-    timeStruct[0] = malloc(sizeof(struct tm));
-    assert(timeStruct[0] != NULL);
-    timeStruct[0]->tm_sec = 0;
-    timeStruct[0]->tm_min = 0;
-    timeStruct[0]->tm_hour = 0;
-    timeStruct[0]->tm_mday = 1;
-    timeStruct[0]->tm_mon = 0;
-    timeStruct[0]->tm_year = 0; 
+time_t findDate(CalProp * prop, ComType caller) {
 
-    if (strcmp(prop->name,"COMPLETED") == 0 || strcmp(prop->name,"DTEND") == 0 ||
-      strcmp(prop->name,"DUE") == 0 || strcmp(prop->name,"DTSTART") == 0 ||
-      (strcmp(prop->name,"CREATED") == 0 && caller != FILTER) || (strcmp(prop->name,"DTSTAMP") == 0 
-      && caller != FILTER) || (strcmp(prop->name,"LAST-MODIFIED") == 0 && caller != FILTER)) {
-        strptime(prop->value,"%Y%m%dT%H%M%S",(*timeStruct));
-        timeStruct[0]->tm_isdst = -1;
-        return mktime((*timeStruct));
+    if (prop->kind == PROP_COMPLETED || prop->kind == PROP_DTEND || prop->kind == PROP_DUE || 
+      prop->kind == PROP_DTSTART || (caller != FILTER && (prop->kind == PROP_CREATED || 
+      prop->kind == PROP_DTSTAMP || prop->kind == PROP_LAST_MODIFIED))) {
+        return calPropTime(prop);
     } else {
         return 0;
     } 
@@ -950,40 +2563,31 @@ void thruPropsInfo (CalComp * comp, InfoDetails * details) {
     CalProp * holder;
     char * orgToAdd;
     time_t time;
-    struct tm * timeStruct;
 
-    holder = comp->prop;
     orgToAdd = NULL;
-    while (holder != NULL) {
-        timeStruct = NULL; 
-        if (strcmp(holder->name,"ORGANIZER") == 0) {
+    for (int i = 0; i < comp->nprops; i++) {
+        holder = calCompProp(comp,i);
+        if (holder->kind == PROP_ORGANIZER) {
             if(findCN(holder,&orgToAdd) == 1) {
+                if (details->orgSize == details->orgRoom) {
+                    details->orgRoom = details->orgRoom*2;
+                    details->organizers = realloc(details->organizers,
+                      sizeof(char *)*details->orgRoom);
+                    assert(details->organizers != NULL);
+                }
                 details->organizers[details->orgSize] = orgToAdd;
                 details->orgSize = details->orgSize + 1;
             } 
         }
-        time = findDate(holder,&timeStruct,INFO);
+        time = findDate(holder,INFO);
         if (time > 0 && details->from == 0 && details->from == 0) {
             details->to = time;
             details->from = time;
-            details->toStruct[0] = timeStruct;
-            details->fromStruct[0] = timeStruct;
         } else if (time > details->to) {
-            if (details->fromStruct[0] != details->toStruct[0]) {
-                free(details->toStruct[0]);
-            }
             details->to = time;
-            details->toStruct[0] = timeStruct;
         } else if (time < details->from && time != 0) {
-            if (details->fromStruct[0] != details->toStruct[0]) {
-                free(details->fromStruct[0]);
-            }
             details->from = time;
-            details->fromStruct[0] = timeStruct;
-        } else {
-            free(timeStruct);
         }        
-        holder = holder->next;
     }
 }
 
@@ -993,7 +2597,7 @@ int findCN (CalProp * prop, char ** organizer) {
     holder = prop->param;
 
     while (holder != NULL) {
-        if (strcmp(holder->name,"CN") == 0) {
+        if (holder->kind == PARAM_CN) {
             *organizer = malloc(sizeof(char)*(strlen(holder->value[0])+1));
             assert(*organizer != NULL);
             strncpy(*organizer,holder->value[0],strlen(holder->value[0])+1);
@@ -1003,3 +2607,169 @@ int findCN (CalProp * prop, char ** organizer) {
     }
     return 0;
 }
+
+/*
+Add the files to read in a -batch run: a path, or the .ics files in a directory
+INPUT: file list, its size and room, path
+OUTPUT: NA
+*/
+void addBatchPath (BatchFile ** files, int * nfiles, int * room, const char * path);
+
+/*
+Hand out the files of a -batch run until none are left (thread body)
+INPUT: BatchQueue
+OUTPUT: NULL
+*/
+void * batchWorker (void * arg);
+
+/*
+Read one calendar of a -batch run
+INPUT: file to read and fill in
+OUTPUT: NA
+*/
+void readBatchFile (BatchFile * file);
+
+/*
+Pick out .ics names when reading a directory
+INPUT: directory entry
+OUTPUT: nonzero to keep the entry
+*/
+int icsEntry (const struct dirent * entry);
+
+typedef struct BatchQueue {     // files shared by the -batch workers
+    BatchFile * files;
+    int nfiles;
+    int next;                   // next file to hand out
+    pthread_mutex_t lock;       // guards next
+} BatchQueue;
+
+CalStatus calBatch(char * const * paths, int npaths, FILE * const txtfile) {
+    CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    BatchQueue queue = {.files = NULL, .nfiles = 0, .next = 0};
+    pthread_t * workers;
+    int room = 0;
+    int nworkers;
+
+    for (int i = 0; i < npaths; i++) {
+        addBatchPath(&queue.files,&queue.nfiles,&room,paths[i]);
+    }
+    nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers > queue.nfiles) {
+        nworkers = queue.nfiles;
+    }
+    if (nworkers < 1) {
+        nworkers = 1;
+    }
+    workers = malloc(sizeof(pthread_t)*nworkers);
+    assert(workers != NULL);
+    pthread_mutex_init(&queue.lock,NULL);
+    for (int i = 0; i < nworkers; i++) {
+        if (pthread_create(&workers[i],NULL,batchWorker,&queue) != 0) {
+            nworkers = i;
+            break;
+        }
+    }
+    //no threads at all: read them here
+    if (nworkers == 0) {
+        batchWorker(&queue);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        pthread_join(workers[i],NULL);
+    }
+    pthread_mutex_destroy(&queue.lock);
+
+    //report in the order given
+    for (int i = 0; i < queue.nfiles; i++) {
+        if (!queue.files[i].opened) {
+            fprintf(txtfile,"%s: could not be opened\n",queue.files[i].path);
+            if (toReturn.code == OK) {
+                toReturn.code = IOERR;
+            }
+        } else if (queue.files[i].status.code != OK) {
+            fprintf(txtfile,"%s: read calendar failed with code:%d line %d\n",queue.files[i].path,
+              queue.files[i].status.code,queue.files[i].status.lineto);
+            if (toReturn.code == OK) {
+                toReturn = queue.files[i].status;
+            }
+        } else {
+            fprintf(txtfile,"%s: %d components\n",queue.files[i].path,queue.files[i].ncomps);
+        }
+        free(queue.files[i].path);
+    }
+    free(queue.files);
+    free(workers);
+    return toReturn;
+}
+
+void addBatchPath (BatchFile ** files, int * nfiles, int * room, const char * path) {
+    struct stat info;
+    struct dirent ** entries;
+    int nentries;
+    char * fullPath;
+
+    if (stat(path,&info) == 0 && S_ISDIR(info.st_mode)) {
+        nentries = scandir(path,&entries,icsEntry,alphasort);
+        for (int i = 0; i < nentries; i++) {
+            fullPath = malloc(sizeof(char)*(strlen(path)+strlen(entries[i]->d_name)+2));
+            assert(fullPath != NULL);
+            sprintf(fullPath,"%s/%s",path,entries[i]->d_name);
+            addBatchPath(files,nfiles,room,fullPath);
+            free(fullPath);
+            free(entries[i]);
+        }
+        if (nentries >= 0) {
+            free(entries);
+        }
+        return;
+    }
+    if (*nfiles == *room) {
+        *room = (*room == 0) ? 64 : *room*2;
+        *files = realloc(*files,sizeof(BatchFile)*(*room));
+        assert(*files != NULL);
+    }
+    (*files)[*nfiles].path = malloc(sizeof(char)*(strlen(path)+1));
+    assert((*files)[*nfiles].path != NULL);
+    strcpy((*files)[*nfiles].path,path);
+    (*files)[*nfiles].opened = false;
+    (*files)[*nfiles].ncomps = 0;
+    *nfiles = *nfiles+1;
+}
+
+int icsEntry (const struct dirent * entry) {
+    int length = strlen(entry->d_name);
+
+    return length > 4 && strcasecmp(entry->d_name+length-4,".ics") == 0;
+}
+
+void * batchWorker (void * arg) {
+    BatchQueue * queue = arg;
+    int i;
+
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        i = queue->next;
+        queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (i >= queue->nfiles) {
+            break;
+        }
+        readBatchFile(&queue->files[i]);
+    }
+    return NULL;
+}
+
+void readBatchFile (BatchFile * file) {
+    FILE * ics;
+    CalComp * comp;
+
+    if ((ics = fopen(file->path,"r")) == NULL) {
+        return;
+    }
+    file->opened = true;
+    file->status = readCalFileMapped(ics,&comp);
+    if (file->status.code == OK) {
+        file->ncomps = comp->ncomps;
+        freeCalComp(comp);
+    }
+    fclose(ics);
+}
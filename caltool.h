@@ -8,10 +8,12 @@ Geofferson Camp (gcamp@mail.uoguelph.ca)
 #ifndef CALTOOL_H
 #define CALTOOL_H A2_RevA
 
+#ifndef _GNU_SOURCE
 #define _GNU_SOURCE     // for getdate_r
-#define _XOPEN_SOURCE   // for strptime
+#endif
 #include <time.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include "calutil.h"
 
 /* Symbols used to send options to command execution modules */
@@ -28,6 +30,7 @@ typedef enum {
     EXTRACT,
     FILTER,
     COMBINE,
+    BATCH,
     NONE,
 } ComType;
 
@@ -37,25 +40,154 @@ typedef struct InfoDetails {
     int others;
     int subComps;
     int props;
-    char ** organizers;
+    char ** organizers;     // CNs, by first letter, each once (calInfoDetails)
     int orgSize;
-    struct tm ** toStruct;
-    struct tm ** fromStruct;
+    int orgRoom;            // room at organizers
     time_t from;
     time_t to;
 } InfoDetails;
 
+typedef struct CompTableEntry {    // one identity in a CompTable
+    char * key;         // component name, UID and RECURRENCE-ID (NULL if slot free)
+    unsigned long hash;
+    int input;          // where the version kept was found:
+    int ordinal;        // which input, and which component in it
+    long sequence;      // its SEQUENCE
+    time_t modified;    // its LAST-MODIFIED
+} CompTableEntry;
+
+typedef struct CompTable {  // versions -combine keeps, by open addressing
+    CompTableEntry * slots;
+    int size;           // a power of two
+    int count;          // keys held
+    int dropped;        // versions that lost to another of the same key
+} CompTable;
+
+typedef struct CombineInput {
+    CalParser * parser;
+    CalComp * comp;     // next component to write (NULL when none left)
+    time_t start;       // its DTSTART, for an ordered merge
+    CalStatus status;   // read status
+    int number;         // position among the inputs
+    int ordinal;        // components read so far
+    const CompTable * table;    // versions to keep, NULL to keep all
+} CombineInput;
+
+typedef struct BatchFile {  // one calendar of a -batch run
+    char * path;
+    bool opened;
+    CalStatus status;   // readCalFile's result
+    int ncomps;         // components in the calendar
+} BatchFile;
+
+typedef struct IndexDate {  // one date of an indexed component
+    time_t time;
+    int comp;           // the component's index in the calendar's comp[]
+} IndexDate;
+
+typedef struct IndexSpan {  // when a recurring component's occurrences can fall
+    time_t from;        // its first start
+    time_t to;          // its last end, 0 if it has no end
+    int comp;
+} IndexSpan;
+
+typedef struct CalIndex {   // dates of a calendar's events or todos, in order
+    const CalComp * cal;    // calendar indexed (not owned, must outlive the index)
+    CalOpt content;         // OEVENT or OTODO
+    int ndates;
+    IndexDate * dates;      // every date in those components, sorted by time
+    int ncomps;
+    int * comps;            // the components themselves, for an open range
+    int nrecur;
+    IndexSpan * recur;      // those with RRULE or RDATE by first start, walked if a range meets them
+} CalIndex;
+
 typedef struct ExtractEvent {
     time_t time;
-    struct tm ** timeStruct;
-    char * summary;
+    const char * summary;   // the event's SUMMARY (not copied) or "(na)"
+    int seq;                // order found, to break ties in time
 } ExtractEvent;
 
+typedef struct ExtractList {    // events -extract e prints
+    ExtractEvent * events;
+    int count;
+    int room;
+    int limit;          // keep only the earliest limit events (0 = all)
+    int added;          // events offered so far
+} ExtractList;
+
+typedef struct RecurOverride {  // a RECURRENCE-ID replacing one occurrence
+    char * uid;
+    time_t time;
+} RecurOverride;
+
+typedef struct RunRecord {  // an extract line on its way through a sorted run
+    time_t time;
+    long seq;           // order found, to break ties in time
+    char * summary;     // malloced, with uid after it
+    char * uid;         // UID of a recurring event's occurrence, else NULL
+} RunRecord;
+
+typedef struct RunReader {  // a run being merged, and its next record
+    FILE * file;
+    RunRecord record;
+    size_t room;        // bytes at record.summary
+} RunReader;
+
+typedef struct ExtractRuns {    // calExtractStream's events, sorted a run at a time
+    size_t budget;      // bytes of records held before they go to disk
+    size_t used;
+    RunRecord * records;
+    int nrecords, recordRoom;
+    long seq;           // records added so far
+    FILE ** files;      // runs written out, as temporary files
+    int nfiles, fileRoom;
+} ExtractRuns;
+
 /* iCalendar tool functions */
 
 CalStatus calInfo( const CalComp *comp, int lines, FILE *const txtfile );
 CalStatus calExtract( const CalComp *comp, CalOpt kind, FILE *const txtfile );
+CalStatus calExtractEvents( const CalComp *comp, time_t from, int limit, FILE *const txtfile );
+CalStatus calExtractStream( FILE *const ics, time_t from, int limit, size_t budget, FILE *const txtfile, CalStatus *const readStatus );
 CalStatus calFilter( const CalComp *comp, CalOpt content, time_t datefrom, time_t dateto, FILE *const icsfile );
-CalStatus calCombine( const CalComp *comp1, const CalComp *comp2, FILE *const icsfile );
+CalStatus calFilterStream( FILE *const ics, CalOpt content, time_t datefrom, time_t dateto, FILE *const icsfile, CalStatus *const readStatus );
+CalStatus calCombine( const CalComp *comp1, const CalComp *comp2, FILE *const icsfile, int *const dropped );
+CalStatus calBatch( char *const *paths, int npaths, FILE *const txtfile );
+CalStatus calCombineStream( FILE *const *ics, int nics, bool sorted, bool dedupe, FILE *const icsfile, CalStatus *const readStatus, int *const failed, int *const dropped );
+
+/* The tool functions' results as data, for use in process (CalModule).
+   Strings in them are malloced and freed with them, except extract
+   summaries, which point into the calendar. Calendars returned are
+   malloced trees, freed with freeCalComp. calParseDate reads a date as
+   the tool's from and to do (with DATEMSK, or "today"), giving -1 and
+   getdate_r's error on failure (DATE_NOMEM if out of memory);
+   calDateError says what went wrong. */
+
+#define DATE_NOMEM 6    // getdate_r's error when it runs out of memory
+
+void calInfoDetails( const CalComp *comp, InfoDetails *const details );
+void freeInfoDetails( InfoDetails *const details );
+int calExtractList( const CalComp *comp, time_t from, int limit, ExtractEvent **const pevents );
+int calExtractX( const CalComp *comp, char ***const pnames );
+CalComp *calFilterComp( const CalComp *comp, CalOpt content, time_t datefrom, time_t dateto );
+CalComp *calCombineComp( const CalComp *comp1, const CalComp *comp2, int *const dropped );
+time_t calParseDate( const char *text, bool end, int *const dateErr );
+const char *calDateError( int dateErr, const char *text );
+
+/* Date index. Built once over a calendar read into memory, it answers
+   repeated filter queries by binary search instead of a full scan; a
+   recurring component is only walked when a range meets the span from
+   its first start to its last end.
+   calIndexFind gives the matching components' indexes in comp[] (in
+   file order, in a malloced array the caller frees); calFilterIndex
+   writes what calFilter would for the same range, and calIndexComp
+   returns what calFilterComp would. */
+
+CalIndex * newCalIndex( const CalComp *comp, CalOpt content );
+int calIndexFind( const CalIndex *index, time_t datefrom, time_t dateto, int **const pfound );
+CalStatus calFilterIndex( const CalIndex *index, time_t datefrom, time_t dateto, FILE *const icsfile );
+CalComp *calIndexComp( const CalIndex *index, time_t datefrom, time_t dateto );
+void freeCalIndex( CalIndex *const index );
 
 #endif
@@ -7,6 +7,7 @@ Geofferson Camp (gcamp@mail.uoguelph.ca)
 writeCalComp added for A2
 ********/
 
+#define _GNU_SOURCE     // for fileno, ftello, madvise
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -14,327 +15,1165 @@ writeCalComp added for A2
 #include <stdbool.h>
 #include "calutil.h"
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #define BUFF_SIZE 6000
 #define NAME_SIZE 30
-#define SYM_SIZE 100
+#define TOKEN_PARAMS 16     // parameters tokenized before spilling to the heap
+#define TOKEN_VALUES 32     // parameter values likewise
 #define WRITE_GOOD 1
 #define WRITE_BAD -1
+#define ARENA_BLOCK 65536           // first arena block
+#define ARENA_BLOCK_MAX 4194304     // arena blocks stop doubling here
+#define ARENA_ALIGN 8               // pointer/time_t alignment
+#define CHUNK_MIN 1048576           // smaller files are read on one thread
+#define CHUNKS_PER_THREAD 4         // pieces queued per thread, to even out their sizes
+
+typedef struct CalBlock CalBlock;
+typedef struct CalBlock {   // one chunk of an arena
+    CalBlock *next;         // previously filled chunk
+    size_t size;            // bytes in data
+    size_t used;            // bytes handed out
+    char data[];
+} CalBlock;
+
+typedef struct TokenSpan {  // [from,to) offsets into a content line
+    int from;
+    int to;
+} TokenSpan;
+
+typedef struct ParamTokens {
+    TokenSpan name;
+    int firstValue;         // index of first value in PropTokens paramValue[]
+    int nvalues;
+} ParamTokens;
+
+typedef struct PropTokens { // offsets of the pieces of one content line
+    TokenSpan name;
+    TokenSpan value;
+    int nparams;
+    int nvalues;            // parameter values, all parameters together
+    int paramSize;          // room in param[]
+    int valueSize;          // room in paramValue[]
+    ParamTokens *param;     // -> paramStore until it overflows
+    TokenSpan *paramValue;  // -> valueStore until it overflows
+    bool begin;             // line is BEGIN:...
+    bool end;               // line is END:...
+    ParamTokens paramStore[TOKEN_PARAMS];
+    TokenSpan valueStore[TOKEN_VALUES];
+} PropTokens;
+
+typedef struct StreamState {    // stdio reader position, one per input
+    char buffer[BUFF_SIZE];     // physical line read ahead
+    int lineNumber;
+    bool EOFb4EOL;
+} StreamState;
+
+struct CalArena {
+    CalBlock *block;        // chunk being filled
+    CalComp *root;          // component whose freeCalComp releases the arena
+    void *last;             // most recent allocation (can grow in place)
+};
+
+static char *const propName[] = {   // shared names, indexed by CalPropKind
+    NULL, "ACTION", "ATTACH", "ATTENDEE", "CALSCALE", "CATEGORIES", "CLASS", 
+    "COMMENT", "COMPLETED", "CONTACT", "CREATED", "DESCRIPTION", "DTEND", "DTSTAMP", 
+    "DTSTART", "DUE", "DURATION", "EXDATE", "FREEBUSY", "GEO", "LAST-MODIFIED", 
+    "LOCATION", "METHOD", "ORGANIZER", "PERCENT-COMPLETE", "PRIORITY", "PRODID", 
+    "RDATE", "RECURRENCE-ID", "RELATED-TO", "REPEAT", "REQUEST-STATUS", "RESOURCES", 
+    "RRULE", "SEQUENCE", "STATUS", "SUMMARY", "TRANSP", "TRIGGER", "TZID", "TZNAME", 
+    "TZOFFSETFROM", "TZOFFSETTO", "TZURL", "UID", "URL", "VERSION",
+};
+#define NPROP_NAMES (int)(sizeof(propName)/sizeof(propName[0]))
+
+static char *const paramName[] = {  // shared names, indexed by CalParamKind
+    NULL, "ALTREP", "CN", "CUTYPE", "DELEGATED-FROM", "DELEGATED-TO", "DIR", 
+    "ENCODING", "FBTYPE", "FMTTYPE", "LANGUAGE", "MEMBER", "PARTSTAT", "RANGE", 
+    "RELATED", "RELTYPE", "ROLE", "RSVP", "SENT-BY", "TZID", "VALUE",
+};
+#define NPARAM_NAMES (int)(sizeof(paramName)/sizeof(paramName[0]))
 
 /*
-Print param
-INPUTS: CalParam
-OUTPUT: NA
+Look a name up in a sorted table of names, ignoring case
+INPUT: table (entry 0 unused), its size, name, its length
+OUTPUT: index of the name, 0 if not found
 */
-void printParam (char ** buff, CalParam * param);
+int findName (char *const * table, int size, const char * name, int len);
 
 /*
-Print property
-INPUTS: CalProp
-OUTPUT: NA
+Add bytes to a writer's buffer, writing it out whenever it fills
+INPUT: writer, bytes, their number
+OUTPUT: false if a write failed
+*/
+bool putWriter (CalWriter * writer, const char * text, size_t len);
+
+/*
+Write out what a writer has buffered
+INPUT: writer
+OUTPUT: false if the write failed
+*/
+bool flushWriter (CalWriter * writer);
+
+/*
+Add text to a content line, folding after FOLD_LEN octets but never
+inside a UTF-8 sequence
+INPUT: writer, text, its length, octets on the physical line so far
+OUTPUT: false if a write failed
+*/
+bool putFolded (CalWriter * writer, const char * text, size_t len, int * col);
+
+/*
+Buffer a component, its BEGIN line and properties, a property, or
+its END line, counting lines
+INPUT: writer, component or property
+OUTPUT: false if a write failed
+*/
+bool putComp (CalWriter * writer, const CalComp * comp);
+bool putBegin (CalWriter * writer, const CalComp * comp);
+bool putProp (CalWriter * writer, const CalProp * prop);
+bool putEnd (CalWriter * writer, const CalComp * comp);
+
+/*
+Give up on a write: drop what is buffered and report IOERR
+INPUT: writer
+OUTPUT: its status
 */
-void printProp (char ** buff,CalProp * prop);
+CalStatus failWriter (CalWriter * writer);
+
+static CalWriter legacyWriter;  // writeCalComp's line count, kept between calls
 
 CalStatus writeCalComp (FILE * const ics, const CalComp * comp) {
-    static CalStatus toReturn = {.code = OK, .lineto = 0, .linefrom = 0};
+    legacyWriter.ics = ics;
+    return calWriteComp(&legacyWriter,comp);
+}
+
+CalStatus writeCalBegin (FILE * const ics, const CalComp * comp) {
+    legacyWriter.ics = ics;
+    return calWriteBegin(&legacyWriter,comp);
+}
+
+CalStatus writeCalProp (FILE * const ics, const CalProp * prop) {
+    legacyWriter.ics = ics;
+    return calWriteProp(&legacyWriter,prop);
+}
+
+CalStatus writeCalEnd (FILE * const ics, const CalComp * comp) {
+    legacyWriter.ics = ics;
+    return calWriteEnd(&legacyWriter,comp);
+}
+
+void initCalWriter(CalWriter *const writer, FILE *const ics) {
+    writer->ics = ics;
+    writer->status.code = OK;
+    writer->status.linefrom = 0;
+    writer->status.lineto = 0;
+    writer->used = 0;
+}
+
+CalStatus calWriteComp(CalWriter *const writer, const CalComp *comp) {
+    if (!putComp(writer,comp) || !flushWriter(writer)) {
+        return failWriter(writer);
+    }
+    return writer->status;
+}
+
+CalStatus calWriteBegin(CalWriter *const writer, const CalComp *comp) {
+    if (!putBegin(writer,comp) || !flushWriter(writer)) {
+        return failWriter(writer);
+    }
+    return writer->status;
+}
+
+CalStatus calWriteProp(CalWriter *const writer, const CalProp *prop) {
+    if (!putProp(writer,prop) || !flushWriter(writer)) {
+        return failWriter(writer);
+    }
+    return writer->status;
+}
+
+CalStatus calWriteEnd(CalWriter *const writer, const CalComp *comp) {
+    if (!putEnd(writer,comp) || !flushWriter(writer)) {
+        return failWriter(writer);
+    }
+    return writer->status;
+}
+
+bool putComp (CalWriter * writer, const CalComp * comp) {
+    if (!putBegin(writer,comp)) {
+        return false;
+    }
+    //cycles through comps
+    for (int i = 0; i < comp->ncomps; i++) {
+        if (!putComp(writer,comp->comp[i])) {
+            return false;
+        }
+    }
+    return putEnd(writer,comp);
+}
+
+bool putBegin (CalWriter * writer, const CalComp * comp) {
     CalProp * holder;
-    char ** buff;
-    char tempBuffer[BUFF_SIZE] = {'\0'};
-    int foldCount = 0;
 
-    buff = malloc(sizeof(char*));
-    assert(buff != NULL);
-    holder = comp->prop;
-    if (fprintf(ics,"BEGIN:%s\r\n",comp->name) < 0) {
-        toReturn.code = IOERR;
-        toReturn.linefrom = toReturn.lineto;
-        free(buff);
-        return toReturn;
+    if (!putWriter(writer,"BEGIN:",6) || !putWriter(writer,comp->name,strlen(comp->name))
+      || !putWriter(writer,"\r\n",2)) {
+        return false;
     }
-    toReturn.lineto++;
-    toReturn.linefrom = toReturn.lineto;
+    writer->status.lineto++;
+    writer->status.linefrom = writer->status.lineto;
     //cycles through properties
+    holder = comp->prop;
     while (holder != NULL) {
-        buff[0] = calloc(BUFF_SIZE,sizeof(char)*BUFF_SIZE);
-        assert(buff[0] != NULL);
-        printProp(buff,holder);
-        while (strlen(buff[0])-2 > (foldCount+1)*FOLD_LEN) { 
-            if (strlen(tempBuffer) == 0) {
-                strncpy(tempBuffer,buff[0],FOLD_LEN);
-            } else {
-                if (foldCount == 1) {
-                    strncat(tempBuffer,buff[0]+((FOLD_LEN)*foldCount),FOLD_LEN-1);            
-                } else {
-                    strncat(tempBuffer,buff[0]+((FOLD_LEN-1)*foldCount)+1,FOLD_LEN-1);
-                }
-                
-            } 
-            strcat(tempBuffer,"\r\n ");
-            foldCount++;
-            toReturn.lineto++;
-        }
-        if (foldCount > 0) {
-            strncat(tempBuffer,buff[0]+((FOLD_LEN-1)*foldCount)+1,FOLD_LEN+3);
-            //strcat(tempBuffer,"\r\n\0");
-            strncpy(buff[0],tempBuffer,BUFF_SIZE);
-            foldCount = 0;
-            for (int j = 0; j < BUFF_SIZE; j++) {
-                tempBuffer[j] = '\0';
-            }
-        }       
-        if (fprintf(ics,"%s",buff[0]) < 0) {
-            toReturn.code = IOERR;
-            if (toReturn.lineto == toReturn.linefrom+1) {
-                toReturn.lineto--;
-            }
-            toReturn.linefrom = toReturn.lineto;
-            free(buff[0]);
-            free(buff);
-            return toReturn;
-        }
-        free(buff[0]);
-        toReturn.lineto++;
-        toReturn.linefrom = toReturn.lineto;
+        if (!putProp(writer,holder)) {
+            return false;
+        }
         holder = holder->next;
     }
-    //cycles through comps
-    for (int i = 0; i < comp->ncomps; i++) {
-        toReturn = writeCalComp(ics,comp->comp[i]);
-        if (toReturn.code == IOERR) {
-            toReturn.linefrom = toReturn.lineto;
-            free(buff);
-            return toReturn;
+    return true;
+}
+
+bool putProp (CalWriter * writer, const CalProp * prop) {
+    CalParam * param;
+    int col = 0;
+
+    if (!putFolded(writer,prop->name,strlen(prop->name),&col)) {
+        return false;
+    }
+    for (param = prop->param; param != NULL; param = param->next) {
+        if (!putFolded(writer,";",1,&col) || !putFolded(writer,param->name,strlen(param->name),&col)
+          || !putFolded(writer,"=",1,&col)) {
+            return false;
+        }
+        for (int i = 0; i < param->nvalues; i++) {
+            if (i != 0 && !putFolded(writer,",",1,&col)) {
+                return false;
+            }
+            if (!putFolded(writer,param->value[i],strlen(param->value[i]),&col)) {
+                return false;
+            }
         }
     }
-    if (fprintf(ics,"END:%s\r\n",comp->name) < 0) {
-        toReturn.code = IOERR;
-        toReturn.linefrom = toReturn.lineto;
-        free(buff);
-        return toReturn;
+    if (!putFolded(writer,":",1,&col) || !putFolded(writer,prop->value,strlen(prop->value),&col)
+      || !putWriter(writer,"\r\n",2)) {
+        return false;
     }
-    toReturn.lineto++;
-    toReturn.linefrom = toReturn.lineto;
-    free(buff);
-    return toReturn;   
+    writer->status.lineto++;
+    writer->status.linefrom = writer->status.lineto;
+    return true;
 }
 
-void printParam (char ** buff,CalParam * param) {
+bool putEnd (CalWriter * writer, const CalComp * comp) {
+    if (!putWriter(writer,"END:",4) || !putWriter(writer,comp->name,strlen(comp->name))
+      || !putWriter(writer,"\r\n",2)) {
+        return false;
+    }
+    writer->status.lineto++;
+    writer->status.linefrom = writer->status.lineto;
+    return true;
+}
 
-    strcat(buff[0],";");
-    strcat(buff[0],param->name);
-    strcat(buff[0],"="); 
-    for (int i = 0; i<param->nvalues; i++) {
-        if (i != 0) {
-            strcat(buff[0],",");
+bool putFolded (CalWriter * writer, const char * text, size_t len, int * col) {
+    size_t take;
+    int back;
+
+    while (len > 0) {
+        take = FOLD_LEN-*col;
+        if (take >= len) {
+            take = len;
+        } else {
+            //back up to the lead byte of a UTF-8 sequence (at most 3)
+            back = 0;
+            while (take > 0 && back < 3 && ((unsigned char)text[take] & 0xC0) == 0x80) {
+                take--;
+                back++;
+            }
+        }
+        if (take == 0) { //physical line is full
+            if (!putWriter(writer,"\r\n ",3)) {
+                return false;
+            }
+            writer->status.lineto++;
+            *col = 1;
+            continue;
+        }
+        if (!putWriter(writer,text,take)) {
+            return false;
         }
-        strcat(buff[0],param->value[i]);
+        *col = *col+take;
+        text = text+take;
+        len = len-take;
     }
+    return true;
 }
 
-void printProp (char ** buff,CalProp * prop) {
-    CalParam * forLoop;
+bool putWriter (CalWriter * writer, const char * text, size_t len) {
+    size_t room;
 
-    strncpy(buff[0],prop->name,BUFF_SIZE);
-    forLoop = prop->param;
-    while (forLoop != NULL) {
-        printParam(buff,forLoop);
-        forLoop = forLoop->next;
+    while (len > WRITE_BUFF-writer->used) {
+        room = WRITE_BUFF-writer->used;
+        memcpy(writer->buffer+writer->used,text,room);
+        writer->used = WRITE_BUFF;
+        if (!flushWriter(writer)) {
+            return false;
+        }
+        text = text+room;
+        len = len-room;
     }
-    strcat(buff[0],":");
-    strcat(buff[0],prop->value);
-    strcat(buff[0],"\r\n");
+    memcpy(writer->buffer+writer->used,text,len);
+    writer->used = writer->used+len;
+    return true;
+}
+
+bool flushWriter (CalWriter * writer) {
+    size_t used = writer->used;
+
+    writer->used = 0;
+    return used == 0 || fwrite(writer->buffer,1,used,writer->ics) == used;
+}
+
+CalStatus failWriter (CalWriter * writer) {
+    writer->used = 0;
+    writer->status.code = IOERR;
+    writer->status.linefrom = writer->status.lineto;
+    return writer->status;
 }
 
 /*
 Initialize CalComp components
-INPUT: Component double pointer, name of component
+INPUT: Component double pointer, name of component, arena (or NULL)
 OUTPUT: NA
 */
-void initCalComp (CalComp ** comp, char name[NAME_SIZE]);
+void initCalComp (CalComp ** comp, const char * name, CalArena * arena);
 
+/*
+Allocate from an arena, or malloc when there is none
+INPUT: arena (or NULL), bytes needed
+OUTPUT: address of the memory
+*/
+void * calAlloc (CalArena * arena, size_t size);
 
 /*
-Check component for required VERSION and PRODID specs
-INPUT: Component
+Resize an allocation made by calAlloc
+INPUT: arena (or NULL), allocation, its old and new sizes
+OUTPUT: address of the resized memory
+*/
+void * calGrow (CalArena * arena, void * ptr, size_t oldSize, size_t newSize);
+
+
+/*
+Where a parser gets its lines from: the stdio reader (readCalLine)
+or a mapped file (readCalMapLine)
+*/
+typedef struct LineSource {
+    FILE * ics;             // stream input, used when map is NULL
+    StreamState * stream;   // its reader position
+    CalMap * map;           // mapped input
+    char * held;            // last line malloced by readStreamLine
+} LineSource;
+
+/*
+readCalLine body, with the reader's position passed in
+INPUT: reader state, stream, line to set
+OUTPUT: CalStatus of the line
+*/
+CalStatus readStreamLine (StreamState * state, FILE * ics, char ** pbuff);
+
+/*
+Find the end of the physical line starting at pos
+INPUT: map, line offset, offset of following line to set, CRLF flag to set
+OUTPUT: length of the line without its EOL characters
+*/
+size_t mapPhysLine (CalMap * map, size_t pos, size_t * next, bool * crlf);
+
+static StreamState legacyStream;   // readCalLine's and readCalComp's position
+
+#define MAX_DEPTH 3     // VCALENDAR > component > subcomponent
+
+struct CalParser {
+    LineSource src;
+    StreamState stream;         // src.stream points here, except for readCalComp
+    CalMap map;                 // src.map points here when mapped
+    CalArena *arena;            // properties go here (NULL: malloc)
+    bool scratch;               // arena is ours, emptied before each line
+    PropTokens tok;             // tokens of the current line
+    int depth;                  // components open
+    int floor;                  // depth at which reading stops
+    char *name[MAX_DEPTH+1];    // names of the open components
+    int nameSize[MAX_DEPTH+1];  // bytes allocated for each name
+    int filled[MAX_DEPTH+1];    // properties + subcomponents seen in each
+    int nprodid;                // PRODIDs in VCALENDAR
+    int nversion;               // VERSIONs in VCALENDAR
+    bool goodVersion;           // last VERSION was VCAL_VER
+    int ncomps;                 // components in VCALENDAR
+    bool vcomp;                 // one of them is a V component
+    bool done;                  // nothing more to read
+    bool chunk;                 // reading one piece of a mapped file
+    bool view;                  // map is a view of a mapping it doesn't own
+    CalStatus status;           // final status, once done
+};
+
+typedef struct CalChunk {   // run of whole components in a mapped calendar
+    size_t from;            // offset of its first line
+    size_t to;              // offset just past its last line
+    int lines;              // physical lines before it
+    CalParser *parser;      // its parser, kept for the VCALENDAR counts
+    CalComp *comp;          // VCALENDAR holding what it read
+    CalStatus status;
+} CalChunk;
+
+typedef struct ChunkQueue { // chunks shared by readMapParallel's threads
+    CalMap *map;
+    CalChunk *chunk;
+    int nchunks;
+    int next;               // next chunk to hand out
+    pthread_mutex_t lock;   // guards next
+} ChunkQueue;
+
+/*
+Read the next unfolded content line from a source
+INPUT: source, line and length to set (line NULL at end of input)
+OUTPUT: CalStatus of the line
+*/
+CalStatus sourceLine (LineSource * src, const char ** pline, int * plen);
+
+/*
+Check for anything other than blank lines left in a source
+INPUT: source
+OUTPUT: true if nothing left
+*/
+bool sourceAtEnd (LineSource * src);
+
+/*
+Set up a parser at the start of a calendar
+INPUT: stream, arena for properties (NULL to malloc them), whether the
+       arena is scratch, whether to try mapping the stream
+OUTPUT: parser
+*/
+CalParser * makeParser (FILE * ics, CalArena * arena, bool scratch, bool tryMap);
+
+/*
+Read and check a whole calendar into a new arena tree
+INPUT: stream, component pointer to set, whether to try mapping the stream
+OUTPUT: CalStatus
+*/
+CalStatus readCalCalendar (FILE * ics, CalComp ** pcomp, bool tryMap);
+
+/*
+Read and check a whole calendar with a new parser, which it frees
+INPUT: parser, with an arena of its own, component pointer to set
+OUTPUT: CalStatus
+*/
+CalStatus readParserCalendar (CalParser * parser, CalComp ** pcomp);
+
+/*
+Read a calendar that's in memory, mapped or not, then close the map;
+on several threads if it's big enough
+INPUT: open map, component pointer to set, threads (0: one per CPU)
+OUTPUT: CalStatus
+*/
+CalStatus readMapParallel (CalMap * map, CalComp ** pcomp, int nthreads);
+
+/*
+Read a whole calendar from a map on this thread, leaving the map open
+INPUT: map, component pointer to set
+OUTPUT: CalStatus
+*/
+CalStatus readMapCalendar (CalMap * map, CalComp ** pcomp);
+
+/*
+Cut a mapped calendar into chunks at top-level BEGIN lines
+INPUT: map, chunk array to set, most chunks wanted
+OUTPUT: number of chunks
+*/
+int splitCal (CalMap * map, CalChunk ** pchunk, int want);
+
+/*
+Thread body of readMapParallel: read chunks until none are left
+INPUT: ChunkQueue
+OUTPUT: NULL
+*/
+void * chunkWorker (void * arg);
+
+/*
+Read one chunk of a mapped calendar into its own arena
+INPUT: map, chunk to read and fill in
+OUTPUT: NA
+*/
+void readChunk (CalMap * map, CalChunk * chunk);
+
+/*
+Stitch chunks read by readMapParallel into one calendar and check it
+INPUT: chunks, their number, component pointer to set, status to set
+OUTPUT: false if a chunk failed and the file has to be read serially
+*/
+bool joinChunks (CalChunk * chunk, int nchunks, CalComp ** pcomp, CalStatus * status);
+
+/*
+Point a component and its subcomponents at another arena
+INPUT: component, arena
+OUTPUT: NA
+*/
+void moveCompArena (CalComp * comp, CalArena * arena);
+
+/*
+Take over the blocks of another arena, which is freed
+INPUT: arena, arena to empty into it
+OUTPUT: NA
+*/
+void adoptArena (CalArena * arena, CalArena * from);
+
+/*
+Build components out of parser events, up to the END of the outermost
+INPUT: parser, outermost component (NULL to create it at its BEGIN), its depth
+OUTPUT: CalStatus
+*/
+CalStatus readCalTree (CalParser * parser, CalComp ** pcomp, int top);
+
+/*
+Open a component: push its name, uppercased
+INPUT: parser, name, its length
+OUTPUT: NA
+*/
+void pushName (CalParser * parser, const char * name, int len);
+
+/*
+Stop a parser, remembering why
+INPUT: parser, status to report from now on
+OUTPUT: the status
+*/
+CalStatus stopParser (CalParser * parser, CalStatus status);
+
+/*
+Check a finished calendar for VERSION, PRODID and V components
+INPUT: parser
 OUTPUT: CalError
 */
-CalError checkReq (CalComp * comp);
+CalError checkCal (CalParser * parser);
 
 /*
-check calendar for required components
-INPUT: component
+Split a content line and screen it for SYNTAX, marking BEGIN and END
+INPUT: line, its length, tokens to fill
 OUTPUT: CalError
 */
-CalError checkComps (CalComp * comp);
+CalError lexProp (const char * buff, int len, PropTokens * tok);
+
+/*
+Build a property out of a tokenized line
+INPUT: arena (or NULL), line, its tokens, property to fill
+OUTPUT: NA
+*/
+void buildProp (CalArena * arena, const char * buff, PropTokens * tok, CalProp * prop);
+
+/*
+Point tokens at their built in storage, or release what overflowed it
+INPUT: tokens
+OUTPUT: NA
+*/
+void initTokens (PropTokens * tok);
+void freeTokens (PropTokens * tok);
+
+/*
+Add component to parent component
+INPUT: parent CalComp, CalComp to add to parent
+OUTPUT: NA
+*/
+void addComp(CalComp ** rootComp, CalComp * compAdding);
+
+/*
+Room in an array grown by doubling
+INPUT: entries in it
+OUTPUT: the power of two at or above that
+*/
+int arraySlots (int n);
 
 CalStatus readCalFile(FILE *const ics, CalComp **const pcomp) {
+    return readCalCalendar(ics,pcomp,false);
+}
+
+CalStatus readCalFileMapped(FILE *const ics, CalComp **const pcomp) {
+    return readCalCalendar(ics,pcomp,true);
+}
+
+CalStatus readCalCalendar (FILE * ics, CalComp ** pcomp, bool tryMap) {
+    return readParserCalendar(makeParser(ics,newCalArena(),false,tryMap),pcomp);
+}
+
+CalStatus readParserCalendar (CalParser * parser, CalComp ** pcomp) {
+    CalArena * arena = parser->arena;
     CalStatus toReturn;
 
-    toReturn = readCalLine(NULL,NULL);
-    initCalComp(pcomp,NULL);    
-    toReturn = readCalComp(ics,pcomp);   
+    *pcomp = NULL;
+    toReturn = readCalTree(parser,pcomp,1);
+    freeCalParser(parser);
     if (toReturn.code == OK) {
-        toReturn.code = checkReq((*pcomp));
+        arena->root = *pcomp;
+    } else {
+        freeCalArena(arena);
+        *pcomp = NULL;
     }
-    if (toReturn.code == OK) {
-        toReturn.code = checkComps((*pcomp));
+    return toReturn;
+}
+
+CalStatus readCalFileParallel(FILE *const ics, CalComp **const pcomp, int nthreads) {
+    CalMap map;
+
+    //pipes and ttys go through the stdio reader
+    if (openCalMap(ics,&map).code != OK) {
+        return readCalCalendar(ics,pcomp,true);
+    }
+    return readMapParallel(&map,pcomp,nthreads);
+}
+
+CalStatus readCalBuffer(const char *const buff, size_t len, CalComp **const pcomp, int nthreads) {
+    CalMap map;
+
+    openCalBuffer(buff,len,&map);
+    return readMapParallel(&map,pcomp,nthreads);
+}
+
+CalStatus readMapCalendar (CalMap * map, CalComp ** pcomp) {
+    CalParser * parser;
+
+    //a view of the whole map, as readChunk makes of a piece
+    parser = makeParser(NULL,newCalArena(),false,false);
+    parser->map = *map;
+    parser->map.fold = NULL;
+    parser->map.foldSize = 0;
+    parser->src.map = &parser->map;
+    parser->view = true;
+    return readParserCalendar(parser,pcomp);
+}
+
+CalStatus readMapParallel (CalMap * map, CalComp ** pcomp, int nthreads) {
+    ChunkQueue queue;
+    CalStatus toReturn;
+    pthread_t * workers;
+    bool joined;
+
+    if (nthreads <= 0) {
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    //small calendars aren't worth splitting
+    if (nthreads <= 1 || map->size-map->start < CHUNK_MIN) {
+        toReturn = readMapCalendar(map,pcomp);
+        closeCalMap(map);
+        return toReturn;
+    }
+    queue.map = map;
+    queue.nchunks = splitCal(map,&queue.chunk,nthreads*CHUNKS_PER_THREAD);
+    queue.next = 0;
+    if (nthreads > queue.nchunks) {
+        nthreads = queue.nchunks;
     }
-    if (toReturn.code != OK) {
-        freeCalComp((*pcomp));
+    workers = malloc(sizeof(pthread_t)*nthreads);
+    assert(workers != NULL);
+    pthread_mutex_init(&queue.lock,NULL);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&workers[i],NULL,chunkWorker,&queue) != 0) {
+            nthreads = i;
+            break;
+        }
+    }
+    //no threads at all: read them here
+    if (nthreads == 0) {
+        chunkWorker(&queue);
     }
-    if (toReturn.linefrom == 0 && toReturn.lineto == 0) {
-        toReturn.code = NOCAL;
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(workers[i],NULL);
     }
+    pthread_mutex_destroy(&queue.lock);
+    joined = joinChunks(queue.chunk,queue.nchunks,pcomp,&toReturn);
+    for (int i = 0; i < queue.nchunks; i++) {
+        freeCalParser(queue.chunk[i].parser);
+    }
+    free(queue.chunk);
+    free(workers);
+    //a chunk can fail only because it was cut out of its context, so
+    //errors come from a serial read, with its codes and line numbers
+    if (!joined) {
+        toReturn = readMapCalendar(map,pcomp);
+    }
+    closeCalMap(map);
     return toReturn;
 }
 
-/* (see free section) */
-void freeProp (CalProp * prop);
+int splitCal (CalMap * map, CalChunk ** pchunk, int want) {
+    CalChunk * chunk;
+    const char * line;
+    size_t pos = map->pos;
+    size_t next, len;
+    size_t target;
+    int nchunks = 1;
+    int lines = map->lineNumber;
+    int depth = 0;
+    bool crlf;
+
+    chunk = calloc(want,sizeof(CalChunk));
+    assert(chunk != NULL);
+    target = (map->size-map->pos)/want;
+    chunk[0].from = pos;
+    chunk[0].lines = lines;
+    //BEGIN/END lines can't be continuations, which start with a blank
+    while (pos < map->size) {
+        len = mapPhysLine(map,pos,&next,&crlf);
+        line = map->base+pos;
+        if (len > 5 && strncasecmp(line,"BEGIN",5) == 0 && (line[5] == ':' || line[5] == ';')) {
+            if (depth == 1 && nchunks < want && pos-chunk[nchunks-1].from >= target) {
+                chunk[nchunks-1].to = pos;
+                chunk[nchunks].from = pos;
+                chunk[nchunks].lines = lines;
+                nchunks++;
+            }
+            depth++;
+        } else if (len > 3 && strncasecmp(line,"END",3) == 0 && (line[3] == ':' || line[3] == ';')) {
+            depth--;
+            //anything after the calendar stays with the last chunk
+            if (depth <= 0) {
+                break;
+            }
+        }
+        lines++;
+        pos = next;
+    }
+    chunk[nchunks-1].to = map->size;
+    *pchunk = chunk;
+    return nchunks;
+}
 
-/*
-Add component to parent component
-INPUT: parent CalComp, CalComp to add to parent
-OUTPUT: NA
-*/
-void addComp(CalComp ** rootComp, CalComp * compAdding);
+void * chunkWorker (void * arg) {
+    ChunkQueue * queue = arg;
+    int i;
+
+    while (true) {
+        pthread_mutex_lock(&queue->lock);
+        i = queue->next;
+        queue->next++;
+        pthread_mutex_unlock(&queue->lock);
+        if (i >= queue->nchunks) {
+            break;
+        }
+        readChunk(queue->map,&queue->chunk[i]);
+    }
+    return NULL;
+}
+
+void readChunk (CalMap * map, CalChunk * chunk) {
+    CalParser * parser;
+
+    //a view of the shared mapping, with its own position and fold buffer
+    parser = makeParser(NULL,newCalArena(),false,false);
+    parser->map = *map;
+    parser->map.pos = chunk->from;
+    parser->map.size = chunk->to;
+    parser->map.lineNumber = chunk->lines;
+    parser->map.fold = NULL;
+    parser->map.foldSize = 0;
+    parser->src.map = &parser->map;
+    parser->chunk = true;
+    parser->view = true;
+    chunk->comp = NULL;
+    //past the first chunk, reading starts inside VCALENDAR
+    if (chunk->from != map->start) {
+        pushName(parser,"VCALENDAR",9);
+        parser->filled[1] = 1;
+        initCalComp(&chunk->comp,"VCALENDAR",parser->arena);
+    }
+    chunk->status = readCalTree(parser,&chunk->comp,1);
+    chunk->parser = parser;
+}
+
+bool joinChunks (CalChunk * chunk, int nchunks, CalComp ** pcomp, CalStatus * status) {
+    CalParser * first = chunk[0].parser;
+    CalParser * parser;
+    CalArena * arena = first->arena;
+    CalComp * root = chunk[0].comp;
+    CalComp * piece;
+    CalProp * holder;
+    CalProp * next;
+    int total = 0;
+    int slots = 1;
+    int newSlots;
+    bool whole = true;
+
+    //all but the last chunk end inside VCALENDAR, the last after it
+    for (int i = 0; i < nchunks; i++) {
+        if (chunk[i].status.code != OK || chunk[i].parser->depth != (i == nchunks-1 ? 0 : 1)) {
+            whole = false;
+        }
+    }
+    *pcomp = NULL;
+    if (!whole) {
+        for (int i = 0; i < nchunks; i++) {
+            freeCalArena(chunk[i].parser->arena);
+        }
+        return false;
+    }
+
+    //VCALENDAR checks over the counts of every chunk
+    for (int i = 1; i < nchunks; i++) {
+        parser = chunk[i].parser;
+        first->nprodid = first->nprodid+parser->nprodid;
+        first->nversion = first->nversion+parser->nversion;
+        if (parser->nversion > 0) {
+            first->goodVersion = parser->goodVersion;
+        }
+        first->ncomps = first->ncomps+parser->ncomps;
+        first->vcomp = first->vcomp || parser->vcomp;
+    }
+    *status = chunk[nchunks-1].status;
+    status->code = checkCal(first);
+    if (status->code != OK) {
+        for (int i = 0; i < nchunks; i++) {
+            freeCalArena(chunk[i].parser->arena);
+        }
+        return true;
+    }
+
+    //grow comp[] once, keeping addComp's power of two size
+    for (int i = 0; i < nchunks; i++) {
+        total = total+chunk[i].comp->ncomps;
+    }
+    while (slots < root->ncomps) {
+        slots = slots*2;
+    }
+    newSlots = slots;
+    while (newSlots < total) {
+        newSlots = newSlots*2;
+    }
+    if (newSlots > slots) {
+        root = calGrow(arena,root,sizeof(CalComp)+sizeof(CalComp*)*slots,
+          sizeof(CalComp)+sizeof(CalComp*)*newSlots);
+    }
+    for (int i = 1; i < nchunks; i++) {
+        piece = chunk[i].comp;
+        holder = piece->prop;
+        while (holder != NULL) {
+            next = holder->next;
+            holder->next = NULL;
+            addProp(root,holder);
+            holder = next;
+        }
+        for (int j = 0; j < piece->ncomps; j++) {
+            moveCompArena(piece->comp[j],arena);
+            root->comp[root->ncomps] = piece->comp[j];
+            root->ncomps++;
+        }
+        adoptArena(arena,chunk[i].parser->arena);
+    }
+    arena->root = root;
+    *pcomp = root;
+    return true;
+}
 
 CalStatus readCalComp(FILE *const ics, CalComp **const pcomp) {
-    MallocStatus propToAddStatus;
-    MallocStatus nextCompStatus;
-    static int nestLevel;
+    CalParser * parser;
+    CalStatus toReturn;
+
+    parser = makeParser(ics,(*pcomp)->arena,false,false);
+    parser->src.stream = &legacyStream;
+    toReturn = readCalCompFrom(parser,pcomp);
+    freeCalParser(parser);
+    return toReturn;
+}
+
+CalStatus readCalCompFrom(CalParser *const parser, CalComp **const pcomp) {
+    CalStatus toReturn;
+    bool scratch = parser->scratch;
+    int top = 1;
+
+    //a named component has had its BEGIN read already
+    if ((*pcomp)->name != NULL) {
+        if (parser->depth == 0) {
+            parser->depth = 1;
+            parser->floor = 1;
+            pushName(parser,(*pcomp)->name,strlen((*pcomp)->name));
+        }
+        top = parser->depth;
+    }
+    //scratch space is kept until the next event, so the tree stays whole
+    parser->scratch = false;
+    toReturn = readCalTree(parser,pcomp,top);
+    parser->scratch = scratch;
+    return toReturn;
+}
+
+CalStatus readCalEventComp(CalParser *const parser, const CalEvent *const begin, 
+  CalComp **const pcomp) {
+    initCalComp(pcomp,begin->name,parser->arena);
+    return readCalCompFrom(parser,pcomp);
+}
+
+CalStatus readCalLineFrom(CalParser *const parser, char **const pbuff) {
+    CalStatus toReturn;
+    const char * line;
+    int len;
+
+    toReturn = sourceLine(&parser->src,&line,&len);
+    if (line == NULL) {
+        *pbuff = NULL;
+        return toReturn;
+    }
+    *pbuff = malloc(sizeof(char)*(len+1));
+    assert(*pbuff != NULL);
+    memcpy(*pbuff,line,len);
+    (*pbuff)[len] = '\0';
+    return toReturn;
+}
+
+CalStatus readCalTree (CalParser * parser, CalComp ** pcomp, int top) {
+    CalComp * open[MAX_DEPTH+1] = {NULL};   // components being filled
+    CalEvent event;
     CalStatus status;
-    char ** pbuff;
-    CalComp ** nextComp;// next component to add
-    CalError parseError;
-    CalProp * propToAdd;
-    char endCondition[BUFF_SIZE];//stores end condition to break out of component
-
-    propToAddStatus = NOTHING;
-    nextCompStatus = NOTHING;
-    pbuff = malloc(sizeof(char *));
-    assert(pbuff != NULL);
-    nextComp = malloc(sizeof(CalComp*));
-    assert(nextComp != NULL);
-    nextCompStatus = MALLOCED;
-    status.code = OK;
-    status.lineto = 1;
-    status.linefrom = 1;
-
-    //first component set up
-    if (!pcomp[0]->name) {
-        nestLevel = 1;
-        pcomp[0]->name = malloc(sizeof(char)*NAME_SIZE);
-        assert(pcomp[0] != NULL);
-        status = readCalLine(ics,pbuff);
-        propToAdd = malloc(sizeof(CalProp));
-        assert(propToAdd != NULL);
-        propToAddStatus = MALLOCED;
-        if (pbuff[0] != NULL) {
-            parseError = parseCalProp(pbuff[0],propToAdd);
-            free(pbuff[0]);
-            propToAddStatus = INNERFREEABLE;
-        } else {
-            parseError = status.code;
+    int depth;
+
+    open[top] = *pcomp;
+    do {
+        status = readCalEvent(parser,&event);
+        if (status.code != OK) {
+            break;
         }
-        status.code = parseError;
-        if (status.code == SYNTAX) {
-        } else if (status.code == NOCRNL) {
-        } else if (strcmp(propToAdd->name,"BEGIN") == 0 && strcmp(propToAdd->value,"VCALENDAR")==0) {
-            strcpy(pcomp[0]->name,"VCALENDAR");
-        } else {
-            status.code = NOCAL;
+        depth = event.depth;
+        if (event.kind == EVBEGIN) {
+            if (open[depth] == NULL) {
+                initCalComp(&open[depth],event.name,parser->arena);
+            } else if (open[depth]->name == NULL) {
+                open[depth]->name = calAlloc(parser->arena,strlen(event.name)+1);
+                strcpy(open[depth]->name,event.name);
+            }
+        } else if (event.kind == EVPROP) {
+            addProp(open[depth],event.prop);
+        } else if (event.kind == EVEND && depth > top) {
+            addComp(&open[depth-1],open[depth]);
+            open[depth] = NULL;
         }
-        if (propToAddStatus == INNERFREEABLE) {
-            freeProp(propToAdd);
-        } else {
-            free(propToAdd);
+    } while (event.kind != EVDONE && !(event.kind == EVEND && event.depth == top));
+    //components left open were never added to their parents
+    for (int i = MAX_DEPTH; i > top; i--) {
+        if (open[i] != NULL) {
+            freeCalComp(open[i]);
         }
-        propToAddStatus = ADDED;
     }
-    if (status.code != NOCAL ) {
-        strcpy(endCondition,(*pcomp)->name);
+    *pcomp = open[top];
+    return status;
+}
+
+CalParser * newCalParser(FILE *const ics, CalArena *const arena) {
+    if (arena == NULL) {
+        return makeParser(ics,newCalArena(),true,true);
+    }
+    return makeParser(ics,arena,false,true);
+}
+
+CalParser * makeParser (FILE * ics, CalArena * arena, bool scratch, bool tryMap) {
+    CalParser * parser;
+
+    parser = calloc(1,sizeof(CalParser));
+    assert(parser != NULL);
+    parser->src.ics = ics;
+    parser->src.stream = &parser->stream;
+    //pipes, ttys and empty files go through the stdio reader
+    if (tryMap && openCalMap(ics,&parser->map).code == OK) {
+        parser->src.map = &parser->map;
     }
-    //read through file. create components and properties when appropriate.
-    while (!(status.code != OK && pbuff != NULL) && status.code == OK) {
-        status = readCalLine(ics,pbuff);
-        if ((status.code == OK) && (pbuff[0] == NULL || strcmp(pbuff[0],"")==0)) {
-            status.lineto--;
-            status.linefrom--;
-            status.code = BEGEND;
-            break;
+    parser->arena = arena;
+    parser->scratch = scratch;
+    initTokens(&parser->tok);
+    return parser;
+}
+
+CalStatus readCalEvent(CalParser *const parser, CalEvent *const event) {
+    PropTokens * tok = &parser->tok;
+    CalStatus status;
+    CalProp * prop;
+    const char * line;
+    const char * value;
+    int len;
+    int valueLen;
+
+    event->kind = EVDONE;
+    event->depth = parser->depth;
+    event->name = NULL;
+    event->prop = NULL;
+    if (parser->done) {
+        return parser->status;
+    }
+    if (parser->scratch) {
+        resetCalArena(parser->arena);
+    }
+    status = sourceLine(&parser->src,&line,&len);
+    if (status.code != OK) {
+        return stopParser(parser,status);
+    }
+    if (line == NULL && parser->depth == 0) {
+        status.code = NOCAL;
+        return stopParser(parser,status);
+    }
+    //the end of a chunk is only the end of its piece of VCALENDAR
+    if (line == NULL && parser->chunk && parser->depth == 1) {
+        return stopParser(parser,status);
+    }
+    //input ran out with components still open
+    if (line == NULL || (len == 0 && parser->depth > 0)) {
+        status.lineto--;
+        status.linefrom--;
+        status.code = BEGEND;
+        return stopParser(parser,status);
+    }
+    status.code = lexProp(line,len,tok);
+    value = line+tok->value.from;
+    valueLen = tok->value.to-tok->value.from;
+    if (status.code == OK && parser->depth == 0 && 
+      !(tok->begin && valueLen == 9 && strncasecmp(value,"VCALENDAR",9) == 0)) {
+        status.code = NOCAL;
+    }
+    if (status.code != OK) {
+        return stopParser(parser,status);
+    }
+
+    if (tok->begin) {
+        if (parser->depth+1 > MAX_DEPTH) {
+            status.code = SUBCOM;
+            return stopParser(parser,status);
         }
-        if (status.code == OK) {
-            propToAdd = malloc(sizeof(CalProp));
-            assert(propToAdd != NULL);
-            propToAddStatus = MALLOCED;
-            parseError = parseCalProp(pbuff[0],propToAdd);
-            free(pbuff[0]);
-            status.code = parseError;
-            if (status.code == SYNTAX) {
-                break;
+        parser->filled[parser->depth]++;
+        pushName(parser,value,valueLen);
+        if (parser->depth == 2) {
+            parser->ncomps++;
+            if (parser->name[2][0] == 'V') {
+                parser->vcomp = true;
             }
-            propToAddStatus = INNERFREEABLE;
-            if (strcmp(propToAdd->name,"BEGIN") == 0) {
-                nestLevel++;
-                if (nestLevel < 4) {
-                    initCalComp(nextComp,propToAdd->value);
-                    nextCompStatus = INNERFREEABLE;
-                    status = readCalComp(ics,nextComp);
-                    if (status.code != OK) { 
-                        break;
-                    }
-                    addComp(pcomp,nextComp[0]);
-                    nextCompStatus = ADDED;                  
-                } else {
-                    status.code = SUBCOM;
-                    break;           
-                }
-                nestLevel--;
-                freeProp(propToAdd);
-                propToAddStatus = ADDED; //so no one tries to free it
-            } else if (strcmp(propToAdd->name,"END")==0) {         
-                if ((*pcomp)->nprops == 0 && (*pcomp)->ncomps == 0) {
-                    status.code = NODATA;
-                } else if (strcmp(endCondition,propToAdd->value)==0) {
-                    if (strcmp(propToAdd->value,"VCALENDAR")==0) {
-                        if (!feof(ics)) {
-                            readCalLine(ics,pbuff);
-                            status.code = AFTEND;
-                            status.linefrom = status.linefrom+1;
-                            status.lineto = status.lineto+1;
-                        }
-                    }
-                } else {
-                    status.code = BEGEND;
+        }
+        event->kind = EVBEGIN;
+        event->depth = parser->depth;
+        event->name = parser->name[parser->depth];
+    } else if (tok->end) {
+        if (parser->filled[parser->depth] == 0) {
+            status.code = NODATA;
+            return stopParser(parser,status);
+        }
+        if (strncasecmp(value,parser->name[parser->depth],valueLen) != 0 || 
+          parser->name[parser->depth][valueLen] != '\0') {
+            status.code = BEGEND;
+            return stopParser(parser,status);
+        }
+        event->kind = EVEND;
+        event->depth = parser->depth;
+        event->name = parser->name[parser->depth];
+        parser->depth--;
+        if (parser->depth == parser->floor) {
+            if (parser->floor == 0) {
+                if (!sourceAtEnd(&parser->src)) {
+                    sourceLine(&parser->src,&line,&len);
+                    status.code = AFTEND;
+                    status.linefrom = status.linefrom+1;
+                    status.lineto = status.lineto+1;
+                } else if (!parser->chunk) { //chunks are checked together
+                    status.code = checkCal(parser);
                 }
-                freeProp(propToAdd);
-                propToAddStatus = ADDED; //so no one tries to free it
-                break;
-            } else { //property to be added (default)
-                 addProp((*pcomp),propToAdd);
-                 propToAddStatus = ADDED;       
-            }    
-        } else if (status.code == NOCRNL) { //improper carriage
-             break; 
+            }
+            if (status.code != OK) {
+                event->kind = EVDONE;
+            }
+            stopParser(parser,status);
         }
-    }
-    if (propToAddStatus != ADDED) {
-        if (propToAddStatus == MALLOCED) {
-            free(propToAdd);
-        } else if (propToAddStatus == INNERFREEABLE) {
-            freeProp(propToAdd);
+    } else { //property of the innermost component
+        prop = calAlloc(parser->arena,sizeof(CalProp));
+        buildProp(parser->arena,line,tok,prop);
+        parser->filled[parser->depth]++;
+        if (parser->depth == 1) {
+            if (prop->kind == PROP_PRODID) {
+                parser->nprodid++;
+            } else if (prop->kind == PROP_VERSION) {
+                parser->nversion++;
+                parser->goodVersion = strcmp(prop->value,VCAL_VER) == 0;
+            }
         }
+        event->kind = EVPROP;
+        event->depth = parser->depth;
+        event->prop = prop;
     }
-    if (nextCompStatus != ADDED) {
-       if (nextCompStatus == INNERFREEABLE) {
-            freeCalComp((*nextComp));
+    return status;
+}
+
+void freeCalParser(CalParser *const parser) {
+    //a view's mapping belongs to readMapParallel
+    if (parser->view) {
+        free(parser->map.fold);
+    } else if (parser->src.map != NULL) {
+        closeCalMap(parser->src.map);
+    }
+    free(parser->src.held);
+    for (int i = 0; i <= MAX_DEPTH; i++) {
+        free(parser->name[i]);
+    }
+    freeTokens(&parser->tok);
+    if (parser->scratch) {
+        freeCalArena(parser->arena);
+    }
+    free(parser);
+}
+
+CalStatus readCalEvents(FILE *const ics, CalArena *const arena, const CalHandler *const handler) {
+    CalParser * parser;
+    CalEvent event;
+    CalStatus status;
+    CalError error;
+
+    parser = newCalParser(ics,arena);
+    do {
+        status = readCalEvent(parser,&event);
+        if (status.code != OK) {
+            break;
         }
+        error = OK;
+        if (event.kind == EVBEGIN && handler->onBeginComponent != NULL) {
+            error = handler->onBeginComponent(handler->data,event.name,event.depth);
+        } else if (event.kind == EVPROP && handler->onProperty != NULL) {
+            error = handler->onProperty(handler->data,event.prop,event.depth);
+        } else if (event.kind == EVEND && handler->onEndComponent != NULL) {
+            error = handler->onEndComponent(handler->data,event.name,event.depth);
+        }
+        //a handler can stop the read; it is reported at the current line
+        if (error != OK) {
+            status.code = error;
+            break;
+        }
+    } while (event.kind != EVDONE);
+    freeCalParser(parser);
+    return status;
+}
+
+CalStatus sourceLine (LineSource * src, const char ** pline, int * plen) {
+    CalStatus status;
+    char * buff = NULL;
+
+    if (src->map != NULL) {
+        return readCalMapLine(src->map,pline,plen);
     }
-    free(nextComp);
-    free(pbuff); 
+    free(src->held);
+    status = readStreamLine(src->stream,src->ics,&buff);
+    src->held = buff;
+    *pline = buff;
+    *plen = (buff != NULL) ? strlen(buff) : 0;
     return status;
 }
 
+bool sourceAtEnd (LineSource * src) {
+    if (src->map != NULL) {
+        return calMapAtEnd(src->map);
+    }
+    return feof(src->ics);
+}
+
 /*
 Removes blanks from lines to be appended
 INPUT: char array
@@ -375,21 +1214,23 @@ Copy part of a string to destination
 INPUT: Destination, source, start and end positions of string to copy
 OUTPUT: NA
 */
-void copySubStr (char * dest, char * src, int start, int end);
+void copySubStr (char * dest, const char * src, int start, int end);
 
 CalStatus readCalLine(FILE *const ics, char **const pbuff) {
+    return readStreamLine(&legacyStream,ics,pbuff);
+}
+
+CalStatus readStreamLine (StreamState * state, FILE * ics, char ** pbuff) {
     char * temp;;
-    static char buffer[BUFF_SIZE];
-    static int lineNumber;
+    char * buffer = state->buffer;
     CalStatus toReturn;   
-    static bool EOFb4EOL;
     int blanksSkipped;
 
     blanksSkipped = 0; 
 
-    //reset static variables
+    //reset state
     if (ics == NULL) {
-        lineNumber = 0;
+        state->lineNumber = 0;
         toReturn.code = OK;
         toReturn.linefrom = 0;
         toReturn.lineto = 0;
@@ -402,19 +1243,19 @@ CalStatus readCalLine(FILE *const ics, char **const pbuff) {
     //check for EOF conditions
     if (feof(ics)) {
         toReturn.code = OK;
-        toReturn.lineto = lineNumber+1;
-        toReturn.linefrom = lineNumber+1;
-        if (EOFb4EOL == false) {
+        toReturn.lineto = state->lineNumber+1;
+        toReturn.linefrom = state->lineNumber+1;
+        if (state->EOFb4EOL == false) {
             pbuff[0] = NULL;
         } else {
-            EOFb4EOL = false;
+            state->EOFb4EOL = false;
             copySubStr(pbuff[0],buffer,0,BUFF_SIZE-2);
         }
         return toReturn;
     }
     temp = calloc(BUFF_SIZE,sizeof(char)*BUFF_SIZE);
     assert(temp != NULL);
-    if (lineNumber == 0) {
+    if (state->lineNumber == 0) {
         fgets(buffer,BUFF_SIZE,ics);
     }
     toReturn.code = checkEOL(buffer,ics); 
@@ -423,26 +1264,26 @@ CalStatus readCalLine(FILE *const ics, char **const pbuff) {
     } else {
         //fprintf(stderr,"read error\n");
     }
-    lineNumber++;
-    toReturn.linefrom = lineNumber;
+    state->lineNumber++;
+    toReturn.linefrom = state->lineNumber;
     while (notBlank(temp) == 0 && !feof(ics)) {
         fgets(temp,BUFF_SIZE,ics);
         blanksSkipped++;
     }
     if (feof(ics)) {
-        EOFb4EOL = true;
+        state->EOFb4EOL = true;
     } else { 
-        EOFb4EOL = false;
+        state->EOFb4EOL = false;
     }
-    if (!isspace(temp[0])) {
+    if (!isspace((unsigned char)temp[0])) {
         copySubStr(pbuff[0],buffer,0,BUFF_SIZE-2);
         copySubStr(buffer,temp,0,BUFF_SIZE-2);
-        toReturn.lineto = lineNumber;// + blanksSkipped;
-        lineNumber = lineNumber + blanksSkipped;
-    } else if (isspace(temp[0])) {
-        lineNumber = lineNumber + blanksSkipped;
+        toReturn.lineto = state->lineNumber;// + blanksSkipped;
+        state->lineNumber = state->lineNumber + blanksSkipped;
+    } else if (isspace((unsigned char)temp[0])) {
+        state->lineNumber = state->lineNumber + blanksSkipped;
         blanksSkipped = 0;
-        while (isspace(temp[0])) {
+        while (isspace((unsigned char)temp[0])) {
             //this maintains a NOCRNL status while allowing OK to change to NOCRNL
             if (toReturn.code == OK ) {
                 toReturn.code = checkEOL(temp,ics);
@@ -451,206 +1292,410 @@ CalStatus readCalLine(FILE *const ics, char **const pbuff) {
             append(buffer,temp);
             if (!fgets(temp,BUFF_SIZE,ics)) {
             }
-            lineNumber++;
+            state->lineNumber++;
             while (notBlank(temp) == 0 && !feof(ics)) {
                 fgets(temp,BUFF_SIZE,ics);
-                lineNumber++;
+                state->lineNumber++;
             }
             if (feof(ics)) {
                 break;
             }
         }
-        toReturn.lineto = lineNumber;
-        copySubStr(pbuff[0],buffer,0,BUFF_SIZE-2);
-        copySubStr(buffer,temp,0,BUFF_SIZE-2);
+        toReturn.lineto = state->lineNumber;
+        copySubStr(pbuff[0],buffer,0,BUFF_SIZE-2);
+        copySubStr(buffer,temp,0,BUFF_SIZE-2);
+    }
+    if (toReturn.code == NOCRNL) {
+        pbuff[0] = NULL;
+    }
+    free(temp);
+    return toReturn;
+}
+
+/*
+Checks if a physical line is blank (whitespace only, not a fold)
+INPUT: line view and its length
+OUTPUT: true if blank
+*/
+bool blankView (const char * line, size_t len);
+
+/*
+Make room in the fold buffer
+INPUT: map, bytes needed
+OUTPUT: NA
+*/
+void growFold (CalMap * map, size_t needed);
+
+CalStatus openCalMap(FILE *const ics, CalMap *const map) {
+    CalStatus toReturn = {.code = OK, .linefrom = 0, .lineto = 0};
+    struct stat info;
+    off_t start;
+    void * base;
+
+    map->base = NULL;
+    map->size = 0;
+    map->pos = 0;
+    map->start = 0;
+    map->lineNumber = 0;
+    map->fold = NULL;
+    map->foldSize = 0;
+    map->mapped = false;
+    start = ftello(ics);
+    if (start < 0 || fstat(fileno(ics),&info) != 0 || !S_ISREG(info.st_mode) 
+      || info.st_size < start) {
+        toReturn.code = IOERR;
+        return toReturn;
+    }
+    if (info.st_size == start) { //nothing to map, reads as end of input
+        return toReturn;
+    }
+    base = mmap(NULL,info.st_size,PROT_READ,MAP_PRIVATE,fileno(ics),0);
+    if (base == MAP_FAILED) {
+        toReturn.code = IOERR;
+        return toReturn;
+    }
+    madvise(base,info.st_size,MADV_SEQUENTIAL);
+    map->mapped = true;
+    map->base = base;
+    map->size = info.st_size;
+    map->pos = start;
+    map->start = start;
+    return toReturn;
+}
+
+CalStatus readCalMapLine(CalMap *const map, const char **const pline, int *const plen) {
+    CalStatus toReturn = {.code = OK, .linefrom = 0, .lineto = 0};
+    const char * line;
+    size_t len, next;
+    size_t look, cont, contNext;
+    int skipped;
+    int used = -1; //bytes in fold, -1 while the line is unfolded
+    bool crlf;
+
+    //skip blank lines
+    while (map->pos < map->size) {
+        len = mapPhysLine(map,map->pos,&next,&crlf);
+        if (!blankView(map->base+map->pos,len)) {
+            break;
+        }
+        map->pos = next;
+        map->lineNumber++;
+    }
+    if (map->pos >= map->size) {
+        *pline = NULL;
+        *plen = 0;
+        toReturn.linefrom = map->lineNumber+1;
+        toReturn.lineto = map->lineNumber+1;
+        return toReturn;
+    }
+    line = map->base+map->pos;
+    map->pos = next;
+    map->lineNumber++;
+    toReturn.linefrom = map->lineNumber;
+    if (!crlf) {
+        toReturn.code = NOCRNL;
     }
+    //append continuation lines, copying only when there is one
+    while (map->pos < map->size) {
+        look = map->pos;
+        skipped = 0;
+        cont = mapPhysLine(map,look,&contNext,&crlf);
+        while (blankView(map->base+look,cont) && contNext < map->size) {
+            look = contNext;
+            skipped++;
+            cont = mapPhysLine(map,look,&contNext,&crlf);
+        }
+        //only SP and HTAB fold a line (RFC 5545 3.1)
+        if ((map->base[look] != ' ' && map->base[look] != '\t') || blankView(map->base+look,cont)) {
+            break;
+        }
+        if (used < 0) {
+            growFold(map,len+cont);
+            memcpy(map->fold,line,len);
+            used = len;
+        } else {
+            growFold(map,used+cont);
+        }
+        memcpy(map->fold+used,map->base+look+1,cont-1);
+        used = used+cont-1;
+        if (!crlf) {
+            toReturn.code = NOCRNL;
+        }
+        map->pos = contNext;
+        map->lineNumber = map->lineNumber+skipped+1;
+    }
+    toReturn.lineto = map->lineNumber;
     if (toReturn.code == NOCRNL) {
-        pbuff[0] = NULL;
+        *pline = NULL;
+        *plen = 0;
+    } else if (used < 0) {
+        *pline = line;
+        *plen = len;
+    } else {
+        *pline = map->fold;
+        *plen = used;
     }
-    free(temp);
     return toReturn;
 }
 
+bool calMapAtEnd(CalMap *const map) {
+    size_t pos, next, len;
+    bool crlf;
+
+    pos = map->pos;
+    while (pos < map->size) {
+        len = mapPhysLine(map,pos,&next,&crlf);
+        if (!blankView(map->base+pos,len)) {
+            return false;
+        }
+        pos = next;
+    }
+    return true;
+}
+
+void openCalBuffer(const char *const buff, size_t len, CalMap *const map) {
+    map->base = buff;
+    map->size = len;
+    map->pos = 0;
+    map->start = 0;
+    map->lineNumber = 0;
+    map->fold = NULL;
+    map->foldSize = 0;
+    map->mapped = false;
+}
+
+void closeCalMap(CalMap *const map) {
+    if (map->mapped) {
+        munmap((void *)map->base,map->size);
+    }
+    free(map->fold);
+    map->base = NULL;
+    map->fold = NULL;
+    map->foldSize = 0;
+}
+
 /*
-Initialize new parameter to add to active property
-INPUT: CalParam
-OUTPUT: NA
+Find the next content line delimiter (; : = " ,)
+INPUT: line, offset to start at, line length
+OUTPUT: offset of the delimiter, or len if there is none
 */
-void initParam (CalParam * newParam);
+int scanDelim (const char * buff, int from, int len);
 
 /*
-Convert parameter names to upper case
-INPUT: char array
+Parse a content line, allocating from an arena
+INPUT: arena (or NULL), line, its length, property to fill
+OUTPUT: CalError
+*/
+CalError parsePropIn (CalArena * arena, const char * buff, int len, CalProp * prop);
+
+/*
+Split a content line into name, parameter and value offsets in one pass
+INPUT: line, its length, tokens to fill
+OUTPUT: CalError
+*/
+CalError tokenizeProp (const char * buff, int len, PropTokens * tok);
+
+/*
+Make room for one more parameter or parameter value token
+INPUT: tokens
+OUTPUT: address of the new entry
+*/
+ParamTokens * addParamToken (PropTokens * tok);
+TokenSpan * addValueToken (PropTokens * tok);
+
+/*
+Copy a token out of a line
+INPUT: arena (or NULL), line, token
+OUTPUT: NUL terminated copy
+*/
+char * copyToken (CalArena * arena, const char * buff, TokenSpan span);
+
+/*
+Convert names to upper case
+INPUT: char array, its length
 OUTPUT: NA
 */
-void stringToUpper(char * string);
+void stringToUpper(char * string, int len);
 
 /*
 Check for unexpected white space
-INPUT: char array
+INPUT: char array, its length
 OUTPUT: int indicating white space or not
 */
-int checkForSpace (char * string);
+int checkForSpace (const char * string, int len);
 
 CalError parseCalProp(char * const buff, CalProp * const prop) {
+    return parsePropIn(NULL,buff,strlen(buff),prop);
+}
+
+CalError parseCalPropLen(const char * const buff, int len, CalProp * const prop) {
+    return parsePropIn(NULL,buff,len,prop);
+}
+
+CalError parsePropIn (CalArena * arena, const char * buff, int len, CalProp * prop) {
+    PropTokens tok;
     CalError toReturn;
-    char * foundChar;   
-    char active;
-    int quoteOn;
-    int colonOn;
-    int to;
-    int from;
-    char symFound[SYM_SIZE];
-    int foundCount;
-    CalParam * newParam;
-    CalParam * nextParam;
-    int nEqual = 0;
-    int nQuote = 0;
-    int nSemi = 0;
-    int nColon = 0;
-
-    toReturn = OK;
-    quoteOn = 0;
-    colonOn = 0;
-    to = 0;
-    from = 0;
-    foundCount = 0;
+
     prop->nparams = 0;
     prop->name = NULL;
+    prop->kind = PROP_OTHER;
     prop->value = NULL;
     prop->param = NULL;
+    prop->paramv = NULL;
+    prop->timed = false;
     prop->next = NULL;
+    initTokens(&tok);
+    toReturn = lexProp(buff,len,&tok);
+    if (toReturn == OK) {
+        buildProp(arena,buff,&tok,prop);
+    }
+    freeTokens(&tok);
+    return toReturn;
+}
 
-    for (int i = 0; i<strlen(buff)+1; i++) {
-        active = buff[i];
-        foundChar = strchr(";:=\",\0",active);
-        to++;
-        if (foundChar == NULL || (colonOn == 1 && active != '\0' ) || (quoteOn == 1 && active != '"')) {
-            continue;
-        } else {
-            symFound[foundCount] = active;
-            symFound[foundCount+1] = '\0';
-            foundCount++;
-        }
-        if (active == '"') {
-           if (quoteOn == 0) {
-               quoteOn = 1;
-               from = i-1;
-           } else {
-               quoteOn = 0;
-               continue;
-           }
-        }
-        if (active == ':') {
-           if (colonOn == 0) {
-               colonOn = 1;
-           }
-        } 
-        //skip symbol processing if in a quoted string or prop value
-        if (quoteOn == 1 || (colonOn == 1 && (active != '\0' && active != ':'))) {
-            continue;
+CalError lexProp (const char * buff, int len, PropTokens * tok) {
+    ParamTokens * param;
+    int nameLen;
+
+    tok->begin = false;
+    tok->end = false;
+    if (tokenizeProp(buff,len,tok) != OK) {
+        return SYNTAX;
+    }
+    //screen the pieces for SYNTAX before anything is allocated
+    nameLen = tok->name.to-tok->name.from;
+    if (checkForSpace(buff,nameLen) == 1) {
+        return SYNTAX;
+    }
+    for (int i = 0; i < tok->nparams; i++) {
+        param = &tok->param[i];
+        if (param->name.to == param->name.from || 
+          checkForSpace(buff+param->name.from,param->name.to-param->name.from) == 1) {
+            return SYNTAX;
         }
-        //set property value 
-        if (active == '\0') {
-            prop->value = malloc(sizeof(char)*(to-from+1));
-            assert(prop->value != NULL);
-            copySubStr(prop->value,buff,from+1,to); 
-            if (prop->name != NULL) {
-                if ((strcmp(prop->name,"BEGIN")==0 || strcmp(prop->name,"END") == 0) 
-                  && checkForSpace(prop->value) == 1) {
-                    toReturn = SYNTAX;
-                }
-                if (strcmp(prop->name,"BEGIN")==0 || strcmp(prop->name,"END") == 0) {
-                    stringToUpper(prop->value);
-                }   
-            } 
-        }
-        //set prop name
-        if (foundCount == 1 && (active == ':' || active == ';')) {
-            prop->name = malloc(sizeof(char)*(to-from+1)); 
-            assert(prop->name != NULL);
-            copySubStr(prop->name,buff,from,to-2);
-            stringToUpper(prop->name);
-            if (checkForSpace(prop->name) == 1) {
-                toReturn = SYNTAX;
-            }
+    }
+    tok->begin = nameLen == 5 && strncasecmp(buff,"BEGIN",5) == 0;
+    tok->end = nameLen == 3 && strncasecmp(buff,"END",3) == 0;
+    if ((tok->begin || tok->end) && 
+      checkForSpace(buff+tok->value.from,tok->value.to-tok->value.from) == 1) {
+        return SYNTAX;
+    }
+    return OK;
+}
+
+CalError tokenizeProp (const char * buff, int len, PropTokens * tok) {
+    ParamTokens * param;
+    TokenSpan * value;
+    const char * close;
+    int at;
+    int start;
+
+    tok->nparams = 0;
+    tok->nvalues = 0;
+    if (len == 0 || buff[0] == ':' || buff[0] == ';' || buff[0] == '"' || buff[0] == '=') {
+        return SYNTAX;
+    }
+    //name runs to the first ; or :
+    at = scanDelim(buff,0,len);
+    if (at == len || (buff[at] != ';' && buff[at] != ':')) {
+        return SYNTAX;
+    }
+    tok->name.from = 0;
+    tok->name.to = at;
+    //each ; starts a NAME=value[,value...] parameter
+    while (buff[at] == ';') {
+        start = at+1;
+        at = scanDelim(buff,start,len);
+        if (at == len || buff[at] != '=') {
+            return SYNTAX;
         }
-        //set newParam name
-        if (active == '=') {
-            newParam->name = malloc(sizeof(char)*(to-from+1));
-            assert(newParam->name != NULL);
-            copySubStr(newParam->name,buff,from+1,to-2);
-            stringToUpper(newParam->name);
-            if (strcmp(newParam->name,"") == 0 || checkForSpace(newParam->name) == 1) {
-                toReturn = SYNTAX;
+        param = addParamToken(tok);
+        param->name.from = start;
+        param->name.to = at;
+        param->firstValue = tok->nvalues;
+        param->nvalues = 0;
+        start = at+1;
+        at = start;
+        while (true) {
+            at = scanDelim(buff,at,len);
+            if (at == len || buff[at] == '=') {
+                return SYNTAX;
             }
-        }
-        //set a new param value
-        if ((active == ',') || ((active == ';' || active == ':') && 
-          (symFound[foundCount-2] == '=' || symFound[foundCount-2] == ','
-          || symFound[foundCount-2] == '"')) ) { 
-            newParam->nvalues++;
-            newParam = realloc(newParam,sizeof(CalParam) + sizeof(char*)*newParam->nvalues);
-            assert(newParam != NULL);
-            newParam->value[newParam->nvalues-1] = malloc(sizeof(char)*(to-from+1));
-            assert(newParam->value[newParam->nvalues-1] != NULL);
-            copySubStr(newParam->value[newParam->nvalues-1],buff,from+1,to-2); 
-            if (newParam->value[newParam->nvalues-1][0] != '"') {
-                //stringToUpper(newParam->value[newParam->nvalues-1]);
-            }   
-        }
-        //add newParam to prop
-        if ((active == ';' || active == ':' || active == '=') && 
-          (symFound[foundCount-2] == ',' || symFound[foundCount-2] == '=' || 
-            symFound[foundCount-2] == '"' ) ) {
-            nextParam = prop->param;
-            if (nextParam != NULL) {
-                while (nextParam->next != NULL) {
-                    nextParam = nextParam->next;
+            //quoted strings are kept whole, quotes included
+            if (buff[at] == '"') {
+                close = memchr(buff+at+1,'"',len-at-1);
+                if (close == NULL) {
+                    return SYNTAX;
                 }
-                nextParam->next = newParam;
-            } else {
-                prop->param = newParam;
+                at = close-buff+1;
+                continue;
             }
-            prop->nparams++;
-        } 
-        //initialize new parameter 
-        if (active == ';') {
-            newParam = NULL;
-            newParam = malloc(sizeof(CalParam)+sizeof(char*)); 
-            assert(newParam != NULL);
-            initParam(newParam);
-        }
-        from = i;
-    }
-    //count symbols for syntax check
-    for (int j = 0; j<strlen(symFound); j++) {
-        switch (symFound[j]) {
-            case ';':
-                nSemi++;
-                break;
-            case ':':
-                nColon++;
-                break;
-            case '"':
-                nQuote++;
-                break;
-            case '=':
-                nEqual++;
+            value = addValueToken(tok);
+            value->from = start;
+            value->to = at;
+            param->nvalues++;
+            if (buff[at] != ',') {
                 break;
+            }
+            at++;
+            start = at;
         }
     }
-    //screen count data for SYNTAX
-    if (nColon < 1) {
-        toReturn = SYNTAX;
+    //everything after the : is the value
+    tok->value.from = at+1;
+    tok->value.to = len;
+    return OK;
+}
+
+void buildProp (CalArena * arena, const char * buff, PropTokens * tok, CalProp * prop) {
+    CalParam * newParam;
+    CalParam * lastParam = NULL;
+    ParamTokens * param;
+
+    prop->nparams = 0;
+    prop->param = NULL;
+    prop->paramv = NULL;
+    prop->next = NULL;
+    prop->timed = false;
+    if (tok->nparams > 0) {
+        prop->paramv = calAlloc(arena,sizeof(CalParam*)*arraySlots(tok->nparams));
     }
-    if (nEqual != nSemi || (nQuote % 2) != 0) {
-        toReturn = SYNTAX;
+    prop->kind = findName(propName,NPROP_NAMES,buff+tok->name.from,tok->name.to-tok->name.from);
+    if (prop->kind != PROP_OTHER) {
+        prop->name = propName[prop->kind];
+    } else {
+        prop->name = copyToken(arena,buff,tok->name);
+        stringToUpper(prop->name,tok->name.to-tok->name.from);
     }
-    if (buff[0] == ':' || buff[0] == ';' || buff[0] == '"' || buff[0] == '=') {
-        toReturn = SYNTAX;
+    prop->value = copyToken(arena,buff,tok->value);
+    if (tok->begin || tok->end) {
+        stringToUpper(prop->value,tok->value.to-tok->value.from);
+    }
+    for (int i = 0; i < tok->nparams; i++) {
+        param = &tok->param[i];
+        newParam = calAlloc(arena,sizeof(CalParam)+sizeof(char*)*param->nvalues);
+        newParam->kind = findName(paramName,NPARAM_NAMES,buff+param->name.from,
+          param->name.to-param->name.from);
+        if (newParam->kind != PARAM_OTHER) {
+            newParam->name = paramName[newParam->kind];
+        } else {
+            newParam->name = copyToken(arena,buff,param->name);
+            stringToUpper(newParam->name,param->name.to-param->name.from);
+        }
+        newParam->next = NULL;
+        newParam->nvalues = param->nvalues;
+        for (int j = 0; j < param->nvalues; j++) {
+            newParam->value[j] = copyToken(arena,buff,tok->paramValue[param->firstValue+j]);
+        }
+        if (lastParam == NULL) {
+            prop->param = newParam;
+        } else {
+            lastParam->next = newParam;
+        }
+        lastParam = newParam;
+        prop->paramv[prop->nparams] = newParam;
+        prop->nparams++;
     }
-    return toReturn;
 }
 
 /*
@@ -671,7 +1716,15 @@ void freeCalComp(CalComp *const comp) {
     CalProp * nextProp;
     CalProp * holder;
  
+    //arena trees go all at once, from their root
+    if (comp->arena != NULL) {
+        if (comp->arena->root == comp) {
+            freeCalArena(comp->arena);
+        }
+        return;
+    }
     free(comp->name);
+    free(comp->propv);
     holder = comp->prop;
     while (holder != NULL) {
         nextProp = holder->next;
@@ -688,101 +1741,216 @@ void freeCalComp(CalComp *const comp) {
 support functions
 */
 /* readCalFile */
-void initCalComp (CalComp ** comp, char name[NAME_SIZE]) {
+void initCalComp (CalComp ** comp, const char * name, CalArena * arena) {
 
-    comp[0] = malloc(sizeof(CalComp) + sizeof(CalComp *));
-    assert(comp[0] != NULL);
+    comp[0] = calAlloc(arena,sizeof(CalComp) + sizeof(CalComp *));
     if (!name) {
         comp[0]->name = NULL;
     } else {
-        comp[0]->name = malloc(sizeof(char)*NAME_SIZE);
-        assert(comp[0]->name != NULL);
+        comp[0]->name = calAlloc(arena,sizeof(char)*(strlen(name)+1));
         strcpy(comp[0]->name,name);
     }
+    comp[0]->arena = arena;
     comp[0]->nprops = 0;
     comp[0]->prop = NULL;
+    comp[0]->propv = NULL;
     comp[0]->ncomps = 0;
 }
 
-CalError checkReq (CalComp * comp) {
-    CalProp * prop;
-    CalError error;
-    int foundProdId;
-    int foundVersion;
-    char versionVal[100];
-    
-    foundProdId = 0;
-    foundVersion = 0;
-    prop = comp->prop;
-    //search for occurences of PRODID and VERSION
-    while (prop != NULL) {
-        if (strcmp(prop->name,"PRODID")==0) {
-            foundProdId++;         
-        }
-        if (strcmp(prop->name,"VERSION")==0) {
-            foundVersion++;
-            strcpy(versionVal,prop->value);
-        }
-        prop = prop->next;
-    }
-    //set return value based on search
-    if (foundProdId != 1 && foundVersion != 1) {
-        error = BADVER; 
-    } else if (foundVersion != 1 || strcmp(VCAL_VER,versionVal) != 0) {
-        error = BADVER;
-    } else if (foundProdId != 1) {
-        error = NOPROD;
-    } else {
-        error = OK;
+void pushName (CalParser * parser, const char * name, int len) {
+    int depth = ++parser->depth;
+
+    if (len+1 > parser->nameSize[depth]) {
+        parser->name[depth] = realloc(parser->name[depth],len+1);
+        assert(parser->name[depth] != NULL);
+        parser->nameSize[depth] = len+1;
+    }
+    memcpy(parser->name[depth],name,len);
+    parser->name[depth][len] = '\0';
+    stringToUpper(parser->name[depth],len);
+    parser->filled[depth] = 0;
+}
+
+CalStatus stopParser (CalParser * parser, CalStatus status) {
+    parser->done = true;
+    parser->status = status;
+    return status;
+}
+
+CalError checkCal (CalParser * parser) {
+    if (parser->nversion != 1 || !parser->goodVersion) {
+        return BADVER;
+    }
+    if (parser->nprodid != 1) {
+        return NOPROD;
+    }
+    if (parser->ncomps == 0 || !parser->vcomp) {
+        return NOCAL;
     }
-    return error;
+    return OK;
+}
+
+CalPropKind calPropKind(const char *const name, int len) {
+    return findName(propName,NPROP_NAMES,name,len);
 }
 
-CalError checkComps (CalComp * comp) {
-    CalError vCheck;
-    CalError numCheck;
+CalParamKind calParamKind(const char *const name, int len) {
+    return findName(paramName,NPARAM_NAMES,name,len);
+}
 
-    vCheck = NOCAL;
-    numCheck = NOCAL;
+int findName (char *const * table, int size, const char * name, int len) {
+    int low = 1;
+    int high = size-1;
+    int mid, diff;
 
-    for (int i = 0; i<comp->ncomps; i++) {
-        if (comp->comp[i]->name[0] == 'V') {
-            vCheck = OK;
+    while (low <= high) {
+        mid = (low+high)/2;
+        diff = strncasecmp(name,table[mid],len);
+        if (diff == 0 && table[mid][len] != '\0') {
+            diff = -1; //name is a prefix of the entry
         }
-        if (comp->ncomps > 0) {
-            numCheck = OK;
+        if (diff == 0) {
+            return mid;
+        } else if (diff < 0) {
+            high = mid-1;
+        } else {
+            low = mid+1;
         }
     }
-    if (vCheck == OK && numCheck == OK) {
-        return OK;
-    } else { 
-        return NOCAL;
-    }
+    return 0;
 }
 
 /* readCalComp */
 void addComp(CalComp ** rootComp, CalComp * compAdding) {
+    CalArena * arena = (*rootComp)->arena;
+    int slots = 1;
+
+    if (arena == NULL) {
+        (*rootComp)->ncomps++;
+        (*rootComp) = realloc((*rootComp),sizeof(CalComp)+sizeof(CalComp*)*((*rootComp)->ncomps+1));
+        assert((*rootComp) != NULL);
+        (*rootComp)->comp[(*rootComp)->ncomps-1] = compAdding;
+        return;
+    }
+    //arena copies can't be freed, so grow by doubling: slots is the
+    //power of two at or above ncomps
+    while (slots < (*rootComp)->ncomps) {
+        slots = slots*2;
+    }
+    if ((*rootComp)->ncomps+1 > slots) {
+        (*rootComp) = calGrow(arena,(*rootComp),sizeof(CalComp)+sizeof(CalComp*)*slots,
+          sizeof(CalComp)+sizeof(CalComp*)*slots*2);
+    }
     (*rootComp)->ncomps++;
-    (*rootComp) = realloc((*rootComp),sizeof(CalComp)+sizeof(CalComp*)*((*rootComp)->ncomps+1));
-    assert((*rootComp) != NULL);
     (*rootComp)->comp[(*rootComp)->ncomps-1] = compAdding;
 }
 
 void addProp(CalComp * comp, CalProp * prop) {
-    CalProp * nextP;
+    CalProp * holder;
+    int slots;
 
-    nextP = comp->prop;
-    if (nextP != NULL) {
-        while (nextP->next != NULL) {
-            nextP = nextP->next;
+    if (comp->propv == NULL) {
+        //a list built by hand: count it into a new array
+        comp->nprops = 0;
+        for (holder = comp->prop; holder != NULL; holder = holder->next) {
+            comp->nprops++;
+        }
+        comp->propv = calAlloc(comp->arena,sizeof(CalProp*)*arraySlots(comp->nprops+1));
+        holder = comp->prop;
+        for (int i = 0; i < comp->nprops; i++) {
+            comp->propv[i] = holder;
+            holder = holder->next;
         }
-        nextP->next = prop;
     } else {
+        slots = arraySlots(comp->nprops);
+        if (comp->nprops+1 > slots) {
+            comp->propv = calGrow(comp->arena,comp->propv,sizeof(CalProp*)*slots,
+              sizeof(CalProp*)*slots*2);
+        }
+    }
+    if (comp->nprops == 0) {
         comp->prop = prop;
-    } 
+    } else {
+        comp->propv[comp->nprops-1]->next = prop;
+    }
+    comp->propv[comp->nprops] = prop;
     comp->nprops++;
 }
 
+void addParam(CalProp *const prop, CalParam *const param) {
+    CalParam * holder;
+    int slots;
+
+    if (prop->paramv == NULL) {
+        prop->nparams = 0;
+        for (holder = prop->param; holder != NULL; holder = holder->next) {
+            prop->nparams++;
+        }
+        prop->paramv = calAlloc(NULL,sizeof(CalParam*)*arraySlots(prop->nparams+1));
+        holder = prop->param;
+        for (int i = 0; i < prop->nparams; i++) {
+            prop->paramv[i] = holder;
+            holder = holder->next;
+        }
+    } else {
+        slots = arraySlots(prop->nparams);
+        if (prop->nparams+1 > slots) {
+            prop->paramv = calGrow(NULL,prop->paramv,sizeof(CalParam*)*slots,
+              sizeof(CalParam*)*slots*2);
+        }
+    }
+    if (prop->nparams == 0) {
+        prop->param = param;
+    } else {
+        prop->paramv[prop->nparams-1]->next = param;
+    }
+    prop->paramv[prop->nparams] = param;
+    prop->nparams++;
+}
+
+CalProp * calCompProp(const CalComp *const comp, int i) {
+    CalProp * holder;
+
+    if (i < 0 || i >= comp->nprops) {
+        return NULL;
+    }
+    if (comp->propv != NULL) {
+        return comp->propv[i];
+    }
+    holder = comp->prop;
+    while (i > 0 && holder != NULL) {
+        holder = holder->next;
+        i--;
+    }
+    return holder;
+}
+
+CalParam * calPropParam(const CalProp *const prop, int i) {
+    CalParam * holder;
+
+    if (i < 0 || i >= prop->nparams) {
+        return NULL;
+    }
+    if (prop->paramv != NULL) {
+        return prop->paramv[i];
+    }
+    holder = prop->param;
+    while (i > 0 && holder != NULL) {
+        holder = holder->next;
+        i--;
+    }
+    return holder;
+}
+
+int arraySlots (int n) {
+    int slots = 1;
+
+    while (slots < n) {
+        slots = slots*2;
+    }
+    return slots;
+}
+
 /* readCalLine */
 int notBlank(char * temp) {
     int length;
@@ -804,9 +1972,10 @@ int notBlank(char * temp) {
 
 bool clearEOLChars (char * line) {
     int initLength;
+    char * save;
 
     initLength = strlen(line);
-    line = strtok(line,"\r\n");
+    line = strtok_r(line,"\r\n",&save);
     if (line == NULL) {
         return true;
     }
@@ -840,34 +2009,318 @@ void clearBlanks(char * string) {
     }
 }
 
+size_t mapPhysLine (CalMap * map, size_t pos, size_t * next, bool * crlf) {
+    const char * newline;
+    size_t len;
+
+    newline = memchr(map->base+pos,'\n',map->size-pos);
+    if (newline == NULL) { //last line of the file needs no EOL
+        len = map->size-pos;
+        *next = map->size;
+        *crlf = true;
+    } else {
+        len = newline-(map->base+pos);
+        *next = pos+len+1;
+        *crlf = (len > 0 && map->base[pos+len-1] == '\r');
+    }
+    if (len > 0 && map->base[pos+len-1] == '\r') {
+        len--;
+    }
+    return len;
+}
+
+bool blankView (const char * line, size_t len) {
+    if (len > 0 && line[0] == ' ') {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (line[i] != ' ' && line[i] != '\t' && line[i] != '\r') {
+            return false;
+        }
+    }
+    return true;
+}
+
+void growFold (CalMap * map, size_t needed) {
+    if (needed+1 <= map->foldSize) {
+        return;
+    }
+    while (map->foldSize < needed+1) {
+        map->foldSize = (map->foldSize == 0) ? BUFF_SIZE : map->foldSize*2;
+    }
+    map->fold = realloc(map->fold,map->foldSize);
+    assert(map->fold != NULL);
+}
+
 /* parseCalComp */
-void copySubStr (char * dest, char * src, int start, int end) {
+void copySubStr (char * dest, const char * src, int start, int end) {
     for (int i = 0; i<=end-start; i++) {
         dest[i] = src[start+i];
     }
     dest[end-start+1] = '\0';
 }
 
-int checkForSpace (char * string) {
-    for (int i = 0; i < strlen(string); i++) {
-        if (isspace(string[i])) {
+/* delimiters the tokenizer stops at */
+static const bool delimTable[256] = {
+    [';'] = true, [':'] = true, ['='] = true, ['"'] = true, [','] = true,
+};
+
+int scanDelim (const char * buff, int from, int len) {
+    int i = from;
+    unsigned int mask;
+
+#ifdef __AVX2__
+    const __m256i semi32 = _mm256_set1_epi8(';');
+    const __m256i colon32 = _mm256_set1_epi8(':');
+    const __m256i equal32 = _mm256_set1_epi8('=');
+    const __m256i quote32 = _mm256_set1_epi8('"');
+    const __m256i comma32 = _mm256_set1_epi8(',');
+    __m256i chunk32;
+
+    for (; i+32 <= len; i += 32) {
+        chunk32 = _mm256_loadu_si256((const __m256i *)(buff+i));
+        mask = _mm256_movemask_epi8(_mm256_or_si256(
+          _mm256_or_si256(_mm256_cmpeq_epi8(chunk32,semi32),_mm256_cmpeq_epi8(chunk32,colon32)),
+          _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chunk32,equal32),
+          _mm256_cmpeq_epi8(chunk32,quote32)),_mm256_cmpeq_epi8(chunk32,comma32))));
+        if (mask != 0) {
+            return i+__builtin_ctz(mask);
+        }
+    }
+#endif
+#ifdef __SSE2__
+    const __m128i semi = _mm_set1_epi8(';');
+    const __m128i colon = _mm_set1_epi8(':');
+    const __m128i equal = _mm_set1_epi8('=');
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i comma = _mm_set1_epi8(',');
+    __m128i chunk;
+
+    for (; i+16 <= len; i += 16) {
+        chunk = _mm_loadu_si128((const __m128i *)(buff+i));
+        mask = _mm_movemask_epi8(_mm_or_si128(
+          _mm_or_si128(_mm_cmpeq_epi8(chunk,semi),_mm_cmpeq_epi8(chunk,colon)),
+          _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk,equal),_mm_cmpeq_epi8(chunk,quote)),
+          _mm_cmpeq_epi8(chunk,comma))));
+        if (mask != 0) {
+            return i+__builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; i < len; i++) {
+        if (delimTable[(unsigned char)buff[i]]) {
+            return i;
+        }
+    }
+    return len;
+}
+
+void initTokens (PropTokens * tok) {
+    tok->param = tok->paramStore;
+    tok->paramValue = tok->valueStore;
+    tok->paramSize = TOKEN_PARAMS;
+    tok->valueSize = TOKEN_VALUES;
+}
+
+void freeTokens (PropTokens * tok) {
+    if (tok->param != tok->paramStore) {
+        free(tok->param);
+    }
+    if (tok->paramValue != tok->valueStore) {
+        free(tok->paramValue);
+    }
+}
+
+ParamTokens * addParamToken (PropTokens * tok) {
+    if (tok->nparams == tok->paramSize) {
+        tok->paramSize = tok->paramSize*2;
+        if (tok->param == tok->paramStore) {
+            tok->param = malloc(sizeof(ParamTokens)*tok->paramSize);
+            assert(tok->param != NULL);
+            memcpy(tok->param,tok->paramStore,sizeof(tok->paramStore));
+        } else {
+            tok->param = realloc(tok->param,sizeof(ParamTokens)*tok->paramSize);
+            assert(tok->param != NULL);
+        }
+    }
+    tok->nparams++;
+    return &tok->param[tok->nparams-1];
+}
+
+TokenSpan * addValueToken (PropTokens * tok) {
+    if (tok->nvalues == tok->valueSize) {
+        tok->valueSize = tok->valueSize*2;
+        if (tok->paramValue == tok->valueStore) {
+            tok->paramValue = malloc(sizeof(TokenSpan)*tok->valueSize);
+            assert(tok->paramValue != NULL);
+            memcpy(tok->paramValue,tok->valueStore,sizeof(tok->valueStore));
+        } else {
+            tok->paramValue = realloc(tok->paramValue,sizeof(TokenSpan)*tok->valueSize);
+            assert(tok->paramValue != NULL);
+        }
+    }
+    tok->nvalues++;
+    return &tok->paramValue[tok->nvalues-1];
+}
+
+char * copyToken (CalArena * arena, const char * buff, TokenSpan span) {
+    char * toReturn;
+
+    toReturn = calAlloc(arena,span.to-span.from+1);
+    memcpy(toReturn,buff+span.from,span.to-span.from);
+    toReturn[span.to-span.from] = '\0';
+    return toReturn;
+}
+
+int checkForSpace (const char * string, int len) {
+    for (int i = 0; i < len; i++) {
+        if (isspace((unsigned char)string[i])) {
             return 1;
         }
     }
     return 0;
 }
 
-void stringToUpper(char * string) {
-    for (int i = 0; i < strlen(string); i++) {
-        string[i] = toupper(string[i]);
+void stringToUpper(char * string, int len) {
+    for (int i = 0; i < len; i++) {
+        string[i] = toupper((unsigned char)string[i]);
+    }
+}
+
+/* arena */
+CalArena * newCalArena(void) {
+    CalArena * arena;
+
+    arena = malloc(sizeof(CalArena));
+    assert(arena != NULL);
+    arena->block = NULL;
+    arena->root = NULL;
+    arena->last = NULL;
+    return arena;
+}
+
+void * calArenaAlloc(CalArena *const arena, size_t size) {
+    CalBlock * block;
+    size_t blockSize;
+    void * toReturn;
+
+    size = (size+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    block = arena->block;
+    if (block == NULL || block->size-block->used < size) {
+        blockSize = (block == NULL) ? ARENA_BLOCK : block->size*2;
+        if (blockSize > ARENA_BLOCK_MAX) {
+            blockSize = ARENA_BLOCK_MAX;
+        }
+        if (blockSize < size) {
+            blockSize = size;
+        }
+        block = malloc(sizeof(CalBlock)+blockSize);
+        assert(block != NULL);
+        block->next = arena->block;
+        block->size = blockSize;
+        block->used = 0;
+        arena->block = block;
+    }
+    toReturn = block->data+block->used;
+    block->used = block->used+size;
+    arena->last = toReturn;
+    return toReturn;
+}
+
+char * calArenaStr(CalArena *const arena, const char *const str, int len) {
+    char * toReturn;
+
+    toReturn = calArenaAlloc(arena,len+1);
+    memcpy(toReturn,str,len);
+    toReturn[len] = '\0';
+    return toReturn;
+}
+
+void freeCalArena(CalArena *const arena) {
+    CalBlock * block;
+    CalBlock * next;
+
+    block = arena->block;
+    while (block != NULL) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+void resetCalArena(CalArena *const arena) {
+    CalBlock * block;
+    CalBlock * next;
+
+    //keep the newest (largest) block for reuse
+    if (arena->block == NULL) {
+        return;
+    }
+    block = arena->block->next;
+    while (block != NULL) {
+        next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->block->next = NULL;
+    arena->block->used = 0;
+    arena->last = NULL;
+}
+
+void * calAlloc (CalArena * arena, size_t size) {
+    void * toReturn;
+
+    if (arena != NULL) {
+        return calArenaAlloc(arena,size);
+    }
+    toReturn = malloc(size);
+    assert(toReturn != NULL);
+    return toReturn;
+}
+
+void * calGrow (CalArena * arena, void * ptr, size_t oldSize, size_t newSize) {
+    CalBlock * block;
+    void * toReturn;
+
+    if (arena == NULL) {
+        toReturn = realloc(ptr,newSize);
+        assert(toReturn != NULL);
+        return toReturn;
+    }
+    oldSize = (oldSize+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    newSize = (newSize+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+    block = arena->block;
+    //the newest allocation can simply take more of its block
+    if (ptr == arena->last && block->size-block->used >= newSize-oldSize) {
+        block->used = block->used+newSize-oldSize;
+        return ptr;
+    }
+    toReturn = calArenaAlloc(arena,newSize);
+    memcpy(toReturn,ptr,oldSize);
+    return toReturn;
+}
+
+void moveCompArena (CalComp * comp, CalArena * arena) {
+    comp->arena = arena;
+    for (int i = 0; i < comp->ncomps; i++) {
+        moveCompArena(comp->comp[i],arena);
     }
 }
 
-void initParam (CalParam * newParam) {    
-    newParam->name = NULL;
-    newParam->next = NULL;
-    newParam->nvalues = 0;
-    newParam->value[0] = NULL;
+void adoptArena (CalArena * arena, CalArena * from) {
+    CalBlock * block;
+
+    //behind the block being filled, so allocation carries on in it
+    if (from->block != NULL) {
+        block = from->block;
+        while (block->next != NULL) {
+            block = block->next;
+        }
+        block->next = arena->block->next;
+        arena->block->next = from->block;
+    }
+    free(from);
 }
 
 /* calCompFree */
@@ -876,8 +2329,12 @@ void freeProp (CalProp * prop) {
     CalParam * holder;
 
     holder = prop->param;
-    free(prop->name);
+    //shared names aren't ours to free
+    if (prop->kind <= PROP_OTHER || prop->kind >= NPROP_NAMES || prop->name != propName[prop->kind]) {
+        free(prop->name);
+    }
     free(prop->value);
+    free(prop->paramv);
 
     while (holder != NULL) {
         nextParam = holder->next;
@@ -889,7 +2346,10 @@ void freeProp (CalProp * prop) {
 }
 
 void freeParam (CalParam * param) {   
-    free(param->name);
+    if (param->kind <= PARAM_OTHER || param->kind >= NPARAM_NAMES 
+      || param->name != paramName[param->kind]) {
+        free(param->name);
+    }
     for (int i = 0; i < param->nvalues; i++) {
         free(param->value[i]);
     }
@@ -11,16 +11,100 @@ writeCalComp added for A2.
 #define CALUTIL_H A2
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <time.h>       // time_t cached in CalProp
 
 #define FOLD_LEN 75     // fold lines longer than this length (RFC 5545 3.1)
 #define VCAL_VER "2.0"  // version of standard accepted
 
 
+/* Well-known names. The reader points the name of each RFC 5545
+   property and parameter at one shared, read-only copy and sets its
+   kind, so they can be told apart with an integer compare. Other names
+   (X- and IANA) get their own copy and kind PROP_OTHER/PARAM_OTHER.
+   Shared names must not be written into or freed; freeCalComp skips
+   them. */
+
+typedef enum {
+    PROP_OTHER = 0,
+    PROP_ACTION,
+    PROP_ATTACH,
+    PROP_ATTENDEE,
+    PROP_CALSCALE,
+    PROP_CATEGORIES,
+    PROP_CLASS,
+    PROP_COMMENT,
+    PROP_COMPLETED,
+    PROP_CONTACT,
+    PROP_CREATED,
+    PROP_DESCRIPTION,
+    PROP_DTEND,
+    PROP_DTSTAMP,
+    PROP_DTSTART,
+    PROP_DUE,
+    PROP_DURATION,
+    PROP_EXDATE,
+    PROP_FREEBUSY,
+    PROP_GEO,
+    PROP_LAST_MODIFIED,
+    PROP_LOCATION,
+    PROP_METHOD,
+    PROP_ORGANIZER,
+    PROP_PERCENT_COMPLETE,
+    PROP_PRIORITY,
+    PROP_PRODID,
+    PROP_RDATE,
+    PROP_RECURRENCE_ID,
+    PROP_RELATED_TO,
+    PROP_REPEAT,
+    PROP_REQUEST_STATUS,
+    PROP_RESOURCES,
+    PROP_RRULE,
+    PROP_SEQUENCE,
+    PROP_STATUS,
+    PROP_SUMMARY,
+    PROP_TRANSP,
+    PROP_TRIGGER,
+    PROP_TZID,
+    PROP_TZNAME,
+    PROP_TZOFFSETFROM,
+    PROP_TZOFFSETTO,
+    PROP_TZURL,
+    PROP_UID,
+    PROP_URL,
+    PROP_VERSION,
+} CalPropKind;
+
+typedef enum {
+    PARAM_OTHER = 0,
+    PARAM_ALTREP,
+    PARAM_CN,
+    PARAM_CUTYPE,
+    PARAM_DELEGATED_FROM,
+    PARAM_DELEGATED_TO,
+    PARAM_DIR,
+    PARAM_ENCODING,
+    PARAM_FBTYPE,
+    PARAM_FMTTYPE,
+    PARAM_LANGUAGE,
+    PARAM_MEMBER,
+    PARAM_PARTSTAT,
+    PARAM_RANGE,
+    PARAM_RELATED,
+    PARAM_RELTYPE,
+    PARAM_ROLE,
+    PARAM_RSVP,
+    PARAM_SENT_BY,
+    PARAM_TZID,
+    PARAM_VALUE,
+} CalParamKind;
+
 /* data structures for ICS file in memory */
 
 typedef struct CalParam CalParam;
 typedef struct CalParam {    // property's parameter
     char *name;         // uppercase
+    CalParamKind kind;  // PARAM_OTHER unless name is well-known
     CalParam *next;     // linked list of parameters (ends with NULL)
     int nvalues;        // no. of values
     char *value[];      // uppercase or "..." (flexible array member)
@@ -29,17 +113,26 @@ typedef struct CalParam {    // property's parameter
 typedef struct CalProp CalProp;
 typedef struct CalProp {    // (sub)component's property (=contentline)
     char *name;         // uppercase
+    CalPropKind kind;   // PROP_OTHER unless name is well-known
     char *value;
     int nparams;        // no. of parameters
     CalParam *param;    // -> first parameter (or NULL)
+    CalParam **paramv;  // the same parameters, in an array (or NULL)
     CalProp *next;      // linked list of properties (ends with NULL)
+    time_t time;        // value cached by calPropTime
+    bool timed;         // time has been worked out
+    unsigned long zones;    // for a TZID time, the zones it was read with
 } CalProp;
 
+typedef struct CalArena CalArena;  // block allocator owning a whole tree
+
 typedef struct CalComp CalComp;
 typedef struct CalComp {    // calendar's (sub)component
     char *name;         // uppercase
     int nprops;         // no. of properties
     CalProp *prop;      // -> first property (or NULL)
+    CalProp **propv;    // the same properties, in an array (or NULL)
+    CalArena *arena;    // arena the tree lives in (NULL if malloced)
     int ncomps;         // no. of subcomponents
     CalComp *comp[];    // component pointers (flexible array member)
 } CalComp;
@@ -65,6 +158,36 @@ typedef struct {
     int linefrom, lineto;   // line numbers where error occurred
 } CalStatus;    
 
+/* Memory-mapped input. Content lines are handed out as views into the
+   mapping; only lines that are folded get copied (into fold). A map can
+   also be opened over the caller's own buffer, which is read in place. */
+
+typedef struct CalMap {
+    const char *base;   // start of mapping
+    bool mapped;        // base came from mmap (else it's the caller's)
+    size_t size;        // bytes mapped
+    size_t pos;         // offset of next physical line
+    size_t start;       // file offset reading started at
+    int lineNumber;     // physical lines consumed so far
+    char *fold;         // scratch for unfolded lines (reused)
+    int foldSize;       // bytes allocated for fold
+} CalMap;
+
+/* Writer context. writeCalComp and the other writeCal functions share
+   one static CalWriter, so their line count runs on across calls; each
+   CalWriter counts on its own. A call's output is gathered in buffer and
+   written with one fwrite (or one per WRITE_BUFF bytes), so nothing is
+   left pending between calls. */
+
+#define WRITE_BUFF 32768    // bytes a CalWriter gathers before writing
+
+typedef struct CalWriter {
+    FILE *ics;          // output
+    CalStatus status;   // lines written so far (IOERR once a write fails)
+    size_t used;        // bytes waiting in buffer
+    char buffer[WRITE_BUFF];
+} CalWriter;
+
 typedef enum {
     NOTHING=0,
     MALLOCED,
@@ -78,9 +201,98 @@ CalStatus readCalFile( FILE *const ics, CalComp **const pcomp );
 CalStatus readCalComp( FILE *const ics, CalComp **const pcomp );
 CalStatus readCalLine( FILE *const ics, char **const pbuff );
 CalError parseCalProp( char *const buff, CalProp *const prop );
+CalError parseCalPropLen( const char *const buff, int len, CalProp *const prop );
+CalPropKind calPropKind( const char *const name, int len );
+CalParamKind calParamKind( const char *const name, int len );
 CalStatus writeCalComp( FILE *const ics, const CalComp *comp );
+CalStatus writeCalBegin( FILE *const ics, const CalComp *comp );
+CalStatus writeCalProp( FILE *const ics, const CalProp *prop );
+CalStatus writeCalEnd( FILE *const ics, const CalComp *comp );
 void freeCalComp( CalComp *const comp );
 
+/* Mapped reader functions. readCalFileParallel cuts a mapped calendar
+   at its top-level BEGIN lines and reads the pieces on nthreads threads
+   (0: one per CPU), giving the same tree and status as readCalFile.
+   readCalBuffer does the same for a calendar already in memory, reading
+   it where it is; the tree doesn't point into it, so the buffer need
+   only last for the call. */
+
+CalStatus readCalFileMapped( FILE *const ics, CalComp **const pcomp );
+CalStatus readCalFileParallel( FILE *const ics, CalComp **const pcomp, int nthreads );
+CalStatus readCalBuffer( const char *const buff, size_t len, CalComp **const pcomp, int nthreads );
+CalStatus openCalMap( FILE *const ics, CalMap *const map );
+void openCalBuffer( const char *const buff, size_t len, CalMap *const map );
+CalStatus readCalMapLine( CalMap *const map, const char **const pline, int *const plen );
+bool calMapAtEnd( CalMap *const map );
+void closeCalMap( CalMap *const map );
+
+/* Event-driven reading. A CalParser hands a calendar out one component
+   boundary or property at a time, with the same checks, error codes and
+   line numbers as readCalFile, so a file can be processed without
+   building its tree. Properties come from the arena given, or with a
+   NULL arena from scratch space reused once the next event is read.
+   readCalEventComp reads the rest of the component an EVBEGIN opened
+   into a tree, which lasts as long as its properties would. */
+
+typedef enum {
+    EVBEGIN = 0,    // BEGIN:name opened a component
+    EVPROP,         // property of the innermost open component
+    EVEND,          // END:name closed it
+    EVDONE,         // calendar read and checked (or reading stopped)
+} CalEventKind;
+
+typedef struct CalEvent {
+    CalEventKind kind;
+    int depth;          // 1 = VCALENDAR, 2 = its components, 3 = subcomponents
+    const char *name;   // component name, uppercase (EVBEGIN, EVEND)
+    CalProp *prop;      // property (EVPROP)
+} CalEvent;
+
+typedef struct CalParser CalParser;
+
+typedef struct CalHandler {     // readCalEvents callbacks (any may be NULL)
+    void *data;         // passed back to every callback
+    CalError (*onBeginComponent)( void *data, const char *name, int depth );
+    CalError (*onProperty)( void *data, CalProp *prop, int depth );
+    CalError (*onEndComponent)( void *data, const char *name, int depth );
+} CalHandler;
+
+CalParser *newCalParser( FILE *const ics, CalArena *const arena );
+CalStatus readCalEvent( CalParser *const parser, CalEvent *const event );
+CalStatus readCalEventComp( CalParser *const parser, const CalEvent *const begin, CalComp **const pcomp );
+void freeCalParser( CalParser *const parser );
+CalStatus readCalEvents( FILE *const ics, CalArena *const arena, const CalHandler *const handler );
+
+/* Reentrant versions of the file I/O functions: all their state lives in
+   the CalParser or CalWriter passed, so any number can run at once */
+
+CalStatus readCalLineFrom( CalParser *const parser, char **const pbuff );
+CalStatus readCalCompFrom( CalParser *const parser, CalComp **const pcomp );
+void initCalWriter( CalWriter *const writer, FILE *const ics );
+CalStatus calWriteComp( CalWriter *const writer, const CalComp *comp );
+CalStatus calWriteBegin( CalWriter *const writer, const CalComp *comp );
+CalStatus calWriteProp( CalWriter *const writer, const CalProp *prop );
+CalStatus calWriteEnd( CalWriter *const writer, const CalComp *comp );
+
+/* Properties and parameters are kept both as lists and, in the same
+   order, in arrays grown by doubling: comp->propv[0..nprops-1] and
+   prop->paramv[0..nparams-1]. addProp and addParam append to both in
+   constant time; lists built by hand (array NULL) get their array on
+   the first append. addParam is for malloced properties. calCompProp
+   and calPropParam index either layout. */
+
 void addProp(CalComp * comp, CalProp * prop);
+void addParam( CalProp *const prop, CalParam *const param );
+CalProp * calCompProp( const CalComp *const comp, int i );
+CalParam * calPropParam( const CalProp *const prop, int i );
+
+/* Arena functions. Trees read by readCalFile live in an arena owned by
+   the root, so freeCalComp(root) releases the whole tree at once. */
+
+CalArena *newCalArena( void );
+void *calArenaAlloc( CalArena *const arena, size_t size );
+char *calArenaStr( CalArena *const arena, const char *const str, int len );
+void resetCalArena( CalArena *const arena );
+void freeCalArena( CalArena *const arena );
 
 #endif
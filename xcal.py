@@ -6,9 +6,11 @@
 #0658817
 #
 # - Added database functionality for A4
+# - Info, extract, filter and combine run in CalModule, not through caltool
 
 import string
 import sys
+import time
 import CalModule
 import subprocess
 import getpass
@@ -35,9 +37,10 @@ class view(Frame):
         self.inFVP = list()
         self.todoSel = dict()
         self.undoes = list()
+        self.undoCal = None
         self.activeICS = ""
+        self.reading = None
         self.unsaved = 0
-        self.prevPrint = 0
         self.fileFrame = FilePanel(self)
         self.logFrame = LogPanel(self)
         self.menus() 
@@ -179,10 +182,11 @@ class view(Frame):
         self.connect.commit()
 
     def addEvent(self,index,orgId):
-        summary = self.calFile[index+3]
+        comp = self.calFile[index]
+        summary = comp.value("SUMMARY","")
         if (summary == ""):
             return
-        dateToParse = self.calFile[index+6]
+        dateToParse = comp.value("DTSTART","")
         if (dateToParse == ""):
             date = datetime.datetime(2016,5,8)
         else:
@@ -190,7 +194,7 @@ class view(Frame):
             int(dateToParse[6:8]),int(dateToParse[9:11]),
             int(dateToParse[11:13]),int(dateToParse[13:15]))
 
-        location = self.calFile[index+7]
+        location = comp.value("LOCATION","")
         checkQ = """SELECT event_id FROM EVENT WHERE \
                     summary = %s AND start_time = %s"""
         self.cursor.execute(checkQ,(summary,date))
@@ -204,10 +208,11 @@ class view(Frame):
 
 
     def addTodo(self,index,orgId):
-        summary = self.calFile[index+3]
+        comp = self.calFile[index]
+        summary = comp.value("SUMMARY","")
         if (summary == ""):
             return
-        priority = self.calFile[index+6]
+        priority = comp.value("PRIORITY","")
         checkQ = """SELECT todo_id FROM TODO WHERE \
                     summary = %s"""
         self.cursor.execute(checkQ,(summary,))
@@ -221,9 +226,11 @@ class view(Frame):
 
     def storeOne(self,index):
         orgId = None
-        if (self.calFile[index+4] != ""):
-            orgName = self.calFile[index+4]
-            orgContact = self.calFile[index+5]
+        comp = self.calFile[index]
+        organizer = comp.prop("ORGANIZER")
+        if (organizer != None and organizer.param("CN","") != ""):
+            orgName = organizer.param("CN")
+            orgContact = organizer.value
             orgQuery = """SELECT org_id \
                         FROM ORGANIZER \
                         WHERE name = %s  AND contact = %s"""
@@ -234,10 +241,10 @@ class view(Frame):
             self.cursor.execute(orgQuery,(orgName,orgContact))
             result = self.cursor.fetchall()
             orgId = result[0][0]
-        if (self.calFile[index] == "VEVENT"): 
+        if (comp.name == "VEVENT"): 
             self.addEvent(index,orgId)
             self.activateClear()
-        elif (self.calFile[index] == "VTODO"):
+        elif (comp.name == "VTODO"):
             self.addTodo(index,orgId) 
             self.activateClear()
 
@@ -248,7 +255,7 @@ class view(Frame):
         self.printStatus()
 
     def storeAll(self):
-        for index in range(1,len(self.calFile),8):
+        for index in range(len(self.calFile)):
             self.storeOne(index)
         self.printStatus()
 
@@ -281,62 +288,76 @@ class view(Frame):
         fileName = fd.go()
         if (fileName == None):
             return
-        os.system("./caltool -info < " + fileName + " > tempOut 2> tempErr")
-        infoCheck = self.checkTemps(1,fileName)
-        if (infoCheck == 2):
+        #a big file is read in the background so the window keeps responding
+        self.reading = CalModule.readFileAsync(fileName)
+        self.after(20,self.checkReading,self.reading,fileName)
+
+    def checkReading (self,reading,fileName):
+        if (reading is not self.reading):
+            return
+        if (not reading.done()):
+            self.after(20,self.checkReading,reading,fileName)
+            return
+        self.reading = None
+        try:
+            result = reading.result()
+        except (OSError,ValueError) as err:
+            self.logError(err,fileName)
             return
+        self.logText(self.infoText(CalModule.info(result)))
         self.fileFrame.showSelBtn.config(state="disabled") 
         self.master.title(self.nameFromPath(fileName));
         self.activeICS = fileName
-        self.activateBtns()
-        self.readNewCal(fileName)
         self.unsaved = 0
+        self.showNewCal(result)
+        self.activateBtns()
 
-    def readNewCal (self,fileName):
+    def infoText(self,info):
+        def count(n,one,many):
+            return str(n) + " " + (one if n == 1 else many)
+        text = count(info["lines"],"line","lines") + "\n"
+        text = text + count(info["components"],"component","components") + ": "
+        text = text + count(info["events"],"event","events") + ", "
+        text = text + count(info["todos"],"todo","todos") + ", "
+        text = text + count(info["others"],"other","others") + "\n"
+        text = text + count(info["subcomponents"],"subcomponent","subcomponents") + "\n"
+        text = text + count(info["properties"],"property","properties") + "\n"
+        if (info["from"] == None):
+            text = text + "No dates\n"
+        else:
+            text = text + "From " + time.strftime("%Y-%b-%d",time.localtime(info["from"]))
+            text = text + " to " + time.strftime("%Y-%b-%d",time.localtime(info["to"])) + "\n"
+        if (len(info["organizers"]) == 0):
+            text = text + "No organizers\n"
+        else:
+            text = text + "Organizers:\n"
+            for name in info["organizers"]:
+                text = text + name + "\n"
+        return text
+
+    def showNewCal (self,result):
         self.inFVP.clear()      
-        result = []
-        status = CalModule.readFile(fileName,result); 
-        compNum = 1
         self.fileFrame.tree.delete(*self.fileFrame.tree.get_children())
-        for index in range(1,len(result),8):
+        for index, comp in enumerate(result):
             self.fileFrame.tree.insert('','end',iid=index,
-            values=(compNum,result[index],result[index+1],result[index+2],result[index+3]))
-            self.inFVP.append(compNum-1)
-            compNum += 1
-        if (self.calFile != None):
-            CalModule.freeFile(self.calFile[0]);        
+            values=(index+1,comp.name,comp.nprops,comp.ncomps,comp.value("SUMMARY","")))
+            self.inFVP.append(index)
         self.calFile = result
-        lines = CalModule.writeFile("tempCal",self.calFile[0],self.inFVP)        
-        self.correctLines(lines) 
-
-    def checkTemps(self,checkOut,fileName):
-        if (checkOut == 1):    
-            tempOut = open("tempOut","r")
-            outStr = tempOut.read()
-            self.logFrame.log.insert(INSERT,outStr)
-            self.logFrame.log.see(END)
-        tempErr = open("tempErr","r")
-        errStr = tempErr.read()
-        if (errStr == ""):
-            return 1
-        else:
-            if (fileName != None):
-                errStr = errStr.rstrip()
-                errStr = errStr + " for file " + self.nameFromPath(fileName) + "\n"
-            self.logFrame.log.insert(INSERT,errStr)
-            self.logFrame.log.see(END)
-            return 2   
-
-    def correctLines(self,lines):
-        lines =  lines - self.prevPrint
-        self.prevPrint = self.prevPrint + lines
-        return lines 
+
+    def logText(self,text):
+        self.logFrame.log.insert(INSERT,text)
+        self.logFrame.log.see(END)
+
+    def logError(self,err,fileName):
+        errStr = str(err)
+        if (fileName != None):
+            errStr = errStr + " for file " + self.nameFromPath(fileName)
+        self.logText(errStr + "\n")
 
     def save(self):
         if (self.calFile == None):
             return
-        lines = CalModule.writeFile(self.activeICS,self.calFile[0],self.inFVP)
-        lines = self.correctLines(lines)
+        lines = CalModule.writeFile(self.activeICS,self.calFile,self.inFVP)
         if (lines == -1):
             lines = 0
             report = "Save failed."
@@ -356,32 +377,38 @@ class view(Frame):
         fileName = fd.go()
         if (fileName == None):
             return
-        os.system("./caltool -combine "+fileName+" < tempCal > tempOut 2> tempErr")
-        check = self.checkTemps(0,fileName)
-        if (check == 1):
-            self.readNewCal("tempOut")
-            self.changes()
+        try:
+            other = CalModule.readFile(fileName)
+        except (OSError,ValueError) as err:
+            self.logError(err,fileName)
+            return
+        combined, dropped = CalModule.combine(self.calFile,other)
+        if (dropped > 0):
+            self.logText("combine: " + str(dropped) + " duplicate components dropped\n")
+        self.showNewCal(combined)
+        self.changes()
     def filter(self):
         def subFilter():
+            fromTime = None
+            toTime = None
             if (controlVar.get() == 1):
                 filterFlag = "t"
-                timeString =""
             else:
                 filterFlag = "e"
-                fromTime = fromBox.get("1.0",END).rstrip()
-                toTime = toBox.get("1.0",END).rstrip()
-                if (fromTime != "" or toTime != ""):
-                    timeString = " "
-                    if (fromTime != ""):
-                        timeString = timeString + "from \""+fromTime+"\""
-                    if (toTime != ""):
-                        if (fromTime != ""):
-                            timeString = timeString + " "
-                        timeString = timeString + "to \""+toTime+"\""
-            os.system("./caltool -filter "+filterFlag+timeString+" < tempCal > tempOut 2> tempErr")
-            check = self.checkTemps(0,None)
-            if (check == 1):
-                self.readNewCal("tempOut")
+                if (fromBox.get("1.0",END).rstrip() != ""):
+                    fromTime = fromBox.get("1.0",END).rstrip()
+                if (toBox.get("1.0",END).rstrip() != ""):
+                    toTime = toBox.get("1.0",END).rstrip()
+            try:
+                filtered = CalModule.filter(self.calFile,filterFlag,fromTime,toTime)
+            except ValueError as err:
+                self.logError(err,None)
+                filterWin.destroy()
+                return
+            if (len(filtered) == 0):
+                self.logText("No components found by filter\n")
+            else:
+                self.showNewCal(filtered)
                 self.changes()
             filterWin.destroy()
         def cancel():
@@ -419,18 +446,8 @@ class view(Frame):
         message="Close program? All unsaved changes will be lost.")
         if (leave == False):
             return
-        if (self.calFile != None):
-            CalModule.freeFile(self.calFile[0]);
         root.destroy()
         self.connect.close()
-        if (os.path.isfile("tempErr")):
-            os.remove("tempErr")
-        if (os.path.isfile("tempCal")):
-            os.remove("tempCal")
-        if (os.path.isfile("tempOut")):
-            os.remove("tempOut")
-        if (os.path.isfile("tempUndo")):
-            os.remove("tempUndo")
 
     def changes(self):
         self.master.title(self.nameFromPath(self.activeICS+"*"))
@@ -621,10 +638,10 @@ class view(Frame):
         self.todoWindow.title("To-do List")
         self.todoSel.clear()
         rowCount = 1
-        for index in range(1,len(calFile),8):
-            if (calFile[index] == "VTODO"):
+        for index, comp in enumerate(calFile):
+            if (comp.name == "VTODO"):
                 self.todoSel[index]=IntVar()
-                c = Checkbutton(frame,text=calFile[index+3],
+                c = Checkbutton(frame,text=comp.value("SUMMARY",""),
                 variable=self.todoSel[index],command=activeDone) 
                 c.pack() 
 
@@ -638,16 +655,13 @@ class view(Frame):
         frame.bind("<Configure>",setConfig) 
 
     def updateFromTodo(self):
-        lines = CalModule.writeFile("tempUndo",self.calFile[0],self.inFVP)
-        self.correctLines(lines)
+        self.undoCal = CalModule.writeBuffer(self.calFile,self.inFVP)
         for index in self.todoSel:
             if (self.todoSel[index].get() == 1):
-                self.undoes.append((int(index/4)+1,index))
-                self.inFVP.remove(int(index/4))
+                self.undoes.append((index+1,index))
+                self.inFVP.remove(index)
         self.todoSel.clear()
-        lines = CalModule.writeFile("tempCal",self.calFile[0],self.inFVP)
-        self.correctLines(lines)
-        self.readNewCal("tempCal")
+        self.showNewCal(CalModule.readBuffer(CalModule.writeBuffer(self.calFile,self.inFVP)))
         self.changes()
         self.todoMenu.entryconfig("Undo...",state="normal")
         self.todoWindow.destroy()
@@ -659,7 +673,7 @@ class view(Frame):
         message="Restore all removed components since last save?")
         if (undoC == False):
             return
-        self.readNewCal("tempUndo")
+        self.showNewCal(CalModule.readBuffer(self.undoCal))
         self.todoMenu.entryconfig("Undo...",state="disabled")
         self.undoes.clear()    
 
@@ -711,15 +725,20 @@ class FilePanel(Frame):
         def showSel():
             curItem = self.tree.focus()
             compRef = self.tree.item(curItem)['values'][0]-1
-            lines = CalModule.writeFile("tempOut",master.calFile[0],[compRef])
-            master.correctLines(lines)
-            master.checkTemps(1,None)
+            text = CalModule.writeBuffer(master.calFile,[compRef])
+            master.logText(text.decode("utf-8","replace").replace("\r\n","\n"))
         def extractEv():
-            os.system("./caltool -extract e < tempCal > tempOut 2> tempErr")
-            master.checkTemps(1,None)
+            text = ""
+            for when, summary in CalModule.extractEvents(master.calFile):
+                stamp = time.localtime(when)
+                text = text + time.strftime("%Y-%b-%d %l:%M ",stamp)
+                text = text + ("PM" if stamp.tm_hour > 11 else "AM") + ": " + summary + "\n"
+            master.logText(text)
         def extractX():
-            os.system("./caltool -extract x < tempCal > tempOut 2> tempErr")
-            master.checkTemps(1,None)
+            text = ""
+            for name in CalModule.extractProps(master.calFile):
+                text = text + name + "\n"
+            master.logText(text)
 
         self.fileFrame = Frame(root,relief=RAISED)
         self.fileFrame.grid(row=1,column=1,sticky=NSEW)